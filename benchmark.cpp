@@ -0,0 +1,110 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <cmath>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <vector>
+
+#include "imageio.h"
+#include "scene.h"
+
+/*
+* Root mean square error over the RGB channels, clamped to [0, 1] first so a few fireflies on a light source
+* do not outweigh the noise everywhere else
+*/
+static double computeRMSE(const std::vector<glm::vec4>& image, const std::vector<glm::vec4>& reference) {
+	double sum = 0.0;
+	for (size_t i = 0; i < image.size(); i++) {
+		for (int c = 0; c < 3; c++) {
+			double diff = std::min(std::max(image[i][c], 0.0f), 1.0f) - std::min(std::max(reference[i][c], 0.0f), 1.0f);
+			sum += diff * diff;
+		}
+	}
+	return std::sqrt(sum / std::max<size_t>(image.size() * 3, 1));
+}
+
+/*
+* Renders one scene on one backend, every run gets a fresh Scene so nothing carries over between them
+* pathStats makes the GPU count its rays, which waits for every frame, returns false if the scene cannot be loaded
+*/
+static bool renderScene(GLFWwindow* window, bool useCPU, const std::string& name, unsigned int spp, bool pathStats, unsigned int scrambleSeed,
+	std::vector<glm::vec4>& pixels, Scene::RenderStats& stats) {
+	Scene* scene = new Scene((useCPU) ? nullptr : window, useCPU, name);
+	if (!scene->isValid()) {
+		delete scene;
+		return false;
+	}
+	scene->denoise = false;
+	scene->pathStats = pathStats;
+	scene->cpuTracer->scrambleSeed = scrambleSeed;
+	scene->render(spp, pixels, stats);
+	delete scene;
+	return true;
+}
+
+// Scene files are stored under their name without directory and extension
+static std::string referenceFile(const std::string& directory, const std::string& name) {
+	return directory + "/" + std::filesystem::path(name).stem().string() + ".hdr";
+}
+
+static bool writeReference(const std::string& name, const std::string& filename) {
+	std::cout << "Rendering the " << name << " reference at " << REFERENCE_SPP << " spp on the CPU" << std::endl;
+	std::vector<glm::vec4> pixels;
+	Scene::RenderStats stats;
+	if (!renderScene(nullptr, true, name, REFERENCE_SPP, false, REFERENCE_SCRAMBLE_SEED, pixels, stats)) return false;
+	return writeImage(filename, BENCHMARK_WIDTH, BENCHMARK_HEIGHT, pixels);
+}
+
+int runBenchmarks(GLFWwindow* window, const BenchmarkOptions& options) {
+	std::vector<std::string> scenes = Scene::SCENE_NAMES;
+	if (!options.scene.empty()) scenes = { options.scene };
+
+	if (options.updateReferences) {
+		std::error_code error;
+		std::filesystem::create_directories(options.directory, error);
+		for (const std::string& name : scenes) {
+			if (!writeReference(name, referenceFile(options.directory, name))) return 1;
+		}
+	}
+
+	std::cout << std::left << std::setw(12) << "Scene" << std::setw(9) << "Backend" << std::right
+		<< std::setw(10) << "Time (s)" << std::setw(14) << "Samples/s (M)" << std::setw(12) << "Rays/s (M)" << std::setw(10) << "RMSE" << std::endl;
+
+	bool missingReference = false;
+	for (const std::string& name : scenes) {
+		std::vector<glm::vec4> reference;
+		unsigned int refWidth = 0, refHeight = 0;
+		bool hasReference = readImage(referenceFile(options.directory, name), refWidth, refHeight, reference)
+			&& refWidth == BENCHMARK_WIDTH && refHeight == BENCHMARK_HEIGHT;
+		missingReference = missingReference || !hasReference;
+
+		for (int backend = 0; backend < 2; backend++) {
+			bool useCPU = backend == 0;
+			if (!useCPU && window == nullptr) continue;
+
+			std::vector<glm::vec4> pixels;
+			Scene::RenderStats stats;
+			if (!renderScene(window, useCPU, name, options.spp, false, 0, pixels, stats)) return 1;
+			// The sequences are deterministic, so the counting run traces exactly the rays of the timed one
+			if (!useCPU) {
+				std::vector<glm::vec4> countedPixels;
+				Scene::RenderStats countedStats;
+				renderScene(window, useCPU, name, options.spp, true, 0, countedPixels, countedStats);
+				stats.numRays = countedStats.numRays;
+			}
+
+			std::cout << std::left << std::setw(12) << std::filesystem::path(name).stem().string() << std::setw(9) << ((useCPU) ? "CPU" : "GPU") << std::right << std::fixed
+				<< std::setprecision(3) << std::setw(10) << stats.seconds
+				<< std::setprecision(2) << std::setw(14) << stats.numSamples / stats.seconds / 1e6
+				<< std::setw(12) << stats.numRays / stats.seconds / 1e6;
+			if (hasReference) std::cout << std::setprecision(5) << std::setw(10) << computeRMSE(pixels, reference);
+			else std::cout << std::setw(10) << "-";
+			std::cout << std::defaultfloat << std::endl;
+		}
+	}
+
+	if (missingReference) std::cout << "Scenes without a " << BENCHMARK_WIDTH << "x" << BENCHMARK_HEIGHT << " reference in " << options.directory << " have no RMSE, --benchmark-reference renders them" << std::endl;
+	return 0;
+}
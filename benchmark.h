@@ -0,0 +1,30 @@
+#pragma once
+
+#include <string>
+
+#include <GLFW/glfw3.h>
+
+/*
+	Benchmark suite over the canonical scenes in Scene::SCENE_NAMES
+	- Every scene is rendered from its fixed camera at BENCHMARK_WIDTH x BENCHMARK_HEIGHT, without the denoiser
+	- Each backend reports its time, samples/sec, rays/sec and the RMSE against a reference image of the scene
+	- References are REFERENCE_SPP CPU renders stored as <directory>/<scene>.hdr, made with updateReferences
+	- GPU rays are counted in a second, untimed render, counting them in the timed one would read them back every frame
+*/
+
+static const unsigned int BENCHMARK_WIDTH = 256, BENCHMARK_HEIGHT = 256;
+static const unsigned int BENCHMARK_SPP = 64;
+static const unsigned int REFERENCE_SPP = 4096;
+// Scramble seed of the references, the measured renders use the default sequences so they are not a prefix of the reference
+static const unsigned int REFERENCE_SCRAMBLE_SEED = 0x5eed;
+
+struct BenchmarkOptions {
+	std::string directory = "benchmarks";
+	std::string scene;	// Empty runs every scene
+	unsigned int spp = BENCHMARK_SPP;
+	bool updateReferences = false;
+};
+
+// window provides the GL context of the GPU runs, without one only the CPU backend is measured
+// The globals have to be set to the benchmark resolution before the window is created, returns the exit code
+int runBenchmarks(GLFWwindow* window, const BenchmarkOptions& options);
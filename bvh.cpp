@@ -0,0 +1,204 @@
+#include "bvh.h"
+
+#include <algorithm>
+
+void BVH::build(const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads) {
+	prims.clear();
+	nodes.clear();
+	primRefs.clear();
+
+	unsigned int counts[3] = { (unsigned int)spheres.size(), (unsigned int)triangles.size(), (unsigned int)quads.size() };
+	for (unsigned int type = PRIM_SPHERE; type <= PRIM_QUAD; type++) {
+		for (unsigned int i = 0; i < counts[type]; i++) {
+			PrimInfo prim;
+			prim.ref = makePrimRef(type, i);
+			if (!primitiveBounds(prim.ref, spheres, triangles, quads, prim.bounds, prim.centroid)) continue;
+			prims.push_back(prim);
+		}
+	}
+
+	// A binary tree with N leaves has at most 2N - 1 nodes
+	nodes.reserve(std::max<size_t>(1, prims.size() * 2));
+	nodes.push_back(BVHNode());
+	subdivide(0, 0, (unsigned int)prims.size(), 0);
+
+	primRefs.resize(prims.size());
+	for (unsigned int i = 0; i < prims.size(); i++) {
+		primRefs[i] = prims[i].ref;
+	}
+	prims.clear();
+	prims.shrink_to_fit();
+}
+
+/*
+* Recomputes the bounds of every node bottom up after primitives moved, the tree itself is left as is
+* Children are always stored after their parent so one reverse pass sees them before the parent
+* firstChanged/lastChanged return the half open range of nodes whose bounds changed
+*/
+void BVH::refit(const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads, std::vector<unsigned int>& changedNodes) {
+	for (int i = (int)nodes.size() - 1; i >= 0; i--) {
+		BVHNode& node = nodes[i];
+		AABB bounds;
+		if (node.primCount > 0) {
+			for (int p = node.leftFirst; p < node.leftFirst + node.primCount; p++) {
+				AABB primBounds;
+				glm::vec3 centroid;
+				primitiveBounds(primRefs[p], spheres, triangles, quads, primBounds, centroid);
+				bounds.grow(primBounds);
+			}
+		}
+		else if (node.leftFirst > 0) {
+			bounds.grow(AABB{ nodes[node.leftFirst].bboxMin, nodes[node.leftFirst].bboxMax });
+			bounds.grow(AABB{ nodes[node.leftFirst + 1].bboxMin, nodes[node.leftFirst + 1].bboxMax });
+		}
+		else {
+			continue;	// Empty root
+		}
+
+		if (bounds.bmin != node.bboxMin || bounds.bmax != node.bboxMax) {
+			node.bboxMin = bounds.bmin;
+			node.bboxMax = bounds.bmax;
+			changedNodes.push_back((unsigned int)i);
+		}
+	}
+}
+
+/*
+* Bounds and centroid of a primitive, false for degenerate ones which build leaves out
+*/
+bool BVH::primitiveBounds(unsigned int ref, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads, AABB& bounds, glm::vec3& centroid) {
+	unsigned int idx = ref & PRIM_INDEX_MASK;
+	switch (ref >> PRIM_TYPE_SHIFT) {
+	case PRIM_SPHERE: {
+		glm::vec3 pos = glm::vec3(spheres[idx].posRad);
+		float rad = spheres[idx].posRad.w;
+		bounds.grow(pos - glm::vec3(rad));
+		bounds.grow(pos + glm::vec3(rad));
+		centroid = pos;
+		return rad > 0;
+	}
+	case PRIM_TRIANGLE: {
+		const Triangle& tri = triangles[idx];
+		glm::vec3 p0 = glm::vec3(tri.p0), p1 = glm::vec3(tri.p1), p2 = glm::vec3(tri.p2);
+		bounds.grow(p0);
+		bounds.grow(p1);
+		bounds.grow(p2);
+		centroid = (p0 + p1 + p2) / 3.0f;
+		return glm::length(glm::cross(p1 - p0, p2 - p0)) > 0;
+	}
+	default: {
+		const Quad& quad = quads[idx];
+		glm::vec3 c00 = glm::vec3(quad.c00), c10 = glm::vec3(quad.c10), c01 = glm::vec3(quad.c01), c11 = glm::vec3(quad.c11);
+		bounds.grow(c00);
+		bounds.grow(c10);
+		bounds.grow(c01);
+		bounds.grow(c11);
+		centroid = (c00 + c10 + c01 + c11) / 4.0f;
+		return glm::length(glm::cross(c10 - c00, c01 - c00)) > 0;
+	}
+	}
+}
+
+void BVH::subdivide(unsigned int nodeIdx, unsigned int first, unsigned int count, unsigned int depth) {
+	AABB bounds;
+	for (unsigned int i = first; i < first + count; i++) {
+		bounds.grow(prims[i].bounds);
+	}
+	// An empty scene keeps the inverted default box so every ray misses the root
+	nodes[nodeIdx].bboxMin = bounds.bmin;
+	nodes[nodeIdx].bboxMax = bounds.bmax;
+	nodes[nodeIdx].leftFirst = first;
+	nodes[nodeIdx].primCount = count;
+
+	if (count <= 1 || depth >= MAX_DEPTH) return;
+
+	Split split = findBestSplit(first, count);
+	float leafCost = count * bounds.area();
+	if (split.axis < 0) return;
+	if (split.cost >= leafCost && count <= MAX_LEAF_SIZE) return;
+
+	PrimInfo* begin = prims.data() + first;
+	PrimInfo* middle = std::partition(begin, begin + count, [&](const PrimInfo& prim) {
+		return binIndex(split, prim) <= split.bin;
+	});
+	unsigned int leftCount = (unsigned int)(middle - begin);
+	if (leftCount == 0 || leftCount == count) return;
+
+	unsigned int leftIdx = (unsigned int)nodes.size();
+	nodes.push_back(BVHNode());
+	nodes.push_back(BVHNode());
+	nodes[nodeIdx].leftFirst = leftIdx;
+	nodes[nodeIdx].primCount = 0;
+
+	subdivide(leftIdx, first, leftCount, depth + 1);
+	subdivide(leftIdx + 1, first + leftCount, count - leftCount, depth + 1);
+}
+
+int BVH::binIndex(const Split& split, const PrimInfo& prim) const {
+	int bin = (int)((prim.centroid[split.axis] - split.binMin) * split.binScale);
+	return std::min(std::max(bin, 0), NUM_BINS - 1);
+}
+
+/*
+* Bins the primitive centroids along every axis and returns the cheapest split
+* cost = leftCount * leftArea + rightCount * rightArea, axis is -1 if all centroids coincide
+*/
+BVH::Split BVH::findBestSplit(unsigned int first, unsigned int count) const {
+	Split best;
+	best.cost = 1e30f;
+	best.axis = -1;
+	best.bin = 0;
+	best.binMin = 0;
+	best.binScale = 0;
+
+	AABB centroidBounds;
+	for (unsigned int i = first; i < first + count; i++) {
+		centroidBounds.grow(prims[i].centroid);
+	}
+
+	for (int axis = 0; axis < 3; axis++) {
+		float extent = centroidBounds.bmax[axis] - centroidBounds.bmin[axis];
+		if (extent <= 0) continue;
+
+		Split split;
+		split.axis = axis;
+		split.binMin = centroidBounds.bmin[axis];
+		split.binScale = NUM_BINS / extent;
+
+		AABB binBounds[NUM_BINS];
+		unsigned int binCount[NUM_BINS] = { 0 };
+		for (unsigned int i = first; i < first + count; i++) {
+			int bin = binIndex(split, prims[i]);
+			binBounds[bin].grow(prims[i].bounds);
+			binCount[bin]++;
+		}
+
+		// Sweep from both sides to get the area and count left/right of every bin boundary
+		float leftArea[NUM_BINS - 1], rightArea[NUM_BINS - 1];
+		unsigned int leftCount[NUM_BINS - 1], rightCount[NUM_BINS - 1];
+		AABB leftBox, rightBox;
+		unsigned int leftSum = 0, rightSum = 0;
+		for (int i = 0; i < NUM_BINS - 1; i++) {
+			leftSum += binCount[i];
+			leftBox.grow(binBounds[i]);
+			leftCount[i] = leftSum;
+			leftArea[i] = leftBox.area();
+
+			rightSum += binCount[NUM_BINS - 1 - i];
+			rightBox.grow(binBounds[NUM_BINS - 1 - i]);
+			rightCount[NUM_BINS - 2 - i] = rightSum;
+			rightArea[NUM_BINS - 2 - i] = rightBox.area();
+		}
+
+		for (int i = 0; i < NUM_BINS - 1; i++) {
+			if (leftCount[i] == 0 || rightCount[i] == 0) continue;
+			float cost = leftCount[i] * leftArea[i] + rightCount[i] * rightArea[i];
+			if (cost < best.cost) {
+				best = split;
+				best.cost = cost;
+				best.bin = i;
+			}
+		}
+	}
+	return best;
+}
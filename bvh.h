@@ -0,0 +1,83 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+
+/*
+	Bounding volume hierarchy over every primitive in the scene
+	- Built on the host with a binned surface area heuristic and stored as a flat node array
+	- The node array and primitive references are uploaded to the compute shader as SSBOs and walked with a stack
+	- Primitives are never reordered, leaves point into primRefs which holds (type, index) pairs packed in a uint
+*/
+
+// Primitive reference type, stored in the top 2 bits of a primRef
+#define PRIM_SPHERE 0u
+#define PRIM_TRIANGLE 1u
+#define PRIM_QUAD 2u
+#define PRIM_TYPE_SHIFT 30u
+#define PRIM_INDEX_MASK 0x3FFFFFFFu
+
+inline unsigned int makePrimRef(unsigned int type, unsigned int index) {
+	return (type << PRIM_TYPE_SHIFT) | (index & PRIM_INDEX_MASK);
+}
+
+struct AABB {
+	glm::vec3 bmin = glm::vec3(1e30f);
+	glm::vec3 bmax = glm::vec3(-1e30f);
+
+	void grow(const glm::vec3& p) { bmin = glm::min(bmin, p); bmax = glm::max(bmax, p); }
+	void grow(const AABB& b) { bmin = glm::min(bmin, b.bmin); bmax = glm::max(bmax, b.bmax); }
+	float area() const {
+		glm::vec3 e = bmax - bmin;
+		return (e.x < 0) ? 0.0f : e.x * e.y + e.y * e.z + e.z * e.x;
+	}
+};
+
+// Matches the std430 layout of BVHNode in raytracer.comp (vec3 + int packs into 16 bytes)
+struct BVHNode {
+	glm::vec3 bboxMin;
+	int leftFirst;	// Interior node: index of the left child, the right child follows it. Leaf: first index into primRefs
+	glm::vec3 bboxMax;
+	int primCount;	// 0 for interior nodes
+};
+
+class BVH {
+public:
+	// Degenerate primitives (zero radius spheres, zero area triangles/quads) are left out of the tree
+	void build(const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads);
+	// Updates the node bounds after primitives moved without changing the tree, appends the index of every changed node to changedNodes
+	// Quality drops as objects drift away from where they were at build time, adding or removing primitives needs a build
+	void refit(const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads, std::vector<unsigned int>& changedNodes);
+
+	std::vector<BVHNode> nodes;
+	std::vector<unsigned int> primRefs;
+
+private:
+	struct PrimInfo {
+		AABB bounds;
+		glm::vec3 centroid;
+		unsigned int ref;
+	};
+
+	struct Split {
+		float cost;
+		int axis;
+		int bin;	// Primitives in bins [0, bin] go left
+		float binMin, binScale;
+	};
+
+	static const int NUM_BINS = 12;
+	static const int MAX_LEAF_SIZE = 4;
+	// Has to stay below BVH_STACK_SIZE in raytracer.comp
+	static const unsigned int MAX_DEPTH = 60;
+
+	static bool primitiveBounds(unsigned int ref, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads, AABB& bounds, glm::vec3& centroid);
+	void subdivide(unsigned int nodeIdx, unsigned int first, unsigned int count, unsigned int depth);
+	Split findBestSplit(unsigned int first, unsigned int count) const;
+	int binIndex(const Split& split, const PrimInfo& prim) const;
+
+	std::vector<PrimInfo> prims;
+};
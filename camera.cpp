@@ -20,11 +20,12 @@ void Camera::matrix() {
 	// Adds perspective to the scene
 	projection = glm::perspective(glm::radians(FOV), (float)globals::WINDOW_WIDTH / globals::WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
 
-	invProjView = glm::inverse(projection * view);
+	projView = projection * view;
+	invProjView = glm::inverse(projView);
 }
 
 
-void Camera::inputs(const float& frameTime, bool& resetFrames) {
+void Camera::inputs(const float& frameTime, bool& moved) {
 	// Handles key inputs
 
 	float curVel = slowVel;
@@ -33,33 +34,33 @@ void Camera::inputs(const float& frameTime, bool& resetFrames) {
 	}
 	if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS) {
 		position += curVel * frameTime * direction;
-		resetFrames = true;
+		moved = true;
 	}
 	if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS) {
 		position += curVel * frameTime * -glm::normalize(glm::cross(direction, Up));
-		resetFrames = true;
+		moved = true;
 	}
 	if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS) {
 		position += curVel * frameTime * -direction;
-		resetFrames = true;
+		moved = true;
 	}
 	if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS) {
 		position += curVel * frameTime * glm::normalize(glm::cross(direction, Up));
-		resetFrames = true;
+		moved = true;
 	}
 	if (glfwGetKey(window, GLFW_KEY_SPACE) == GLFW_PRESS) {
 		position += curVel * frameTime * Up;
-		resetFrames = true;
+		moved = true;
 	}
 	if (glfwGetKey(window, GLFW_KEY_LEFT_CONTROL) == GLFW_PRESS) {
 		position += curVel * frameTime * -Up;
-		resetFrames = true;
+		moved = true;
 	}
 
 
 	// Handles mouse inputs (camera movement)
 	if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_PRESS) {
-		resetFrames = true;
+		moved = true;
 		// Hides mouse cursor
 		glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_HIDDEN);
 
@@ -77,8 +78,8 @@ void Camera::inputs(const float& frameTime, bool& resetFrames) {
 
 		// Normalizes and shifts the coordinates of the cursor such that they begin in the middle of the screen
 		// and then "transforms" them into degrees 
-		float rotX = sensitivity * (float)(mouseY - (globals::HALF_WH)) / globals::WINDOW_HEIGHT;
-		float rotY = sensitivity * (float)(mouseX - (globals::HALF_WW)) / globals::WINDOW_WIDTH;
+		float rotX = sensitivity * (float)(mouseY - (globals::WINDOW_HEIGHT / 2.0)) / globals::WINDOW_HEIGHT;
+		float rotY = sensitivity * (float)(mouseX - (globals::WINDOW_WIDTH / 2.0)) / globals::WINDOW_WIDTH;
 
 		// Calculates upcoming vertical change in the Orientation
 		glm::vec3 newOrientation = glm::rotate(direction, glm::radians(-rotX), glm::normalize(glm::cross(direction, Up)));
@@ -92,7 +93,7 @@ void Camera::inputs(const float& frameTime, bool& resetFrames) {
 		direction = glm::rotate(direction, glm::radians(-rotY), Up);
 
 		// Sets mouse cursor to the middle of the screen so that it doesn't end up roaming around
-		glfwSetCursorPos(window, (globals::HALF_WW), (globals::HALF_WH));
+		glfwSetCursorPos(window, (globals::WINDOW_WIDTH / 2.0), (globals::WINDOW_HEIGHT / 2.0));
 	}
 	else if (glfwGetMouseButton(window, GLFW_MOUSE_BUTTON_LEFT) == GLFW_RELEASE) {
 		// Unhides cursor since camera is not looking around anymore
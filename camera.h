@@ -21,8 +21,8 @@ public:
 	// Updates and exports the camera matrix to the Vertex Shader
 	void matrix();
 
-	// Handles camera inputs
-	void inputs(const float& frameTime, bool& resetFrames);
+	// Handles camera inputs, sets moved when any of them changed the position or direction
+	void inputs(const float& frameTime, bool& moved);
 
 	GLFWwindow* window;
 
@@ -44,5 +44,6 @@ public:
 
 	glm::mat4 view;
 	glm::mat4 projection;
+	glm::mat4 projView;
 	glm::mat4 invProjView;
 };
\ No newline at end of file
@@ -0,0 +1,774 @@
+#include "cputracer.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+
+#define EPSILON 0.0001f
+#define PI 3.1415926538f
+#define MISS_DIST 1e30f
+
+
+// Util functions
+
+static bool isEqual(float x, float y) {
+	return (std::abs(x - y) < EPSILON);
+}
+
+
+// Sampler, the same integer arithmetic as sample2D in the shader so both backends draw identical sequences
+
+static uint32_t pcgHash(uint32_t v) {
+	uint32_t state = v * 747796405u + 2891336453u;
+	uint32_t word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+	return (word >> 22u) ^ word;
+}
+
+static uint32_t hashCombine(uint32_t seed, uint32_t v) {
+	return seed ^ (pcgHash(v) + 0x9e3779b9u + (seed << 6u) + (seed >> 2u));
+}
+
+static uint32_t bitfieldReverse(uint32_t x) {
+	x = ((x >> 1u) & 0x55555555u) | ((x & 0x55555555u) << 1u);
+	x = ((x >> 2u) & 0x33333333u) | ((x & 0x33333333u) << 2u);
+	x = ((x >> 4u) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4u);
+	x = ((x >> 8u) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8u);
+	return (x >> 16u) | (x << 16u);
+}
+
+static uint32_t sobol1(uint32_t index) {
+	uint32_t result = 0u;
+	for (uint32_t v = 1u << 31u; index != 0u; index >>= 1u, v ^= v >> 1u) {
+		if ((index & 1u) != 0u) result ^= v;
+	}
+	return result;
+}
+
+static uint32_t laineKarrasPermutation(uint32_t x, uint32_t seed) {
+	x += seed;
+	x ^= x * 0x6c50b47cu;
+	x ^= x * 0xb82f1e52u;
+	x ^= x * 0xc7afe638u;
+	x ^= x * 0x8d22f6e6u;
+	return x;
+}
+
+static uint32_t nestedUniformScramble(uint32_t x, uint32_t seed) {
+	return bitfieldReverse(laineKarrasPermutation(bitfieldReverse(x), seed));
+}
+
+static float toUnitFloat(uint32_t x) {
+	return (float)(x >> 8u) * (1.0f / 16777216.0f);
+}
+
+static glm::mat3 getTangentSpace(const glm::vec3& normal) {
+	glm::vec3 helper = glm::vec3(1, 0, 0);
+	if (std::abs(normal.x) > 0.99f) helper = glm::vec3(0, 0, 1);
+	glm::vec3 tangent = glm::normalize(glm::cross(normal, helper));
+	glm::vec3 binormal = glm::normalize(glm::cross(normal, tangent));
+	return glm::mat3(tangent, binormal, normal);
+}
+
+// Cosine weighted direction around normal, pdf = cos(theta) / PI
+static glm::vec3 sampleCosineHemisphere(const glm::vec3& normal, const glm::vec2& xi) {
+	float cosTheta = std::sqrt(1.0f - xi.x);
+	float sinTheta = std::sqrt(xi.x);
+	float phi = 2 * PI * xi.y;
+	return getTangentSpace(normal) * glm::vec3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+}
+
+// Solid angle of the cone a sphere subtends from pos, 0 from inside it
+static float sphereConeSolidAngle(const glm::vec4& posRad, const glm::vec3& pos) {
+	glm::vec3 toCenter = glm::vec3(posRad) - pos;
+	float dist2 = glm::dot(toCenter, toCenter);
+	float rad2 = posRad.w * posRad.w;
+	if (dist2 <= rad2) return 0.0f;
+	float cosThetaMax = std::sqrt(1.0f - rad2 / dist2);
+	return 2.0f * PI * (rad2 / dist2) / (1.0f + cosThetaMax);
+}
+
+// Uniform direction inside that cone, pdf = 1 / solid angle
+static glm::vec3 sampleSphereCone(const glm::vec4& posRad, const glm::vec3& pos, const glm::vec2& xi, float& pdf) {
+	float solidAngle = sphereConeSolidAngle(posRad, pos);
+	pdf = (solidAngle > 0.0f) ? 1.0f / solidAngle : 0.0f;
+	if (solidAngle <= 0.0f) return glm::vec3(0);
+
+	float cosTheta = 1.0f - xi.x * solidAngle / (2.0f * PI);
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+	float phi = 2.0f * PI * xi.y;
+	return getTangentSpace(glm::normalize(glm::vec3(posRad) - pos)) * glm::vec3(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+}
+
+static float luminance(const glm::vec3& color) {
+	return glm::dot(color, glm::vec3(0.2126f, 0.7152f, 0.0722f));
+}
+
+// Power heuristic for one sample from each strategy
+static float misWeight(float pdf, float otherPdf) {
+	float a = pdf * pdf;
+	float b = otherPdf * otherPdf;
+	return (a + b > 0.0f) ? a / (a + b) : 0.0f;
+}
+
+//========================================================
+
+CPUTracer::CPUTracer(unsigned int width_, unsigned int height_, unsigned int numThreads) : width(width_), height(height_), pool(numThreads) {
+	image.assign(width * height, glm::vec4(0));
+	moments.assign(width * height, glm::vec4(0));
+	albedo.assign(width * height, glm::vec4(0));
+	normalDepth.assign(width * height, glm::vec4(0));
+}
+
+void CPUTracer::setScene(const std::vector<Material>& materials_, const std::vector<Sphere>& spheres_, const std::vector<Triangle>& triangles_, const std::vector<Quad>& quads_,
+	const std::vector<PointLight>& pointLights_, const std::vector<unsigned int>& emitters_, const BVH& bvh_) {
+	materials = materials_;
+	spheres = spheres_;
+	triangles = triangles_;
+	quads = quads_;
+	pointLights = pointLights_;
+	emitters = emitters_;
+	bvh = bvh_;
+	wideBvh.build(bvh, spheres, triangles, quads);
+}
+
+void CPUTracer::setSkybox(const EnvironmentMap& map, const EnvironmentDistribution& envDistribution_) {
+	envDistribution = envDistribution_;
+	skyLevels.resize(map.levelCount);
+	for (unsigned int level = 0; level < map.levelCount; level++) {
+		SkyLevel& sky = skyLevels[level];
+		sky.width = (int)map.levelWidth(level);
+		sky.height = (int)map.levelHeight(level);
+		sky.texels.resize(sky.width * sky.height);
+		for (int y = 0; y < sky.height; y++) {
+			for (int x = 0; x < sky.width; x++) sky.texels[y * sky.width + x] = map.texel(x, y, level);
+		}
+	}
+}
+
+void CPUTracer::setCamera(const glm::vec3& cameraPos_, const glm::vec3& ray00_, const glm::vec3& ray10_, const glm::vec3& ray01_, const glm::vec3& ray11_) {
+	cameraPos = cameraPos_;
+	ray00 = ray00_;
+	ray10 = ray10_;
+	ray01 = ray01_;
+	ray11 = ray11_;
+}
+
+void CPUTracer::render(int numAccumFrames) {
+	auto start = std::chrono::steady_clock::now();
+	rayCounter = 0;
+	shadowRayCounter = 0;
+	activeCounter = 0;
+	for (std::atomic<unsigned long long>& counter : pathLengthCounters) counter = 0;
+
+	unsigned int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+	pool.parallelFor(tilesX * tilesY, [&](unsigned int tileIdx) {
+		renderTile(tileIdx, numAccumFrames);
+	});
+
+	lastFrameTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	lastRayCount = rayCounter;
+	lastShadowRayCount = shadowRayCounter;
+	lastActivePixels = activeCounter;
+	for (unsigned int i = 0; i <= MAX_BOUNCES; i++) lastPathLengths[i] = pathLengthCounters[i];
+}
+
+void CPUTracer::renderTile(unsigned int tileIdx, int numAccumFrames) {
+	unsigned int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+	unsigned int x0 = (tileIdx % tilesX) * TILE_SIZE;
+	unsigned int y0 = (tileIdx / tilesX) * TILE_SIZE;
+
+	TraceStats stats;
+	unsigned int numActive = 0;
+	for (unsigned int y = y0; y < std::min(y0 + TILE_SIZE, height); y++) {
+		for (unsigned int x = x0; x < std::min(x0 + TILE_SIZE, width); x++) {
+			// The moments restart with the accumulation
+			glm::vec4& pixelMoments = moments[y * width + x];
+			if (numAccumFrames == 0) pixelMoments = glm::vec4(0);
+			if (adaptiveSampling && pixelConverged(pixelMoments)) continue;
+
+			uint32_t pixelSeed = pcgHash(x + y * width);
+			if (scrambleSeed != 0) pixelSeed = hashCombine(pixelSeed, scrambleSeed);
+			glm::vec3 pixelColor = renderMethod(glm::ivec2(x, y), pixelSeed, (uint32_t)numAccumFrames, pixelMoments, albedo[y * width + x], normalDepth[y * width + x], stats);
+			image[y * width + x] = glm::vec4(pixelColor, 1.0f);
+			numActive++;
+		}
+	}
+	rayCounter += stats.numRays;
+	shadowRayCounter += stats.shadowRays;
+	activeCounter += numActive;
+	for (unsigned int i = 0; i <= MAX_BOUNCES; i++) {
+		if (stats.pathLengths[i] > 0) pathLengthCounters[i] += stats.pathLengths[i];
+	}
+}
+
+// Bilinear lookup like the GL sampler, u repeats and v is clamped to the edge
+glm::vec3 CPUTracer::sampleSkyboxLevel(unsigned int level, const glm::vec2& uv) const {
+	const SkyLevel& sky = skyLevels[level];
+	float fx = uv.x * (float)sky.width - 0.5f;
+	float fy = uv.y * (float)sky.height - 0.5f;
+	int x0 = (int)std::floor(fx), y0 = (int)std::floor(fy);
+	float tx = fx - (float)x0, ty = fy - (float)y0;
+
+	int x1 = x0 + 1;
+	x0 = ((x0 % sky.width) + sky.width) % sky.width;
+	x1 = ((x1 % sky.width) + sky.width) % sky.width;
+	int y1 = glm::clamp(y0 + 1, 0, sky.height - 1);
+	y0 = glm::clamp(y0, 0, sky.height - 1);
+
+	glm::vec3 top = glm::mix(sky.texels[y0 * sky.width + x0], sky.texels[y0 * sky.width + x1], tx);
+	glm::vec3 bottom = glm::mix(sky.texels[y1 * sky.width + x0], sky.texels[y1 * sky.width + x1], tx);
+	return glm::mix(top, bottom, ty);
+}
+
+// Same level selection as the shader, blended between the two nearest levels like GL_LINEAR_MIPMAP_LINEAR
+glm::vec3 CPUTracer::sampleSkybox(const glm::vec3& dir, float coneSpread) const {
+	glm::vec2 uv = glm::vec2(0.5f + std::atan2(dir.x, dir.z) / (2 * PI), 0.5f + std::asin(-dir.y) / PI);
+	float lod = std::log2(std::max(coneSpread * (float)skyLevels[0].height / PI, 1.0f));
+	lod = std::min(lod, (float)(skyLevels.size() - 1));
+	unsigned int level = (unsigned int)lod;
+	float blend = lod - (float)level;
+	glm::vec3 color = sampleSkyboxLevel(level, uv);
+	if (blend > 0.0f) color = glm::mix(color, sampleSkyboxLevel(level + 1, uv), blend);
+	return color;
+}
+
+bool CPUTracer::useEnvSampling() const {
+	return envSampling && envDistribution.valid();
+}
+
+unsigned int CPUTracer::numLightSources() const {
+	return (unsigned int)(pointLights.size() + emitters.size());
+}
+
+float CPUTracer::emitterPdf(unsigned int sphereIdx, const glm::vec3& pos) const {
+	float solidAngle = sphereConeSolidAngle(spheres[sphereIdx].posRad, pos);
+	return (solidAngle > 0.0f) ? 1.0f / (solidAngle * (float)numLightSources()) : 0.0f;
+}
+
+bool CPUTracer::intersectSphere(const Sphere& sphere, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const {
+	glm::vec3 pos = glm::vec3(sphere.posRad);
+	float rad = sphere.posRad.w;
+
+	float a = glm::dot(ray.dir, ray.dir);
+	glm::vec3 sToR = ray.pos - pos;
+	float b = 2.0f * glm::dot(sToR, ray.dir);
+	float c = glm::dot(sToR, sToR) - rad * rad;
+	float disc = b * b - 4.0f * a * c;
+	if (disc <= 0) return false;
+	float t = (-b - std::sqrt(disc)) / (2.0f * a);
+
+	if (t <= 0) {
+		if (!hitBackface) return false;
+		t = (-b + std::sqrt(disc)) / (2.0f * a);
+		// If this t <= 0 then we are backwards
+		if (t <= 0) return false;
+		// If not then return the negative normal for the inside face of the sphere
+		if (t < hit.t) {
+			hit.t = t;
+			hit.normal = -glm::normalize((ray.pos + t * ray.dir) - pos);
+			hit.prim = prim;
+			hit.backface = true;
+			return true;
+		}
+	}
+	if (t < hit.t) {
+		hit.t = t;
+		hit.normal = glm::normalize((ray.pos + t * ray.dir) - pos);
+		hit.prim = prim;
+		hit.backface = false;
+		return true;
+	}
+	return true;
+}
+
+bool CPUTracer::intersectTriangle(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const {
+	glm::vec3 edge1 = p1 - p0;
+	glm::vec3 edge2 = p2 - p0;
+	glm::vec3 h = glm::cross(ray.dir, edge2);
+	float a = glm::dot(edge1, h);
+	if (isEqual(a, 0)) return false; // Check if ray is parallel
+	float f = 1.0f / a;
+	glm::vec3 s = ray.pos - p0;
+	float u = f * glm::dot(s, h);
+	if (u < 0 || u > 1.0f) return false;
+	glm::vec3 q = glm::cross(s, edge1);
+	float v = f * glm::dot(ray.dir, q);
+	if (v < 0.0f || u + v > 1.0f) return false;
+	float t = f * glm::dot(edge2, q);
+	if (t > 0 && t < hit.t) {
+		glm::vec3 normal = glm::normalize(glm::cross(edge2, edge1));
+		if (glm::dot(ray.dir, normal) > 0) {
+			if (!hitBackface) return false;
+			hit.t = t;
+			hit.normal = -normal;
+			hit.prim = prim;
+			hit.backface = true;
+		}
+		else {
+			hit.t = t;
+			hit.normal = normal;
+			hit.prim = prim;
+			hit.backface = false;
+		}
+		return true;
+	}
+	return false;
+}
+
+bool CPUTracer::intersectQuad(const Quad& quad, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const {
+	bool intersect1 = intersectTriangle(quad.c00, quad.c10, quad.c11, prim, ray, hit, hitBackface);
+	bool intersect2 = intersectTriangle(quad.c00, quad.c11, quad.c01, prim, ray, hit, hitBackface);
+	return intersect1 || intersect2;
+}
+
+bool CPUTracer::intersectPrimitive(unsigned int primRef, const Ray& ray, Hit& hit, bool hitBackface) const {
+	unsigned int type = primRef >> PRIM_TYPE_SHIFT;
+	unsigned int index = primRef & PRIM_INDEX_MASK;
+	if (type == PRIM_SPHERE) {
+		return intersectSphere(spheres[index], primRef, ray, hit, hitBackface);
+	}
+	else if (type == PRIM_TRIANGLE) {
+		const Triangle& tri = triangles[index];
+		return intersectTriangle(tri.p0, tri.p1, tri.p2, primRef, ray, hit, hitBackface);
+	}
+	return intersectQuad(quads[index], primRef, ray, hit, hitBackface);
+}
+
+const Material& CPUTracer::getMaterial(unsigned int primRef) const {
+	unsigned int type = primRef >> PRIM_TYPE_SHIFT;
+	unsigned int index = primRef & PRIM_INDEX_MASK;
+	if (type == PRIM_SPHERE) return materials[spheres[index].materialIdx];
+	else if (type == PRIM_TRIANGLE) return materials[triangles[index].materialIdx];
+	return materials[quads[index].materialIdx];
+}
+
+// Slab test, returns the entry distance or MISS_DIST if the box is missed or further than the closest hit so far
+float CPUTracer::intersectAABB(const glm::vec3& bboxMin, const glm::vec3& bboxMax, const Ray& ray, const glm::vec3& invDir, float tMax) const {
+	glm::vec3 t0 = (bboxMin - ray.pos) * invDir;
+	glm::vec3 t1 = (bboxMax - ray.pos) * invDir;
+	glm::vec3 tSmall = glm::min(t0, t1);
+	glm::vec3 tBig = glm::max(t0, t1);
+	float tEnter = std::max(std::max(tSmall.x, tSmall.y), tSmall.z);
+	float tExit = std::min(std::min(tBig.x, tBig.y), tBig.z);
+	if (tExit >= std::max(tEnter, 0.0f) && tEnter < tMax) return tEnter;
+	return MISS_DIST;
+}
+
+// Walks the BVH front to back, always descending into the nearer child first
+bool CPUTracer::intersectObjects(const Ray& ray, Hit& hit, bool hitBackface) const {
+#if WIDE_BVH_AVAILABLE
+	if (useWideBVH) return wideBvh.intersect(ray, hit, hitBackface);
+#endif
+	bool intersect = false;
+	glm::vec3 invDir = 1.0f / ray.dir;
+	const std::vector<BVHNode>& nodes = bvh.nodes;
+
+	unsigned int stack[BVH_STACK_SIZE];
+	int stackPtr = 0;
+	unsigned int nodeIdx = 0;
+	if (intersectAABB(nodes[0].bboxMin, nodes[0].bboxMax, ray, invDir, hit.t) == MISS_DIST) return false;
+
+	while (true) {
+		const BVHNode& node = nodes[nodeIdx];
+		if (node.primCount > 0) {
+			for (int i = 0; i < node.primCount; i++) {
+				intersect = intersectPrimitive(bvh.primRefs[node.leftFirst + i], ray, hit, hitBackface) || intersect;
+			}
+			if (stackPtr == 0) break;
+			nodeIdx = stack[--stackPtr];
+			continue;
+		}
+
+		unsigned int child1 = (unsigned int)node.leftFirst;
+		unsigned int child2 = child1 + 1;
+		float dist1 = intersectAABB(nodes[child1].bboxMin, nodes[child1].bboxMax, ray, invDir, hit.t);
+		float dist2 = intersectAABB(nodes[child2].bboxMin, nodes[child2].bboxMax, ray, invDir, hit.t);
+		if (dist1 > dist2) {
+			std::swap(dist1, dist2);
+			std::swap(child1, child2);
+		}
+
+		if (dist1 == MISS_DIST) {
+			if (stackPtr == 0) break;
+			nodeIdx = stack[--stackPtr];
+		}
+		else {
+			nodeIdx = child1;
+			if (dist2 != MISS_DIST) stack[stackPtr++] = child2;
+		}
+	}
+
+	return intersect;
+}
+
+float CPUTracer::computeFresnelRatio(float cosi, float n1, float n2) const {
+	if (isEqual(n1, 0) || isEqual(n2, 0)) return 1.0f;
+	// Compute sini using Snell's law
+	float sint = n1 / n2 * std::sqrt(std::max(0.0f, 1.0f - cosi * cosi));
+	// Total internal reflection
+	if (sint >= 1) return 1.0f;
+	else {
+		float cost = std::sqrt(std::max(0.0f, 1.0f - sint * sint));
+		cosi = std::abs(cosi);
+		float Rs = ((n2 * cosi) - (n1 * cost)) / ((n2 * cosi) + (n1 * cost));
+		float Rp = ((n1 * cosi) - (n2 * cost)) / ((n1 * cosi) + (n2 * cost));
+		return (Rs * Rs + Rp * Rp) / 2.0f;
+	}
+}
+
+// Traces a singular ray and returns the hit color, the extend, shade and miss stages of raytracer.comp in one loop (see STAGE_SHADE for the lighting model)
+glm::vec3 CPUTracer::traceRay(Ray ray, uint32_t pixelSeed, uint32_t sampleIndex, TraceStats& stats, glm::vec3& firstAlbedo, glm::vec4& firstNormalDepth) const {
+	glm::vec3 incomingLight = glm::vec3(0);
+	glm::vec3 rayColor = glm::vec3(1);
+	// Pdf of the last diffuse bounce for MIS against skybox sampling, 0 for camera rays and delta lobes
+	float bsdfPdf = 0.0f;
+	// Only the cone's spread matters for the skybox, the footprint width is left out here
+	float coneSpread = pixelSpreadAngle();
+
+	for (unsigned int bounce = 0; bounce <= MAX_BOUNCES; bounce++) {
+		Hit hit;
+		hit.t = INFINITY;
+		stats.numRays++;
+
+		if (intersectObjects(ray, hit, true)) {
+			const Material& material = getMaterial(hit.prim);
+			glm::vec3 hitPoint = ray.pos + hit.t * ray.dir;
+
+			if (bounce == 0) {
+				firstAlbedo = glm::vec3(material.diffuseColor);
+				firstNormalDepth = glm::vec4(hit.normal, hit.t);
+			}
+
+			glm::vec2 lobeSample = sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_LOBE);
+			glm::vec3 specularDir = glm::reflect(ray.dir, hit.normal);
+
+			float n1, n2;
+			if (hit.backface) {
+				n1 = material.data.z;
+				n2 = 1.0f;
+			}
+			else {
+				n1 = 1.0f;
+				n2 = material.data.z;
+			}
+			float fresRatio = computeFresnelRatio(glm::dot(ray.dir, hit.normal), n1, n2);
+			glm::vec3 refractDir = glm::refract(ray.dir, hit.normal, n1 / n2);
+
+			bool didTransmit = lobeSample.x > fresRatio;
+			bool didSpecular = lobeSample.y < material.data.x;
+			float diffuseChance = fresRatio * (1.0f - material.data.x);
+			float diffuseSpread = std::max(coneSpread, CONE_DIFFUSE_SPREAD);
+
+			glm::vec3 shadowPos = hitPoint + hit.normal * EPSILON;
+			glm::vec3 diffuseBsdf = glm::vec3(material.diffuseColor) * diffuseChance / PI;
+
+			// Next event estimation towards the skybox, see the shade stage
+			if (useEnvSampling() && diffuseChance > 0.0f) {
+				float lightPdf;
+				glm::vec3 lightDir = envDistribution.sample(sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_LIGHT), lightPdf);
+				float cosLight = glm::dot(lightDir, hit.normal);
+				if (lightPdf > 0.0f && cosLight > 0.0f) {
+					Ray shadowRay;
+					shadowRay.pos = shadowPos;
+					shadowRay.dir = lightDir;
+					Hit shadowHit;
+					shadowHit.t = INFINITY;
+					stats.numRays++;
+					stats.shadowRays++;
+					if (!intersectObjects(shadowRay, shadowHit, true)) {
+						float lightBsdfPdf = diffuseChance * cosLight / PI;
+						incomingLight += rayColor * diffuseBsdf * cosLight * sampleSkybox(lightDir, diffuseSpread) * misWeight(lightPdf, lightBsdfPdf) / lightPdf;
+					}
+				}
+			}
+
+			// And towards a point light or emissive sphere
+			unsigned int lightCount = numLightSources();
+			if (lightCount > 0 && diffuseChance > 0.0f) {
+				unsigned int light = std::min((unsigned int)(sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_PICK).x * (float)lightCount), lightCount - 1);
+				float pickPdf = 1.0f / (float)lightCount;
+				Ray shadowRay;
+				shadowRay.pos = shadowPos;
+				Hit shadowHit;
+
+				if (light < pointLights.size()) {
+					const PointLight& pointLight = pointLights[light];
+					glm::vec3 toLight = pointLight.pos - shadowPos;
+					float dist2 = glm::dot(toLight, toLight);
+					shadowRay.dir = toLight / std::sqrt(dist2);
+					shadowHit.t = std::sqrt(dist2);
+					float cosLight = glm::dot(shadowRay.dir, hit.normal);
+					if (cosLight > 0.0f) {
+						stats.numRays++;
+						stats.shadowRays++;
+						if (!intersectObjects(shadowRay, shadowHit, true)) {
+							const Material& lightMaterial = materials[pointLight.materialIdx];
+							glm::vec3 intensity = glm::vec3(lightMaterial.emissionColor) * lightMaterial.data.w;
+							incomingLight += rayColor * diffuseBsdf * cosLight * intensity / (dist2 * pickPdf);
+						}
+					}
+				}
+				else {
+					unsigned int sphereIdx = emitters[light - pointLights.size()];
+					unsigned int emitterRef = makePrimRef(PRIM_SPHERE, sphereIdx);
+					float conePdf;
+					shadowRay.dir = sampleSphereCone(spheres[sphereIdx].posRad, shadowPos, sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_EMITTER), conePdf);
+					shadowHit.t = INFINITY;
+					float cosLight = glm::dot(shadowRay.dir, hit.normal);
+					if (hit.prim != emitterRef && conePdf > 0.0f && cosLight > 0.0f) {
+						stats.numRays++;
+						stats.shadowRays++;
+						if (intersectObjects(shadowRay, shadowHit, true) && shadowHit.prim == emitterRef) {
+							const Material& lightMaterial = materials[spheres[sphereIdx].materialIdx];
+							float lightPdf = pickPdf * conePdf;
+							float lightBsdfPdf = diffuseChance * cosLight / PI;
+							incomingLight += rayColor * diffuseBsdf * cosLight * glm::vec3(lightMaterial.emissionColor) * lightMaterial.data.w * misWeight(lightPdf, lightBsdfPdf) / lightPdf;
+						}
+					}
+				}
+			}
+
+			if (didTransmit) {
+				ray.dir = refractDir;
+				rayColor *= glm::vec3(material.refractionColor);
+				bsdfPdf = 0.0f;
+			}
+			else {
+				glm::vec3 emittedLight = glm::vec3(material.emissionColor) * material.data.w;
+				float emissionWeight = 1.0f;
+				if (bsdfPdf > 0.0f && material.data.w > 0.0f && (hit.prim >> PRIM_TYPE_SHIFT) == PRIM_SPHERE) {
+					emissionWeight = misWeight(bsdfPdf, emitterPdf(hit.prim & PRIM_INDEX_MASK, ray.pos));
+				}
+				incomingLight += emittedLight * rayColor * emissionWeight;
+				if (didSpecular) {
+					ray.dir = specularDir;
+					bsdfPdf = 0.0f;
+				}
+				else {
+					ray.dir = sampleCosineHemisphere(hit.normal, sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_DIFFUSE));
+					bsdfPdf = diffuseChance * glm::dot(ray.dir, hit.normal) / PI;
+					coneSpread = diffuseSpread;
+				}
+				rayColor *= glm::vec3(material.diffuseColor);
+			}
+			ray.pos = hitPoint + ray.dir * EPSILON;
+
+			// Russian roulette, see the end of the shade stage
+			bool terminate = bounce >= MAX_BOUNCES;
+			if (!terminate && bounce >= ROULETTE_MIN_BOUNCE) {
+				float survival = std::min(std::max(rayColor.x, std::max(rayColor.y, rayColor.z)), 1.0f);
+				terminate = sample2D(pixelSeed, sampleIndex, bounce, SAMPLE_ROULETTE).x >= survival;
+				if (!terminate) rayColor /= survival;
+			}
+			if (terminate) {
+				stats.pathLengths[bounce]++;
+				break;
+			}
+		}
+		else {
+			float weight = 1.0f;
+			if (useEnvSampling() && bsdfPdf > 0.0f) weight = misWeight(bsdfPdf, envDistribution.pdf(ray.dir));
+			incomingLight += rayColor * sampleSkybox(ray.dir, coneSpread) * weight;
+			if (bounce == 0) {
+				firstAlbedo = glm::vec3(1);
+				firstNormalDepth = glm::vec4(-ray.dir, DENOISE_SKY_DEPTH);
+			}
+			stats.pathLengths[bounce]++;
+			break;
+		}
+	}
+
+	return incomingLight;
+}
+
+// Owen scrambled Sobol (or independent hashes with randMode = 1), see sample2D in raytracer.comp
+glm::vec2 CPUTracer::sample2D(uint32_t pixelSeed, uint32_t sampleIndex, unsigned int bounce, unsigned int dim) const {
+	uint32_t seed = hashCombine(pixelSeed, bounce * SAMPLE_DIMS + dim);
+	if (randMode != 0) return glm::vec2(toUnitFloat(pcgHash(hashCombine(seed, 2u * sampleIndex))), toUnitFloat(pcgHash(hashCombine(seed, 2u * sampleIndex + 1u))));
+
+	uint32_t index = nestedUniformScramble(sampleIndex, seed);
+	uint32_t x = nestedUniformScramble(bitfieldReverse(index), hashCombine(seed, 0u));
+	uint32_t y = nestedUniformScramble(sobol1(index), hashCombine(seed, 1u));
+	return glm::vec2(toUnitFloat(x), toUnitFloat(y));
+}
+
+// Creates the start ray through a stratified position inside the current pixel
+Ray CPUTracer::getJitteredStartRay(const glm::ivec2& txlCoords, uint32_t pixelSeed, uint32_t sampleIndex) const {
+	Ray ray;
+	ray.pos = cameraPos;
+
+	glm::vec2 tpos = (glm::vec2(txlCoords) + sample2D(pixelSeed, sampleIndex, 0, SAMPLE_CAMERA)) / glm::vec2((float)width, (float)height);
+	glm::vec3 rayDir = glm::mix(glm::mix(ray00, ray01, tpos.y), glm::mix(ray10, ray11, tpos.y), tpos.x);
+	ray.dir = glm::normalize(rayDir - cameraPos);
+
+	return ray;
+}
+
+// Angle between the rays of two neighbouring pixels, the spread of every camera ray cone
+float CPUTracer::pixelSpreadAngle() const {
+	return glm::length(ray10 - ray00) / ((float)width * glm::length(0.5f * (ray00 + ray11) - cameraPos));
+}
+
+// Relative standard error of the pixel's mean luminance against errorThreshold
+bool CPUTracer::pixelConverged(const glm::vec4& moments) const {
+	float n = moments.z;
+	if (n < ADAPTIVE_MIN_SAMPLES) return false;
+	float variance = std::max(moments.y - moments.x * moments.x, 0.0f) * n / (n - 1.0f);
+	return std::sqrt(variance / n) <= errorThreshold * std::max(moments.x, ADAPTIVE_MIN_LUMINANCE);
+}
+
+// Accumulates one more sample into the pixel and its moments, mirrors the accumulate stage
+glm::vec3 CPUTracer::renderMethod(const glm::ivec2& coord, uint32_t pixelSeed, uint32_t frame, glm::vec4& moments, glm::vec4& pixelAlbedo, glm::vec4& pixelNormalDepth, TraceStats& stats) const {
+	glm::vec3 newPixelAvg = glm::vec3(0);
+	glm::vec3 newAlbedo = glm::vec3(0);
+	glm::vec4 newNormalDepth = glm::vec4(0);
+	for (int i = 0; i < MAX_SAMPLES; i++) {
+		uint32_t sampleIndex = frame * MAX_SAMPLES + i;
+		Ray ray = getJitteredStartRay(coord, pixelSeed, sampleIndex);
+		glm::vec3 sampleAlbedo;
+		glm::vec4 sampleNormalDepth;
+		newPixelAvg += traceRay(ray, pixelSeed, sampleIndex, stats, sampleAlbedo, sampleNormalDepth);
+		newAlbedo += sampleAlbedo;
+		newNormalDepth += sampleNormalDepth;
+	}
+	newPixelAvg /= (float)MAX_SAMPLES;
+	newAlbedo /= (float)MAX_SAMPLES;
+	newNormalDepth /= (float)MAX_SAMPLES;
+
+	glm::vec3 oldPixel = glm::vec3(image[coord.y * width + coord.x]);
+
+	// Pixels can have different sample counts once adaptive sampling skipped some of them
+	float weight = 1.0f / (moments.z + 1.0f);
+	float lum = luminance(newPixelAvg);
+	moments.x += (lum - moments.x) * weight;
+	moments.y += (lum * lum - moments.y) * weight;
+	moments.z += 1.0f;
+	pixelAlbedo = glm::mix(pixelAlbedo, glm::vec4(newAlbedo, 1.0f), weight);
+	pixelNormalDepth = glm::mix(pixelNormalDepth, newNormalDepth, weight);
+	return oldPixel * (1.0f - weight) + newPixelAvg * weight;
+}
+
+//========================================================
+
+// The variance pass writes filterTemp, every iteration then swaps output and filterTemp so the last one ends in output
+void CPUTracer::denoise(std::vector<glm::vec4>& output) {
+	output.resize(width * height);
+	filterTemp.resize(width * height);
+	std::vector<glm::vec4>* filterIn = &filterTemp;
+	std::vector<glm::vec4>* filterOut = &output;
+	if (DENOISE_ITERATIONS % 2 == 0) std::swap(filterIn, filterOut);
+
+	pool.parallelFor(height, [&](unsigned int y) {
+		estimateVariance(y, *filterIn);
+	});
+	for (unsigned int i = 0; i < DENOISE_ITERATIONS; i++) {
+		pool.parallelFor(height, [&](unsigned int y) {
+			denoiseIteration(y, 1 << i, *filterIn, *filterOut);
+		});
+		std::swap(filterIn, filterOut);
+	}
+}
+
+// Edge stopping weight against pixel q, see featureWeight in raytracer.comp
+float CPUTracer::featureWeight(const glm::vec4& centerNormalDepth, const glm::vec3& centerAlbedo, float depthScale, unsigned int q) const {
+	glm::vec3 qNormal = glm::normalize(glm::vec3(normalDepth[q]) + 1e-6f);
+	float wNormal = std::pow(std::max(glm::dot(glm::vec3(centerNormalDepth), qNormal), 0.0f), DENOISE_SIGMA_NORMAL);
+	float wDepth = std::exp(-std::abs(centerNormalDepth.w - normalDepth[q].w) / depthScale);
+	glm::vec3 albedoDiff = centerAlbedo - glm::vec3(albedo[q]);
+	float wAlbedo = std::exp(-glm::dot(albedoDiff, albedoDiff) / DENOISE_SIGMA_ALBEDO);
+	return wNormal * wDepth * wAlbedo;
+}
+
+float CPUTracer::depthGradient(int x, int y) const {
+	int w = (int)width, h = (int)height;
+	float left = normalDepth[y * w + std::max(x - 1, 0)].w;
+	float right = normalDepth[y * w + std::min(x + 1, w - 1)].w;
+	float down = normalDepth[std::max(y - 1, 0) * w + x].w;
+	float up = normalDepth[std::min(y + 1, h - 1) * w + x].w;
+	return std::max(std::abs(right - left), std::abs(up - down)) * 0.5f;
+}
+
+float CPUTracer::filteredVariance(const std::vector<glm::vec4>& filterIn, int x, int y) const {
+	const float kernel[2] = { 0.25f, 0.125f };
+	float variance = 0.0f;
+	float sumWeight = 0.0f;
+	for (int dy = -1; dy <= 1; dy++) {
+		for (int dx = -1; dx <= 1; dx++) {
+			int qx = x + dx, qy = y + dy;
+			if (qx < 0 || qy < 0 || qx >= (int)width || qy >= (int)height) continue;
+			float w = kernel[std::abs(dx)] * kernel[std::abs(dy)];
+			variance += filterIn[qy * width + qx].w * w;
+			sumWeight += w;
+		}
+	}
+	return variance / sumWeight;
+}
+
+// One row of STAGE_DENOISE_VARIANCE
+void CPUTracer::estimateVariance(unsigned int y, std::vector<glm::vec4>& filterOut) const {
+	for (unsigned int x = 0; x < width; x++) {
+		unsigned int idx = y * width + x;
+		float n = std::max(moments[idx].z, 1.0f);
+		glm::vec2 sampleMoments = glm::vec2(moments[idx].x, moments[idx].y);
+		if (n < DENOISE_MIN_SAMPLES) {
+			glm::vec4 center = normalDepth[idx];
+			center = glm::vec4(glm::normalize(glm::vec3(center) + 1e-6f), center.w);
+			glm::vec3 centerAlbedo = glm::vec3(albedo[idx]);
+			float depthScale = DENOISE_SIGMA_DEPTH * std::max(depthGradient((int)x, (int)y), 1e-3f);
+			float sumWeight = 0.0f;
+			sampleMoments = glm::vec2(0);
+			for (int dy = -3; dy <= 3; dy++) {
+				for (int dx = -3; dx <= 3; dx++) {
+					int qx = (int)x + dx, qy = (int)y + dy;
+					if (qx < 0 || qy < 0 || qx >= (int)width || qy >= (int)height) continue;
+					unsigned int q = qy * width + qx;
+					float w = featureWeight(center, centerAlbedo, depthScale * glm::length(glm::vec2(dx, dy)) + 1e-6f, q);
+					sampleMoments += glm::vec2(moments[q].x, moments[q].y) * w;
+					sumWeight += w;
+				}
+			}
+			sampleMoments /= sumWeight;
+		}
+		float variance = std::max(sampleMoments.y - sampleMoments.x * sampleMoments.x, 0.0f) / n;
+		filterOut[idx] = glm::vec4(glm::vec3(image[idx]), variance);
+	}
+}
+
+// One row of STAGE_DENOISE
+void CPUTracer::denoiseIteration(unsigned int y, int step, const std::vector<glm::vec4>& filterIn, std::vector<glm::vec4>& filterOut) const {
+	const float kernel[3] = { 1.0f, 2.0f / 3.0f, 1.0f / 6.0f };
+	for (unsigned int x = 0; x < width; x++) {
+		unsigned int idx = y * width + x;
+		glm::vec4 center = filterIn[idx];
+		glm::vec4 centerNormalDepth = normalDepth[idx];
+		centerNormalDepth = glm::vec4(glm::normalize(glm::vec3(centerNormalDepth) + 1e-6f), centerNormalDepth.w);
+		glm::vec3 centerAlbedo = glm::vec3(albedo[idx]);
+		float centerLum = luminance(glm::vec3(center));
+		float lumScale = DENOISE_SIGMA_LUMINANCE * std::sqrt(filteredVariance(filterIn, (int)x, (int)y)) + 1e-6f;
+		float depthScale = DENOISE_SIGMA_DEPTH * std::max(depthGradient((int)x, (int)y), 1e-3f);
+
+		glm::vec3 sumColor = glm::vec3(center);
+		float sumVariance = center.w;
+		float sumWeight = 1.0f;
+		for (int dy = -2; dy <= 2; dy++) {
+			for (int dx = -2; dx <= 2; dx++) {
+				if (dx == 0 && dy == 0) continue;
+				glm::ivec2 offset = glm::ivec2(dx, dy) * step;
+				int qx = (int)x + offset.x, qy = (int)y + offset.y;
+				if (qx < 0 || qy < 0 || qx >= (int)width || qy >= (int)height) continue;
+				unsigned int q = qy * width + qx;
+
+				const glm::vec4& tap = filterIn[q];
+				float wLum = std::exp(-std::abs(centerLum - luminance(glm::vec3(tap))) / lumScale);
+				float w = kernel[std::abs(dx)] * kernel[std::abs(dy)] * wLum * featureWeight(centerNormalDepth, centerAlbedo, depthScale * glm::length(glm::vec2(offset)) + 1e-6f, q);
+				sumColor += glm::vec3(tap) * w;
+				sumVariance += tap.w * w * w;
+				sumWeight += w;
+			}
+		}
+		filterOut[idx] = glm::vec4(sumColor / sumWeight, sumVariance / (sumWeight * sumWeight));
+	}
+}
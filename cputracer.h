@@ -0,0 +1,160 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+#include "bvh.h"
+#include "ray.h"
+#include "widebvh.h"
+#include "envmap.h"
+#include "threadpool.h"
+
+/*
+	CPU implementation of the path tracer in raytracer.comp
+	- Every function mirrors the shader function of the same name so results can be compared directly
+	- traceRay runs the wavefront stages of the shader (extend, shade, miss) back to back for a single path
+	- The image is stored exactly like imgOutput (RGBA32F, row 0 at the bottom) so it can be uploaded straight into the screen texture
+	- Frames are split into TILE_SIZE x TILE_SIZE tiles which are handed to a work-stealing thread pool
+	- Rays are traced against a SIMD_WIDTH-ary copy of the BVH (see widebvh.h), the binary one is kept for comparisons
+*/
+
+class CPUTracer {
+public:
+	// numThreads = 0 uses every hardware thread
+	CPUTracer(unsigned int width_, unsigned int height_, unsigned int numThreads = 0);
+
+	// emitters_ holds the indices of the spheres with an emissive material
+	void setScene(const std::vector<Material>& materials_, const std::vector<Sphere>& spheres_, const std::vector<Triangle>& triangles_, const std::vector<Quad>& quads_,
+		const std::vector<PointLight>& pointLights_, const std::vector<unsigned int>& emitters_, const BVH& bvh_);
+	// Copies the skybox and its sampling tables so the caller is free to release its own data
+	void setSkybox(const EnvironmentMap& map, const EnvironmentDistribution& envDistribution_);
+	void setCamera(const glm::vec3& cameraPos_, const glm::vec3& ray00_, const glm::vec3& ray10_, const glm::vec3& ray01_, const glm::vec3& ray11_);
+
+	// Accumulates one more frame into image, numAccumFrames is the number of frames already accumulated
+	void render(int numAccumFrames);
+	// Edge-avoiding a-trous filter over image, the same passes as STAGE_DENOISE_VARIANCE and STAGE_DENOISE
+	void denoise(std::vector<glm::vec4>& output);
+
+	const unsigned int width, height;
+	std::vector<glm::vec4> image;
+	// First hit albedo and normal + camera ray distance, accumulated next to image like imgAlbedo and imgNormalDepth
+	std::vector<glm::vec4> albedo;
+	std::vector<glm::vec4> normalDepth;
+
+	// Traverse the SIMD wide BVH instead of the scalar binary one, has no effect without a vector ISA
+	bool useWideBVH = true;
+
+	// Same convergence test as the GPU stages, see pixelConverged in raytracer.comp
+	bool adaptiveSampling = false;
+	float errorThreshold = 0.02f;
+
+	// Next event estimation towards the skybox, same as envSampling in raytracer.comp
+	bool envSampling = true;
+
+	// Sampler, same as randMode in raytracer.comp: 0 = Owen scrambled Sobol, 1 = independent PCG hashes
+	int randMode = 0;
+	// Mixed into every pixel's scramble seed when set, gives renders sample sequences independent of the default ones
+	uint32_t scrambleSeed = 0;
+
+	// Hard bounce cap, the same as MAX_BOUNCES in raytracer.comp
+	static const unsigned int MAX_BOUNCES = 32;
+
+	// Stats from the last call to render
+	double lastFrameTime = 0.0;
+	unsigned long long lastRayCount = 0;	// Extend and shadow rays
+	unsigned long long lastShadowRayCount = 0;
+	unsigned int lastActivePixels = 0;
+	// Paths that ended after each bounce count, MAX_BOUNCES + 1 entries
+	std::vector<unsigned long long> lastPathLengths = std::vector<unsigned long long>(MAX_BOUNCES + 1, 0);
+
+private:
+	const unsigned int TILE_SIZE = 16;
+	static const int BVH_STACK_SIZE = 64;
+	const unsigned int ROULETTE_MIN_BOUNCE = 3;
+	const int MAX_SAMPLES = 1;
+	const float ADAPTIVE_MIN_SAMPLES = 16.0f;
+	const float ADAPTIVE_MIN_LUMINANCE = 0.05f;
+	const float CONE_DIFFUSE_SPREAD = 0.1f;
+	// Denoiser settings, see DENOISE_* in raytracer.comp
+	const unsigned int DENOISE_ITERATIONS = 5;
+	const float DENOISE_SIGMA_LUMINANCE = 4.0f;
+	const float DENOISE_SIGMA_NORMAL = 128.0f;
+	const float DENOISE_SIGMA_DEPTH = 1.0f;
+	const float DENOISE_SIGMA_ALBEDO = 0.1f;
+	const float DENOISE_MIN_SAMPLES = 4.0f;
+	const float DENOISE_SKY_DEPTH = 1e4f;
+	// 2D sample slots of every bounce, see SAMPLE_* in raytracer.comp
+	enum SampleDim { SAMPLE_CAMERA, SAMPLE_LOBE, SAMPLE_DIFFUSE, SAMPLE_LIGHT, SAMPLE_PICK, SAMPLE_EMITTER, SAMPLE_ROULETTE, SAMPLE_DIMS };
+
+	// Counted per tile and summed into the atomics below once the tile is done
+	struct TraceStats {
+		unsigned int numRays = 0;
+		unsigned int shadowRays = 0;
+		unsigned int pathLengths[MAX_BOUNCES + 1] = {};
+	};
+
+	void renderTile(unsigned int tileIdx, int numAccumFrames);
+
+	glm::vec3 sampleSkyboxLevel(unsigned int level, const glm::vec2& uv) const;
+	glm::vec3 sampleSkybox(const glm::vec3& dir, float coneSpread) const;
+	bool useEnvSampling() const;
+	unsigned int numLightSources() const;
+	float emitterPdf(unsigned int sphereIdx, const glm::vec3& pos) const;
+
+	bool intersectSphere(const Sphere& sphere, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const;
+	bool intersectTriangle(const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const;
+	bool intersectQuad(const Quad& quad, unsigned int prim, const Ray& ray, Hit& hit, bool hitBackface) const;
+	bool intersectPrimitive(unsigned int primRef, const Ray& ray, Hit& hit, bool hitBackface) const;
+	float intersectAABB(const glm::vec3& bboxMin, const glm::vec3& bboxMax, const Ray& ray, const glm::vec3& invDir, float tMax) const;
+	bool intersectObjects(const Ray& ray, Hit& hit, bool hitBackface) const;
+	const Material& getMaterial(unsigned int primRef) const;
+	float computeFresnelRatio(float cosi, float n1, float n2) const;
+
+	glm::vec2 sample2D(uint32_t pixelSeed, uint32_t sampleIndex, unsigned int bounce, unsigned int dim) const;
+	glm::vec3 traceRay(Ray ray, uint32_t pixelSeed, uint32_t sampleIndex, TraceStats& stats, glm::vec3& firstAlbedo, glm::vec4& firstNormalDepth) const;
+	Ray getJitteredStartRay(const glm::ivec2& txlCoords, uint32_t pixelSeed, uint32_t sampleIndex) const;
+	float pixelSpreadAngle() const;
+	bool pixelConverged(const glm::vec4& moments) const;
+	glm::vec3 renderMethod(const glm::ivec2& coord, uint32_t pixelSeed, uint32_t frame, glm::vec4& moments, glm::vec4& pixelAlbedo, glm::vec4& pixelNormalDepth, TraceStats& stats) const;
+
+	float featureWeight(const glm::vec4& centerNormalDepth, const glm::vec3& centerAlbedo, float depthScale, unsigned int q) const;
+	float depthGradient(int x, int y) const;
+	float filteredVariance(const std::vector<glm::vec4>& filterIn, int x, int y) const;
+	void estimateVariance(unsigned int y, std::vector<glm::vec4>& filterOut) const;
+	void denoiseIteration(unsigned int y, int step, const std::vector<glm::vec4>& filterIn, std::vector<glm::vec4>& filterOut) const;
+
+	ThreadPool pool;
+	std::atomic<unsigned long long> rayCounter{ 0 };
+	std::atomic<unsigned long long> shadowRayCounter{ 0 };
+	std::atomic<unsigned long long> pathLengthCounters[MAX_BOUNCES + 1] = {};
+	std::atomic<unsigned int> activeCounter{ 0 };
+
+	// Luminance moments per pixel (mean, mean of squares, sample count), laid out like image
+	std::vector<glm::vec4> moments;
+	// Ping-pong buffer of the denoiser
+	std::vector<glm::vec4> filterTemp;
+
+	std::vector<Material> materials;
+	std::vector<Sphere> spheres;
+	std::vector<Triangle> triangles;
+	std::vector<Quad> quads;
+	std::vector<PointLight> pointLights;
+	std::vector<unsigned int> emitters;
+	BVH bvh;
+	WideBVH wideBvh;
+
+	// Every mip level of the skybox
+	struct SkyLevel {
+		int width, height;
+		std::vector<glm::vec3> texels;
+	};
+	std::vector<SkyLevel> skyLevels;
+	EnvironmentDistribution envDistribution;
+
+	glm::vec3 cameraPos;
+	glm::vec3 ray00, ray10, ray01, ray11;
+};
@@ -4,11 +4,9 @@ in vec2 TexCoords;
 
 out vec4 FragColor;
 
+// Already tone mapped and sRGB encoded at the window's size by the resolve stage, one texel per fragment
 uniform sampler2D tex;
 
 void main() {
-	//float gamma = 2.2;
-	//vec3 texCol = pow(texture(tex, TexCoords).rgb, vec3(1.0 / gamma));
-	vec3 texCol = texture(tex, TexCoords).rgb;
-	FragColor = vec4(texCol, 1.0);
+	FragColor = vec4(texelFetch(tex, ivec2(gl_FragCoord.xy), 0).rgb, 1.0);
 }
\ No newline at end of file
@@ -0,0 +1,228 @@
+#include "envmap.h"
+
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+
+#include <glm/gtc/packing.hpp>
+
+#include "stb_image.h"
+
+#define PI 3.1415926538f
+
+static const char ENV_CACHE_MAGIC[8] = { 'R', 'T', 'E', 'N', 'V', 'M', 'A', 'P' };
+
+EnvironmentMap::EnvironmentMap(const std::string& filename) {
+	levels.assign(1, blackTexel);
+
+	std::error_code error;
+	uint64_t sourceSize = std::filesystem::file_size(filename, error);
+	if (error) {
+		std::cout << "Failed to open skybox: " << filename << std::endl;
+		return;
+	}
+	int64_t sourceTime = (int64_t)std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+
+	std::string cacheFile = filename + ".envcache";
+	if (openCache(cacheFile, sourceSize, sourceTime)) return;
+
+	std::cout << "Building skybox cache: " << cacheFile << std::endl;
+	if (!convertHDR(filename, cacheFile, sourceSize, sourceTime) || !openCache(cacheFile, sourceSize, sourceTime)) {
+		std::cout << "Failed to load skybox: " << filename << std::endl;
+	}
+}
+
+EnvironmentMap::~EnvironmentMap() {
+	delete cache;
+}
+
+glm::vec3 EnvironmentMap::texel(unsigned int x, unsigned int y, unsigned int level) const {
+	const uint16_t* t = levels[level] + (y * levelWidth(level) + x) * 4;
+	return glm::vec3(glm::unpackHalf1x16(t[0]), glm::unpackHalf1x16(t[1]), glm::unpackHalf1x16(t[2]));
+}
+
+bool EnvironmentMap::openCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime) {
+	MappedFile* file = new MappedFile(cacheFile);
+	const EnvironmentCacheHeader* header = reinterpret_cast<const EnvironmentCacheHeader*>(file->data);
+	bool valid = file->isOpen() && file->size >= sizeof(EnvironmentCacheHeader)
+		&& std::memcmp(header->magic, ENV_CACHE_MAGIC, sizeof(ENV_CACHE_MAGIC)) == 0
+		&& header->version == CACHE_VERSION
+		&& header->sourceSize == sourceSize && header->sourceTime == sourceTime
+		&& header->width > 0 && header->height > 0 && header->levelCount > 0;
+
+	size_t expectedSize = sizeof(EnvironmentCacheHeader);
+	if (valid) {
+		for (uint32_t level = 0; level < header->levelCount; level++) {
+			expectedSize += (size_t)std::max(header->width >> level, 1u) * std::max(header->height >> level, 1u) * 4 * sizeof(uint16_t);
+		}
+		valid = file->size >= expectedSize;
+	}
+	// Stale caches are unmapped right away so they can be overwritten
+	if (!valid) {
+		delete file;
+		return false;
+	}
+
+	delete cache;
+	cache = file;
+	width = header->width;
+	height = header->height;
+	levelCount = header->levelCount;
+	levels.clear();
+	const uint16_t* level = reinterpret_cast<const uint16_t*>(cache->data + sizeof(EnvironmentCacheHeader));
+	for (unsigned int i = 0; i < levelCount; i++) {
+		levels.push_back(level);
+		level += (size_t)levelWidth(i) * levelHeight(i) * 4;
+	}
+	return true;
+}
+
+/*
+* Decodes the HDR, applies the skybox transform and box filters it down to 1x1
+* Levels are filtered in float and only rounded to half when written
+*/
+bool EnvironmentMap::convertHDR(const std::string& hdrFile, const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime) {
+	int w, h, channels;
+	float* data = stbi_loadf(hdrFile.c_str(), &w, &h, &channels, 3);
+	if (data == nullptr) {
+		std::cout << "Failed to decode skybox: " << stbi_failure_reason() << std::endl;
+		return false;
+	}
+
+	std::vector<glm::vec4> level(w * h);
+	for (int i = 0; i < w * h; i++) {
+		glm::vec3 color = glm::vec3(data[i * 3], data[i * 3 + 1], data[i * 3 + 2]);
+		level[i] = glm::vec4(glm::min(glm::vec3(MAX_RADIANCE), color), 1.0f);
+	}
+	stbi_image_free(data);
+
+	EnvironmentCacheHeader header;
+	std::memcpy(header.magic, ENV_CACHE_MAGIC, sizeof(ENV_CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.width = (uint32_t)w;
+	header.height = (uint32_t)h;
+	header.levelCount = 1;
+	while ((std::max(w, h) >> header.levelCount) > 0) header.levelCount++;
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+
+	// Write to a temporary file first so an interrupted conversion never leaves a truncated cache behind
+	std::string tempFile = cacheFile + ".tmp";
+	{
+		std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+
+		std::vector<uint16_t> halfs;
+		int levelW = w, levelH = h;
+		for (uint32_t i = 0; i < header.levelCount; i++) {
+			halfs.resize(level.size() * 4);
+			for (size_t t = 0; t < level.size(); t++) {
+				for (int c = 0; c < 4; c++) halfs[t * 4 + c] = glm::packHalf1x16(level[t][c]);
+			}
+			out.write(reinterpret_cast<const char*>(halfs.data()), halfs.size() * sizeof(uint16_t));
+			if (i + 1 == header.levelCount) break;
+
+			// Odd sizes clamp the 2x2 footprint at the last row/column
+			int nextW = std::max(levelW / 2, 1), nextH = std::max(levelH / 2, 1);
+			std::vector<glm::vec4> next(nextW * nextH);
+			for (int y = 0; y < nextH; y++) {
+				int y0 = std::min(y * 2, levelH - 1), y1 = std::min(y * 2 + 1, levelH - 1);
+				for (int x = 0; x < nextW; x++) {
+					int x0 = std::min(x * 2, levelW - 1), x1 = std::min(x * 2 + 1, levelW - 1);
+					next[y * nextW + x] = 0.25f * (level[y0 * levelW + x0] + level[y0 * levelW + x1] + level[y1 * levelW + x0] + level[y1 * levelW + x1]);
+				}
+			}
+			level.swap(next);
+			levelW = nextW;
+			levelH = nextH;
+		}
+		if (!out) return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(tempFile, cacheFile, error);
+	return !error;
+}
+
+//========================================================
+
+void EnvironmentDistribution::build(const EnvironmentMap& map) {
+	width = (int)map.width;
+	height = (int)map.height;
+	marginalCdf.assign(height, 0.0f);
+	conditionalCdf.assign(width * height, 0.0f);
+
+	// Accumulate in double, a 2k sky sums millions of weights
+	std::vector<double> rowSums(height, 0.0);
+	double sum = 0.0;
+	for (int y = 0; y < height; y++) {
+		float sinTheta = std::sin(PI * ((float)y + 0.5f) / (float)height);
+		double rowSum = 0.0;
+		for (int x = 0; x < width; x++) {
+			rowSum += glm::dot(map.texel(x, y), glm::vec3(0.2126f, 0.7152f, 0.0722f)) * sinTheta;
+			conditionalCdf[y * width + x] = (float)rowSum;
+		}
+
+		// Rows without any light are never picked by the marginal, a uniform CDF keeps them well defined
+		float* row = &conditionalCdf[y * width];
+		for (int x = 0; x < width; x++) {
+			row[x] = (rowSum > 0.0) ? (float)(row[x] / rowSum) : (float)(x + 1) / (float)width;
+		}
+		row[width - 1] = 1.0f;
+
+		rowSums[y] = rowSum;
+		sum += rowSum;
+	}
+
+	double running = 0.0;
+	for (int y = 0; y < height; y++) {
+		running += rowSums[y];
+		marginalCdf[y] = (sum > 0.0) ? (float)(running / sum) : (float)(y + 1) / (float)height;
+	}
+	marginalCdf[height - 1] = 1.0f;
+	total = (float)sum;
+}
+
+// First entry of the inclusive CDF above xi
+int EnvironmentDistribution::findInterval(const float* cdf, int count, float xi) {
+	int idx = (int)(std::upper_bound(cdf, cdf + count, xi) - cdf);
+	return std::min(idx, count - 1);
+}
+
+glm::vec3 EnvironmentDistribution::sample(const glm::vec2& xi, float& pdf) const {
+	int y = findInterval(marginalCdf.data(), height, xi.y);
+	float m0 = (y > 0) ? marginalCdf[y - 1] : 0.0f;
+	float m1 = marginalCdf[y];
+
+	const float* row = &conditionalCdf[y * width];
+	int x = findInterval(row, width, xi.x);
+	float c0 = (x > 0) ? row[x - 1] : 0.0f;
+	float c1 = row[x];
+
+	// Place the sample inside the texel by where xi fell in its CDF interval
+	float u = ((float)x + glm::clamp((xi.x - c0) / (c1 - c0), 0.0f, 1.0f)) / (float)width;
+	float v = ((float)y + glm::clamp((xi.y - m0) / (m1 - m0), 0.0f, 1.0f)) / (float)height;
+
+	float theta = PI * v;
+	float phi = 2.0f * PI * (u - 0.5f);
+	float sinTheta = std::sin(theta);
+	glm::vec3 dir = glm::vec3(sinTheta * std::sin(phi), std::cos(theta), sinTheta * std::cos(phi));
+
+	// Texel probability times the texel count gives the density over (u, v), the rest is the equirect jacobian
+	pdf = (sinTheta > 0.0f) ? (m1 - m0) * (float)height * (c1 - c0) * (float)width / (2.0f * PI * PI * sinTheta) : 0.0f;
+	return dir;
+}
+
+float EnvironmentDistribution::pdf(const glm::vec3& dir) const {
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - dir.y * dir.y));
+	if (sinTheta <= 0.0f) return 0.0f;
+	int x = glm::clamp((int)((float)width * (0.5f + std::atan2(dir.x, dir.z) / (2 * PI))), 0, width - 1);
+	int y = glm::clamp((int)((float)height * (0.5f + std::asin(-dir.y) / PI)), 0, height - 1);
+
+	float marginal = marginalCdf[y] - ((y > 0) ? marginalCdf[y - 1] : 0.0f);
+	const float* row = &conditionalCdf[y * width];
+	float conditional = row[x] - ((x > 0) ? row[x - 1] : 0.0f);
+	return marginal * (float)height * conditional * (float)width / (2.0f * PI * PI * sinTheta);
+}
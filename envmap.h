@@ -0,0 +1,87 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+
+/*
+	Equirectangular skybox loaded from an HDR file
+	- The first load decodes the HDR and writes a binary cache next to it (<file>.envcache)
+	- The cache already holds what sampleSkybox returns, linear radiance clamped to MAX_RADIANCE, as RGBA16F with a full mip chain
+	- Later loads memory map the cache and upload the levels straight from it, nothing is decoded or converted
+	- The cache is rebuilt whenever the HDR's size or modification time no longer match the ones stored in it
+*/
+
+struct EnvironmentCacheHeader {
+	char magic[8];			// "RTENVMAP"
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t levelCount;
+	uint64_t sourceSize;	// Size and modification time of the HDR the cache was built from
+	int64_t sourceTime;
+	// Followed by levelCount mip levels, largest first, each a row by row array of RGBA16F texels (4 halfs)
+};
+
+class EnvironmentMap {
+public:
+	// A missing or unreadable HDR leaves a 1x1 black sky so scenes with their own lights still render
+	EnvironmentMap(const std::string& filename);
+	~EnvironmentMap();
+
+	EnvironmentMap(const EnvironmentMap&) = delete;
+	EnvironmentMap& operator=(const EnvironmentMap&) = delete;
+
+	bool isLoaded() const { return cache != nullptr; }
+
+	unsigned int levelWidth(unsigned int level) const { return std::max(width >> level, 1u); }
+	unsigned int levelHeight(unsigned int level) const { return std::max(height >> level, 1u); }
+	glm::vec3 texel(unsigned int x, unsigned int y, unsigned int level = 0) const;
+
+	unsigned int width = 1, height = 1, levelCount = 1;
+	// RGBA16F texels of every mip level, point into the mapped cache file
+	std::vector<const uint16_t*> levels;
+
+private:
+	static const uint32_t CACHE_VERSION = 2;	// 2: linear radiance, version 1 caches stored pow(texel, 1/2.2)
+	static constexpr float MAX_RADIANCE = 158.0f;	// Bounds BSDF sampled hits of the sun, the old ceiling of 10 before gamma
+
+	bool openCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime);
+	static bool convertHDR(const std::string& hdrFile, const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime);
+
+	MappedFile* cache = nullptr;
+	uint16_t blackTexel[4] = { 0, 0, 0, 0 };
+};
+
+/*
+	Importance sampling tables for the equirectangular skybox
+	- Every texel is weighted by its luminance times sin(theta), the solid angle it covers
+	- marginalCdf picks a row, conditionalCdf (width entries per row) picks the texel within that row
+	- Both are inclusive CDFs normalised to 1 and uploaded as is to EnvironmentBuffer in raytracer.comp
+	- Directions map to texels exactly like sampleSkybox: u = 0.5 + atan(x, z) / 2pi, v = 0.5 + asin(-y) / pi
+*/
+
+class EnvironmentDistribution {
+public:
+	// Built from the top level of the skybox
+	void build(const EnvironmentMap& map);
+
+	// Direction towards the sky for two uniform numbers in [0, 1), pdf is per solid angle
+	glm::vec3 sample(const glm::vec2& xi, float& pdf) const;
+	float pdf(const glm::vec3& dir) const;
+	// False for a black sky, there is nothing worth sampling then
+	bool valid() const { return total > 0.0f; }
+
+	int width = 0, height = 0;
+	float total = 0.0f;	// Sum of all texel weights
+	std::vector<float> marginalCdf;
+	std::vector<float> conditionalCdf;
+
+private:
+	static int findInterval(const float* cdf, int count, float xi);
+};
@@ -0,0 +1,10 @@
+#include "globals.h"
+
+namespace globals {
+	unsigned int WINDOW_WIDTH = 1350, WINDOW_HEIGHT = 1350;
+	unsigned int TEXTURE_WIDTH = 1024, TEXTURE_HEIGHT = 1024;
+	unsigned int GROUP_SIZE_X = 8, GROUP_SIZE_Y = 8;
+	unsigned int TILE_WIDTH = 512, TILE_HEIGHT = 512;
+	unsigned int TILES_PER_DRAW = 0;
+	unsigned int FRAMES_IN_FLIGHT = 2;
+}
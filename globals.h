@@ -2,6 +2,14 @@
 
 // Header file storing global constants and variables
 namespace globals {
-	const unsigned int WINDOW_WIDTH = 1350, WINDOW_HEIGHT = 1350;
-	const double HALF_WW = WINDOW_WIDTH / 2.0, HALF_WH = WINDOW_HEIGHT / 2.0;
-}
\ No newline at end of file
+	// Runtime parameters, set from the command line in main before any Scene is created
+	extern unsigned int WINDOW_WIDTH, WINDOW_HEIGHT;
+	extern unsigned int TEXTURE_WIDTH, TEXTURE_HEIGHT;
+	// Compute workgroup size of the per pixel stages, the queue driven stages use GROUP_SIZE_X * GROUP_SIZE_Y flat
+	extern unsigned int GROUP_SIZE_X, GROUP_SIZE_Y;
+	// GPU frames are rendered as tiles of this size, TILES_PER_DRAW > 0 spreads a frame over several draw calls
+	extern unsigned int TILE_WIDTH, TILE_HEIGHT;
+	extern unsigned int TILES_PER_DRAW;
+	// GPU frames the CPU may queue ahead of the one the GPU is working on, 1 to 4
+	extern unsigned int FRAMES_IN_FLIGHT;
+}
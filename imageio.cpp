@@ -0,0 +1,74 @@
+#include "imageio.h"
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+#include "stb_image.h"
+#define STB_IMAGE_WRITE_IMPLEMENTATION
+#include "stb_image_write.h"
+
+static bool hasExtension(const std::string& filename, const std::string& ext) {
+	if (filename.size() < ext.size()) return false;
+	std::string tail = filename.substr(filename.size() - ext.size());
+	std::transform(tail.begin(), tail.end(), tail.begin(), ::tolower);
+	return tail == ext;
+}
+
+// Display transform of one channel, must match filmicCurve and encodeSRGB in raytracer.comp
+static float displayEncode(float x) {
+	x = std::max(x, 0.0f);
+	x = std::min(std::max((x * (2.51f * x + 0.03f)) / (x * (2.43f * x + 0.59f) + 0.14f), 0.0f), 1.0f);
+	return (x < 0.0031308f) ? x * 12.92f : 1.055f * std::pow(x, 1.0f / 2.4f) - 0.055f;
+}
+
+bool writeImage(const std::string& filename, unsigned int width, unsigned int height, const std::vector<glm::vec4>& pixels, float exposure) {
+	// Both GL textures and the CPU image store the bottom row first
+	stbi_flip_vertically_on_write(1);
+
+	int result = 0;
+	if (hasExtension(filename, ".hdr")) {
+		std::vector<float> rgb(width * height * 3);
+		for (unsigned int i = 0; i < width * height; i++) {
+			rgb[i * 3 + 0] = pixels[i].x;
+			rgb[i * 3 + 1] = pixels[i].y;
+			rgb[i * 3 + 2] = pixels[i].z;
+		}
+		result = stbi_write_hdr(filename.c_str(), width, height, 3, rgb.data());
+	}
+	else if (hasExtension(filename, ".png")) {
+		std::vector<unsigned char> rgb(width * height * 3);
+		float scale = std::exp2(exposure);
+		for (unsigned int i = 0; i < width * height; i++) {
+			for (int c = 0; c < 3; c++) {
+				rgb[i * 3 + c] = (unsigned char)(displayEncode(pixels[i][c] * scale) * 255.0f + 0.5f);
+			}
+		}
+		result = stbi_write_png(filename.c_str(), width, height, 3, rgb.data(), width * 3);
+	}
+	else {
+		std::cout << "Unsupported image format: " << filename << " (expected .hdr or .png)" << std::endl;
+		return false;
+	}
+
+	if (!result) std::cout << "Failed to write image: " << filename << std::endl;
+	return result != 0;
+}
+
+bool readImage(const std::string& filename, unsigned int& width, unsigned int& height, std::vector<glm::vec4>& pixels) {
+	stbi_set_flip_vertically_on_load(1);
+	int w, h, channels;
+	float* data = stbi_loadf(filename.c_str(), &w, &h, &channels, 3);
+	// The skybox loader expects the top row first
+	stbi_set_flip_vertically_on_load(0);
+	if (data == nullptr) return false;
+
+	width = (unsigned int)w;
+	height = (unsigned int)h;
+	pixels.resize((size_t)w * h);
+	for (size_t i = 0; i < pixels.size(); i++) {
+		pixels[i] = glm::vec4(data[i * 3 + 0], data[i * 3 + 1], data[i * 3 + 2], 1.0f);
+	}
+	stbi_image_free(data);
+	return true;
+}
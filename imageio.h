@@ -0,0 +1,13 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+// Writes an RGBA32F image laid out like imgOutput (row 0 at the bottom) to disk
+// The format is picked from the extension: .hdr keeps the linear radiance, .png goes through the same exposure (in stops),
+// filmic curve and sRGB encoding as the resolve stage in raytracer.comp
+bool writeImage(const std::string& filename, unsigned int width, unsigned int height, const std::vector<glm::vec4>& pixels, float exposure = 0.0f);
+// Reads an .hdr image back in the same layout, returns false if it could not be loaded
+bool readImage(const std::string& filename, unsigned int& width, unsigned int& height, std::vector<glm::vec4>& pixels);
@@ -7,15 +7,233 @@
 #define new DEBUG_NEW
 #endif
 
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 
 #include "globals.h"
 #include "scene.h"
+#include "benchmark.h"
+
+
+// Command line options, everything defaults to the interactive window
+struct Options {
+	bool headless = false;
+	bool benchmark = false;
+	bool benchmarkReference = false;
+	std::string benchmarkDir = "benchmarks";
+	std::string scene = Scene::SCENE_NAMES[0];
+	bool sceneGiven = false;
+	bool useCPU = false;
+	bool scalarBVH = false;
+	bool noEnvSampling = false;
+	bool pathStats = false;
+	bool denoise = false;
+	bool edit = false;
+	float adaptiveThreshold = 0.0f;	// 0 leaves adaptive sampling off
+	float exposure = 0.0f;
+	unsigned int spp = 256;
+	std::string outFile = "render.hdr";
+	std::string metricsFile;	// Empty leaves the metrics export off
+};
+
+static void printUsage() {
+	std::cout << "Usage: RayTracer [options]" << std::endl;
+	std::cout << "  --width N, --height N   Render resolution (default 1024x1024)" << std::endl;
+	std::cout << "  --window N              Window size for interactive mode (default 1350)" << std::endl;
+	std::cout << "  --group XxY             Compute workgroup size of the GPU per pixel stages (default 8x8)" << std::endl;
+	std::cout << "  --tile WxH              GPU frames are rendered in tiles of this size (default 512x512)" << std::endl;
+	std::cout << "  --tiles-per-draw N      Spread every GPU frame over several window updates, N tiles each (default 0 = whole frame)" << std::endl;
+	std::cout << "  --frames-in-flight N    GPU frames the CPU may queue before waiting for the oldest one, 1 to 4 (default 2)" << std::endl;
+	std::cout << "  --backend cpu|gpu       Renderer to start with (default gpu)" << std::endl;
+	std::cout << "  --scene NAME            Scene to load: sunset (default), balls, greyscale, cornell or a .scene file" << std::endl;
+	std::cout << "  --adaptive T            Stop sampling pixels once their relative error is below T (e.g. 0.02), spp becomes the upper bound" << std::endl;
+	std::cout << "  --scalar-bvh            Trace CPU rays through the binary BVH instead of the SIMD wide one" << std::endl;
+	std::cout << "  --no-env-sampling       Only find the skybox through BSDF bounces, no shadow rays towards it" << std::endl;
+	std::cout << "  --path-stats            Print rays per frame and the path length histogram (GPU renders wait for every frame)" << std::endl;
+	std::cout << "  --denoise               Run the a-trous denoiser over the headless render (on by default in the window, N toggles it)" << std::endl;
+	std::cout << "  --edit                  Add, move, recolor and remove a few objects through the scene edit API before rendering" << std::endl;
+	std::cout << "  --exposure EV           Exposure in stops ahead of the filmic tone curve, for the window and .png output (default 0, +/- adjust it)" << std::endl;
+	std::cout << "  --metrics FILE          Write per frame CPU/GPU timings to FILE (.csv, otherwise JSON lines) and print percentile summaries" << std::endl;
+	std::cout << "  --headless              Render offline without a window and exit (implies --backend cpu unless gpu is given)" << std::endl;
+	std::cout << "  --spp N                 Samples per pixel to accumulate in headless mode (default 256)" << std::endl;
+	std::cout << "  --benchmark             Render every scene (or just --scene) at 256x256 on both backends (only the CPU with --backend cpu)" << std::endl;
+	std::cout << "                          and print time, samples/sec, rays/sec and RMSE against the references, --spp defaults to 64" << std::endl;
+	std::cout << "  --benchmark-reference   Render the 4096 spp CPU references first, implies --benchmark" << std::endl;
+	std::cout << "  --benchmark-dir DIR     Where the references are kept (default benchmarks)" << std::endl;
+	std::cout << "  --out FILE              Output image for headless mode, .hdr or .png (default render.hdr)" << std::endl;
+}
+
+// Parses "AxB", returns false on anything else
+static bool parseSize(const char* str, unsigned int& a, unsigned int& b) {
+	return std::sscanf(str, "%ux%u", &a, &b) == 2;
+}
+
+// Returns false if the arguments could not be parsed
+static bool parseOptions(int argc, char** argv, Options& options) {
+	bool backendGiven = false;
+	bool sppGiven = false;
+	for (int i = 1; i < argc; i++) {
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--headless") options.headless = true;
+		else if (arg == "--width" && hasValue) globals::TEXTURE_WIDTH = std::atoi(argv[++i]);
+		else if (arg == "--height" && hasValue) globals::TEXTURE_HEIGHT = std::atoi(argv[++i]);
+		else if (arg == "--window" && hasValue) globals::WINDOW_WIDTH = globals::WINDOW_HEIGHT = std::atoi(argv[++i]);
+		else if (arg == "--group" && hasValue) {
+			if (!parseSize(argv[++i], globals::GROUP_SIZE_X, globals::GROUP_SIZE_Y)) return false;
+		}
+		else if (arg == "--tile" && hasValue) {
+			if (!parseSize(argv[++i], globals::TILE_WIDTH, globals::TILE_HEIGHT)) return false;
+		}
+		else if (arg == "--tiles-per-draw" && hasValue) globals::TILES_PER_DRAW = std::atoi(argv[++i]);
+		else if (arg == "--frames-in-flight" && hasValue) {
+			int frames = std::atoi(argv[++i]);
+			if (frames < 1 || frames > 4) return false;
+			globals::FRAMES_IN_FLIGHT = frames;
+		}
+		else if (arg == "--adaptive" && hasValue) options.adaptiveThreshold = (float)std::atof(argv[++i]);
+		else if (arg == "--scalar-bvh") options.scalarBVH = true;
+		else if (arg == "--no-env-sampling") options.noEnvSampling = true;
+		else if (arg == "--path-stats") options.pathStats = true;
+		else if (arg == "--denoise") options.denoise = true;
+		else if (arg == "--edit") options.edit = true;
+		else if (arg == "--exposure" && hasValue) options.exposure = (float)std::atof(argv[++i]);
+		else if (arg == "--spp" && hasValue) {
+			options.spp = std::atoi(argv[++i]);
+			sppGiven = true;
+		}
+		else if (arg == "--scene" && hasValue) {
+			options.scene = argv[++i];
+			options.sceneGiven = true;
+			bool builtIn = std::find(Scene::SCENE_NAMES.begin(), Scene::SCENE_NAMES.end(), options.scene) != Scene::SCENE_NAMES.end();
+			if (!builtIn && !Scene::isSceneFile(options.scene)) return false;
+		}
+		else if (arg == "--benchmark") options.benchmark = true;
+		else if (arg == "--benchmark-reference") options.benchmark = options.benchmarkReference = true;
+		else if (arg == "--benchmark-dir" && hasValue) options.benchmarkDir = argv[++i];
+		else if (arg == "--out" && hasValue) options.outFile = argv[++i];
+		else if (arg == "--metrics" && hasValue) options.metricsFile = argv[++i];
+		else if (arg == "--backend" && hasValue) {
+			std::string backend = argv[++i];
+			if (backend != "cpu" && backend != "gpu") return false;
+			options.useCPU = backend == "cpu";
+			backendGiven = true;
+		}
+		else return false;
+	}
+	if (options.headless && !backendGiven) options.useCPU = true;
+	if (options.benchmark && !sppGiven) options.spp = BENCHMARK_SPP;
+	// 1024 invocations is the smallest GL_MAX_COMPUTE_WORK_GROUP_INVOCATIONS an implementation may have
+	unsigned int groupInvocations = globals::GROUP_SIZE_X * globals::GROUP_SIZE_Y;
+	if (groupInvocations == 0 || groupInvocations > 1024 || globals::TILE_WIDTH == 0 || globals::TILE_HEIGHT == 0) return false;
+	return globals::TEXTURE_WIDTH > 0 && globals::TEXTURE_HEIGHT > 0 && globals::WINDOW_WIDTH > 0 && options.spp > 0;
+}
+
+// OpenGL context for offline GPU renders, returns null if none could be created
+static GLFWwindow* createHiddenWindow() {
+	glfwInit();
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 6);
+	glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+	// The context still needs a driver, the window is just never shown
+	glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+	GLFWwindow* window = glfwCreateWindow(globals::WINDOW_WIDTH, globals::WINDOW_HEIGHT, "Test", NULL, NULL);
+	if (window == nullptr) {
+		std::cout << "Failed to create an OpenGL context, use --backend cpu on machines without a GPU" << std::endl;
+		glfwTerminate();
+		return nullptr;
+	}
+	glfwMakeContextCurrent(window);
+	gladLoadGL();
+	return window;
+}
+
+// Renders a fixed sample budget to a file, only touches GLFW/OpenGL when the GPU backend is requested
+static int runHeadless(const Options& options) {
+	// Match the camera aspect ratio to the image since nothing is stretched onto a window
+	globals::WINDOW_WIDTH = globals::TEXTURE_WIDTH;
+	globals::WINDOW_HEIGHT = globals::TEXTURE_HEIGHT;
+
+	GLFWwindow* window = nullptr;
+	if (!options.useCPU) {
+		window = createHiddenWindow();
+		if (window == nullptr) return 1;
+	}
+
+	Scene* scene = new Scene(window, options.useCPU, options.scene);
+	scene->cpuTracer->useWideBVH = !options.scalarBVH;
+	scene->envSampling = !options.noEnvSampling;
+	scene->pathStats = options.pathStats;
+	if (!scene->isValid() || (!options.metricsFile.empty() && !scene->profiler->openMetrics(options.metricsFile))) {
+		delete scene;
+		if (window != nullptr) {
+			glfwDestroyWindow(window);
+			glfwTerminate();
+		}
+		return 1;
+	}
+	scene->denoise = options.denoise;
+	if (options.adaptiveThreshold > 0.0f) {
+		scene->adaptiveSampling = true;
+		scene->errorThreshold = options.adaptiveThreshold;
+	}
+	scene->exposure = options.exposure;
+	if (options.edit) scene->editDemo();
+	bool success = scene->renderOffline(options.spp, options.outFile);
+	delete scene;
 
+	if (window != nullptr) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
+	return success ? 0 : 1;
+}
+
+// Runs the benchmark suite, the GPU runs are skipped with --backend cpu
+static int runBenchmark(const Options& options) {
+	globals::TEXTURE_WIDTH = globals::WINDOW_WIDTH = BENCHMARK_WIDTH;
+	globals::TEXTURE_HEIGHT = globals::WINDOW_HEIGHT = BENCHMARK_HEIGHT;
+	globals::TILE_WIDTH = std::min(globals::TILE_WIDTH, BENCHMARK_WIDTH);
+	globals::TILE_HEIGHT = std::min(globals::TILE_HEIGHT, BENCHMARK_HEIGHT);
+	globals::TILES_PER_DRAW = 0;
+
+	GLFWwindow* window = nullptr;
+	if (!options.useCPU) {
+		window = createHiddenWindow();
+		if (window == nullptr) return 1;
+	}
+
+	BenchmarkOptions benchmarkOptions;
+	benchmarkOptions.directory = options.benchmarkDir;
+	if (options.sceneGiven) benchmarkOptions.scene = options.scene;
+	benchmarkOptions.spp = options.spp;
+	benchmarkOptions.updateReferences = options.benchmarkReference;
+	int result = runBenchmarks(window, benchmarkOptions);
+
+	if (window != nullptr) {
+		glfwDestroyWindow(window);
+		glfwTerminate();
+	}
+	return result;
+}
 
 // Sets up the opengl window, creates Environment variable and calls its draw function
-int main() {
+int main(int argc, char** argv) {
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		printUsage();
+		return 1;
+	}
+	if (options.benchmark) return runBenchmark(options);
+	if (options.headless) return runHeadless(options);
+
 	// Init GLFW
 	glfwInit();
 	// Tell GLFW we are using version 4.6
@@ -37,7 +255,22 @@ int main() {
 	glDisable(GL_DEPTH_TEST);
 
 
-	Scene* scene = new Scene(window);
+	Scene* scene = new Scene(window, options.useCPU, options.scene);
+	scene->cpuTracer->useWideBVH = !options.scalarBVH;
+	scene->envSampling = !options.noEnvSampling;
+	scene->pathStats = options.pathStats;
+	if (!scene->isValid() || (!options.metricsFile.empty() && !scene->profiler->openMetrics(options.metricsFile))) {
+		delete scene;
+		glfwDestroyWindow(window);
+		glfwTerminate();
+		return 1;
+	}
+	if (options.adaptiveThreshold > 0.0f) {
+		scene->adaptiveSampling = true;
+		scene->errorThreshold = options.adaptiveThreshold;
+	}
+	scene->exposure = options.exposure;
+	if (options.edit) scene->editDemo();
 	scene->draw();
 	delete scene;
 
@@ -47,4 +280,4 @@ int main() {
 
 	_CrtSetReportMode(_CRT_WARN, _CRTDBG_MODE_DEBUG);
 	_CrtDumpMemoryLeaks();
-}
\ No newline at end of file
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+
+/*
+	Read-only memory mapping of a whole file
+	- Pages are only read from disk when they are touched so large caches open instantly
+	- isOpen() is false if the file does not exist or could not be mapped
+*/
+class MappedFile {
+public:
+	MappedFile(const std::string& filename);
+	~MappedFile();
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool isOpen() const { return data != nullptr; }
+
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+
+private:
+#ifdef _WIN32
+	void* fileHandle = nullptr;
+	void* mappingHandle = nullptr;
+#else
+	int fd = -1;
+#endif
+};
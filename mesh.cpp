@@ -0,0 +1,136 @@
+#include "mesh.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+static const char MESH_CACHE_MAGIC[8] = { 'R', 'T', 'M', 'E', 'S', 'H', 0, 0 };
+
+Mesh::Mesh(const std::string& filename) {
+	std::error_code error;
+	uint64_t sourceSize = std::filesystem::file_size(filename, error);
+	if (error) {
+		std::cout << "Failed to open mesh: " << filename << std::endl;
+		return;
+	}
+	int64_t sourceTime = (int64_t)std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+
+	std::string cacheFile = filename + ".meshcache";
+	if (openCache(cacheFile, sourceSize, sourceTime)) return;
+
+	std::cout << "Building mesh cache: " << cacheFile << std::endl;
+	if (!convertOBJ(filename, cacheFile, sourceSize, sourceTime) || !openCache(cacheFile, sourceSize, sourceTime)) {
+		std::cout << "Failed to load mesh: " << filename << std::endl;
+	}
+}
+
+Mesh::~Mesh() {
+	delete cache;
+}
+
+bool Mesh::openCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime) {
+	MappedFile* file = new MappedFile(cacheFile);
+	const MeshCacheHeader* header = reinterpret_cast<const MeshCacheHeader*>(file->data);
+	bool valid = file->isOpen() && file->size >= sizeof(MeshCacheHeader)
+		&& std::memcmp(header->magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC)) == 0
+		&& header->version == CACHE_VERSION
+		&& header->sourceSize == sourceSize && header->sourceTime == sourceTime
+		&& file->size >= sizeof(MeshCacheHeader) + (size_t)header->triangleCount * 3 * sizeof(glm::vec4);
+	// Stale caches are unmapped right away so they can be overwritten
+	if (!valid) {
+		delete file;
+		return false;
+	}
+
+	delete cache;
+	cache = file;
+	triangleCount = header->triangleCount;
+	vertices = reinterpret_cast<const glm::vec4*>(cache->data + sizeof(MeshCacheHeader));
+	bboxMin = glm::vec3(header->bboxMin);
+	bboxMax = glm::vec3(header->bboxMax);
+	return true;
+}
+
+// Resolves a 1-based (or negative, relative) OBJ index, returns -1 if out of range
+static long resolveIndex(long index, size_t count) {
+	if (index > 0 && (size_t)index <= count) return index - 1;
+	if (index < 0 && (size_t)(-index) <= count) return (long)count + index;
+	return -1;
+}
+
+/*
+* Parses the positions and faces of an OBJ file, polygons are fan triangulated
+* Normals, texture coordinates, groups and materials are ignored
+*/
+bool Mesh::convertOBJ(const std::string& objFile, const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime) {
+	std::ifstream in(objFile);
+	if (!in) return false;
+
+	std::vector<glm::vec4> positions;
+	std::vector<glm::vec4> triangleVerts;
+	glm::vec3 bmin = glm::vec3(1e30f), bmax = glm::vec3(-1e30f);
+
+	std::string line;
+	std::vector<long> face;
+	while (std::getline(in, line)) {
+		const char* c = line.c_str();
+		while (*c == ' ' || *c == '\t') c++;
+
+		if (c[0] == 'v' && (c[1] == ' ' || c[1] == '\t')) {
+			char* end;
+			float x = std::strtof(c + 2, &end);
+			float y = std::strtof(end, &end);
+			float z = std::strtof(end, &end);
+			positions.push_back(glm::vec4(x, y, z, 1.0f));
+		}
+		else if (c[0] == 'f' && (c[1] == ' ' || c[1] == '\t')) {
+			face.clear();
+			c += 2;
+			while (*c != '\0') {
+				char* end;
+				long index = std::strtol(c, &end, 10);
+				if (end == c) break;
+				face.push_back(resolveIndex(index, positions.size()));
+				// Skip the texture coordinate and normal indices
+				c = end;
+				while (*c != '\0' && *c != ' ' && *c != '\t') c++;
+				while (*c == ' ' || *c == '\t' || *c == '\r') c++;
+			}
+			for (size_t i = 1; i + 1 < face.size(); i++) {
+				if (face[0] < 0 || face[i] < 0 || face[i + 1] < 0) continue;
+				triangleVerts.push_back(positions[face[0]]);
+				triangleVerts.push_back(positions[face[i]]);
+				triangleVerts.push_back(positions[face[i + 1]]);
+			}
+		}
+	}
+	for (const glm::vec4& p : triangleVerts) {
+		bmin = glm::min(bmin, glm::vec3(p));
+		bmax = glm::max(bmax, glm::vec3(p));
+	}
+
+	MeshCacheHeader header;
+	std::memcpy(header.magic, MESH_CACHE_MAGIC, sizeof(MESH_CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.triangleCount = (uint32_t)(triangleVerts.size() / 3);
+	header.sourceSize = sourceSize;
+	header.sourceTime = sourceTime;
+	header.bboxMin = glm::vec4(bmin, 1.0f);
+	header.bboxMax = glm::vec4(bmax, 1.0f);
+
+	// Write to a temporary file first so an interrupted conversion never leaves a truncated cache behind
+	std::string tempFile = cacheFile + ".tmp";
+	{
+		std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(triangleVerts.data()), triangleVerts.size() * sizeof(glm::vec4));
+		if (!out) return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(tempFile, cacheFile, error);
+	return !error;
+}
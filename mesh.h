@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+
+/*
+	Triangle mesh loaded from an OBJ file
+	- The first load parses the OBJ and writes a binary cache next to it (<file>.meshcache)
+	- Later loads memory map the cache, the triangle positions are used in place without any parsing
+	- The cache is rebuilt whenever the OBJ's size or modification time no longer match the ones stored in it
+*/
+
+struct MeshCacheHeader {
+	char magic[8];			// "RTMESH\0\0"
+	uint32_t version;
+	uint32_t triangleCount;
+	uint64_t sourceSize;	// Size and modification time of the OBJ the cache was built from
+	int64_t sourceTime;
+	glm::vec4 bboxMin;
+	glm::vec4 bboxMax;
+	// Followed by triangleCount * 3 vec4 positions (w = 1) so they can be transformed as points directly
+};
+
+class Mesh {
+public:
+	Mesh(const std::string& filename);
+	~Mesh();
+
+	Mesh(const Mesh&) = delete;
+	Mesh& operator=(const Mesh&) = delete;
+
+	bool isLoaded() const { return vertices != nullptr; }
+
+	unsigned int triangleCount = 0;
+	// 3 vertices per triangle, points straight into the mapped cache file
+	const glm::vec4* vertices = nullptr;
+	glm::vec3 bboxMin = glm::vec3(0), bboxMax = glm::vec3(0);
+
+private:
+	static const uint32_t CACHE_VERSION = 1;
+
+	bool openCache(const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime);
+	static bool convertOBJ(const std::string& objFile, const std::string& cacheFile, uint64_t sourceSize, int64_t sourceTime);
+
+	MappedFile* cache = nullptr;
+};
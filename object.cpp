@@ -22,12 +22,12 @@ Material::~Material() {}
 //========================================================
 
 PointLight::PointLight() {
-	pos = glm::vec4(0);
-	material = Material();
+	pos = glm::vec3(0);
+	materialIdx = 0;
 }
-PointLight::PointLight(glm::vec4 pos_, Material material_) {
+PointLight::PointLight(glm::vec3 pos_, unsigned int materialIdx_) {
 	pos = pos_;
-	material = material_;
+	materialIdx = materialIdx_;
 }
 PointLight::~PointLight() {}
 
@@ -35,45 +35,50 @@ PointLight::~PointLight() {}
 
 Sphere::Sphere() {
 	posRad = glm::vec4(0);
-	material = Material();
+	materialIdx = 0;
+	pad0 = pad1 = pad2 = 0;
 }
-Sphere::Sphere(glm::vec4 posRad_, Material material_) {
+Sphere::Sphere(glm::vec4 posRad_, unsigned int materialIdx_) {
 	posRad = posRad_;
-	material = material_;
+	materialIdx = materialIdx_;
+	pad0 = pad1 = pad2 = 0;
 }
 Sphere::~Sphere() {}
 
 //========================================================
 
 Triangle::Triangle() {
-	p0 = glm::vec4(0);
-	p1 = glm::vec4(0);
-	p2 = glm::vec4(0);
-	material = Material();
+	p0 = glm::vec3(0);
+	p1 = glm::vec3(0);
+	p2 = glm::vec3(0);
+	materialIdx = 0;
+	pad1 = pad2 = 0;
 }
-Triangle::Triangle(glm::vec4 p0_, glm::vec4 p1_, glm::vec4 p2_, Material material_) {
+Triangle::Triangle(glm::vec3 p0_, glm::vec3 p1_, glm::vec3 p2_, unsigned int materialIdx_) {
 	p0 = p0_;
 	p1 = p1_;
 	p2 = p2_;
-	material = Material();
-
+	materialIdx = materialIdx_;
+	pad1 = pad2 = 0;
 }
 Triangle::~Triangle() {}
 
 //========================================================
 
 Quad::Quad() {
-	c00 = glm::vec4(0);
-	c10 = glm::vec4(0);
-	c01 = glm::vec4(0);
-	c11 = glm::vec4(0);
-	material = Material();
+	c00 = glm::vec3(0);
+	c10 = glm::vec3(0);
+	c01 = glm::vec3(0);
+	c11 = glm::vec3(0);
+	materialIdx = 0;
+	pad1 = pad2 = pad3 = 0;
 }
-Quad::Quad(glm::vec4 c00_, glm::vec4 c10_, glm::vec4 c01_, glm::vec4 c11_, Material material_) {
+Quad::Quad(glm::vec3 c00_, glm::vec3 c10_, glm::vec3 c01_, glm::vec3 c11_, unsigned int materialIdx_) {
 	c00 = c00_;
 	c10 = c10_;
 	c01 = c01_;
 	c11 = c11_;
-	material = material_;
+	materialIdx = materialIdx_;
+	pad1 = pad2 = pad3 = 0;
 }
 Quad::~Quad() {}
\ No newline at end of file
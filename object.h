@@ -12,6 +12,7 @@
 	- ESSENTIALLY sizeof all structs should be a multiple of 16
 		- alignas changes the sizeof a struct
 		- Member functions do NOT
+	- A vec3 followed by a 4 byte scalar packs into 16 bytes under std430, objects use this to store their material index
 */
 
 struct Material {
@@ -20,8 +21,10 @@ struct Material {
 	~Material();
 
 	// Stores material data: 
-	// data.x - smoothness = how distrubed the reflectance rays are/percentage chance to reflect/absorb
-	// data.y - glossiness
+	// data.x - smoothness = chance that a bounce off the gloss is a perfect mirror reflection instead of a diffuse one
+	//          Both backends pick one lobe per bounce rather than blending the mirror and diffuse directions,
+	//          so values between 0 and 1 give a sharp reflection over a diffuse base instead of a blurry reflection
+	// data.y - glossiness, kept for the scene format but not used by the shading
 	// data.z - index of refraction
 	// data.w - lightPower = if the material type is a light defines the lights power otherwise 0
 	// 
@@ -53,47 +56,54 @@ struct Material {
 
 // All object types are individual structs
 // Each object type is passed to the shader as a separate SSBO
+// Materials live in their own buffer and objects only store an index into it
 
 struct PointLight {
 	PointLight();
-	PointLight(glm::vec4 pos_, Material material_);
+	PointLight(glm::vec3 pos_, unsigned int materialIdx_);
 	~PointLight();
 
-	glm::vec4 pos;
-	Material material;
+	glm::vec3 pos;
+	unsigned int materialIdx;
 };
 
 struct Sphere {
 	Sphere();
-	Sphere(glm::vec4 posRad_, Material material_);
+	Sphere(glm::vec4 posRad_, unsigned int materialIdx_);
 	~Sphere();
 
 	// posRad.xyz = sphere position
 	// posRad.w = sphere radius
 	glm::vec4 posRad;
-	Material material;
+	unsigned int materialIdx;
+	unsigned int pad0, pad1, pad2;
 };
 
 struct Triangle {
 	Triangle();
-	Triangle(glm::vec4 p0_, glm::vec4 p1_, glm::vec4 p2_, Material material_);
+	Triangle(glm::vec3 p0_, glm::vec3 p1_, glm::vec3 p2_, unsigned int materialIdx_);
 	~Triangle();
 
-	glm::vec4 p0;
-	glm::vec4 p1;
-	glm::vec4 p2;
-	Material material;
+	glm::vec3 p0;
+	unsigned int materialIdx;
+	glm::vec3 p1;
+	float pad1;
+	glm::vec3 p2;
+	float pad2;
 };
 
 struct Quad {
 	Quad();
-	Quad(glm::vec4 c00_, glm::vec4 c10_, glm::vec4 c01_, glm::vec4 c11_, Material material_);
+	Quad(glm::vec3 c00_, glm::vec3 c10_, glm::vec3 c01_, glm::vec3 c11_, unsigned int materialIdx_);
 	~Quad();
 
 	// Plane corner vertices
-	glm::vec4 c00;
-	glm::vec4 c10;
-	glm::vec4 c01;
-	glm::vec4 c11;
-	Material material;
-};
\ No newline at end of file
+	glm::vec3 c00;
+	unsigned int materialIdx;
+	glm::vec3 c10;
+	float pad1;
+	glm::vec3 c01;
+	float pad2;
+	glm::vec3 c11;
+	float pad3;
+};
@@ -0,0 +1,223 @@
+#include "profiler.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+static const char* gpuSectionNames[NUM_GPU_SECTIONS] = { "gpu_compute", "gpu_barrier", "gpu_denoise", "gpu_resolve", "gpu_blit" };
+static const char* cpuSectionNames[NUM_CPU_SECTIONS] = { "cpu_frame", "cpu_input", "cpu_upload", "cpu_render", "cpu_present", "cpu_wait" };
+
+// Nearest rank percentile of already sorted values
+static double percentile(const std::vector<double>& sorted, double p) {
+	if (sorted.empty()) return 0.0;
+	size_t rank = (size_t)(p / 100.0 * (double)(sorted.size() - 1) + 0.5);
+	return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+FrameProfiler::FrameProfiler(bool useGpuTimers_) : useGpuTimers(useGpuTimers_) {
+	current = FrameRecord{ 0, 0, {}, {}, 0, 0, nullptr };
+	if (!useGpuTimers) return;
+	glGenQueries(QUERY_FRAMES * NUM_GPU_SECTIONS, &queries[0][0]);
+
+	const GLbitfield flags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	GLsizeiptr size = QUERY_FRAMES * NUM_COUNTERS * sizeof(GLuint);
+	glCreateBuffers(1, &countersBuffer);
+	glNamedBufferStorage(countersBuffer, size, nullptr, flags);
+	countersMapped = static_cast<const GLuint*>(glMapNamedBufferRange(countersBuffer, 0, size, flags));
+	if (countersMapped == nullptr) std::cout << "Failed to map the GPU counter readback buffer" << std::endl;
+}
+
+FrameProfiler::~FrameProfiler() {
+	if (!useGpuTimers) return;
+	glDeleteQueries(QUERY_FRAMES * NUM_GPU_SECTIONS, &queries[0][0]);
+	for (FrameRecord& record : pending) {
+		if (record.countersFence != nullptr) glDeleteSync(record.countersFence);
+	}
+	if (countersMapped != nullptr) glUnmapNamedBuffer(countersBuffer);
+	glDeleteBuffers(1, &countersBuffer);
+}
+
+bool FrameProfiler::openMetrics(const std::string& filename) {
+	metrics.open(filename, std::ios::out | std::ios::trunc);
+	if (!metrics.is_open()) {
+		std::cout << "Failed to open the metrics file " << filename << std::endl;
+		return false;
+	}
+	csv = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".csv") == 0;
+	if (csv) {
+		metrics << "frame";
+		for (const char* name : cpuSectionNames) metrics << "," << name << "_ms";
+		for (const char* name : gpuSectionNames) metrics << "," << name << "_ms";
+		metrics << ",samples,rays,samples_per_sec,rays_per_sec" << std::endl;
+	}
+	return true;
+}
+
+/*
+* A section measured twice in one frame (e.g. several partial frames per loop iteration) keeps the last measurement
+*/
+void FrameProfiler::beginGpu(GpuSection section) {
+	if (!useGpuTimers) return;
+	glBeginQuery(GL_TIME_ELAPSED, queries[querySlot][section]);
+	queryUsed[querySlot][section] = true;
+	activeGpuSection = section;
+}
+
+void FrameProfiler::endGpu() {
+	if (!useGpuTimers || activeGpuSection < 0) return;
+	glEndQuery(GL_TIME_ELAPSED);
+	activeGpuSection = -1;
+}
+
+void FrameProfiler::addCpuTime(CpuSection section, double ms) {
+	current.cpuMs[section] += ms;
+}
+
+void FrameProfiler::beginCpu(CpuSection section) {
+	openCpuSections.push_back(section);
+}
+
+void FrameProfiler::endCpu(double ms) {
+	if (openCpuSections.empty()) return;
+	current.cpuMs[openCpuSections.back()] += ms;
+	openCpuSections.pop_back();
+	if (!openCpuSections.empty()) current.cpuMs[openCpuSections.back()] -= ms;
+}
+
+/*
+* The copies land in this frame's query slot, which is free again because the frame that used it last has resolved
+*/
+void FrameProfiler::copyGpuCounters(GLuint samplesBuffer, GLintptr samplesOffset, GLuint raysBuffer, GLintptr raysOffset) {
+	if (countersMapped == nullptr) return;
+	GLintptr slotOffset = querySlot * NUM_COUNTERS * sizeof(GLuint);
+	glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+	glCopyNamedBufferSubData(samplesBuffer, countersBuffer, samplesOffset, slotOffset, sizeof(GLuint));
+	glCopyNamedBufferSubData(raysBuffer, countersBuffer, raysOffset, slotOffset + sizeof(GLuint), 2 * sizeof(GLuint));
+	countersCopied = true;
+}
+
+void FrameProfiler::endFrame(unsigned long long numSamples, unsigned long long numRays) {
+	current.index = frameIndex++;
+	current.querySlot = querySlot;
+	current.numSamples = numSamples;
+	current.numRays = numRays;
+	if (countersCopied) current.countersFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	countersCopied = false;
+	pending.push_back(current);
+	current = FrameRecord{ 0, 0, {}, {}, 0, 0, nullptr };
+	querySlot = (querySlot + 1) % QUERY_FRAMES;
+
+	// Frames resolve in order, the oldest one has to be done before its query slot comes around again
+	while (!pending.empty()) {
+		bool mustWait = pending.size() >= QUERY_FRAMES;
+		if (!resolve(pending.front(), mustWait)) break;
+		writeRecord(pending.front());
+		// Nothing summarizes the frames without a metrics file, keeping them would grow forever
+		if (metrics.is_open()) window.push_back(pending.front());
+		pending.pop_front();
+	}
+}
+
+void FrameProfiler::flush() {
+	while (!pending.empty()) {
+		resolve(pending.front(), true);
+		writeRecord(pending.front());
+		if (metrics.is_open()) window.push_back(pending.front());
+		pending.pop_front();
+	}
+}
+
+/*
+* Reads the GPU timings and counters of a frame, returns false if wait is not set and one of them is not available yet
+*/
+bool FrameProfiler::resolve(FrameRecord& record, bool wait) {
+	if (!useGpuTimers) return true;
+	for (int i = 0; i < NUM_GPU_SECTIONS; i++) {
+		if (!queryUsed[record.querySlot][i]) continue;
+		GLuint available = GL_TRUE;
+		if (!wait) glGetQueryObjectuiv(queries[record.querySlot][i], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return false;
+	}
+	if (record.countersFence != nullptr) {
+		GLenum status = glClientWaitSync(record.countersFence, GL_SYNC_FLUSH_COMMANDS_BIT, (wait) ? 1000000000ull : 0);
+		if (status == GL_TIMEOUT_EXPIRED && !wait) return false;
+		glDeleteSync(record.countersFence);
+		record.countersFence = nullptr;
+		// A failed wait keeps the counts the frame was closed with
+		if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+			const GLuint* counters = countersMapped + record.querySlot * NUM_COUNTERS;
+			record.numSamples = counters[0];
+			record.numRays = (unsigned long long)counters[1] + counters[2];
+		}
+	}
+	for (int i = 0; i < NUM_GPU_SECTIONS; i++) {
+		if (!queryUsed[record.querySlot][i]) continue;
+		GLuint64 ns = 0;
+		glGetQueryObjectui64v(queries[record.querySlot][i], GL_QUERY_RESULT, &ns);
+		record.gpuMs[i] = (double)ns / 1e6;
+		queryUsed[record.querySlot][i] = false;
+	}
+	return true;
+}
+
+void FrameProfiler::writeRecord(const FrameRecord& record) {
+	if (!metrics.is_open()) return;
+
+	double seconds = record.cpuMs[CPU_FRAME] / 1000.0;
+	double samplesPerSec = (seconds > 0.0) ? record.numSamples / seconds : 0.0;
+	double raysPerSec = (seconds > 0.0) ? record.numRays / seconds : 0.0;
+	if (csv) {
+		metrics << record.index;
+		for (double ms : record.cpuMs) metrics << "," << ms;
+		for (double ms : record.gpuMs) metrics << "," << ms;
+		metrics << "," << record.numSamples << "," << record.numRays << "," << samplesPerSec << "," << raysPerSec << "\n";
+	}
+	else {
+		metrics << "{\"type\":\"frame\",\"frame\":" << record.index;
+		for (int i = 0; i < NUM_CPU_SECTIONS; i++) metrics << ",\"" << cpuSectionNames[i] << "_ms\":" << record.cpuMs[i];
+		for (int i = 0; i < NUM_GPU_SECTIONS; i++) metrics << ",\"" << gpuSectionNames[i] << "_ms\":" << record.gpuMs[i];
+		metrics << ",\"samples\":" << record.numSamples << ",\"rays\":" << record.numRays
+			<< ",\"samples_per_sec\":" << samplesPerSec << ",\"rays_per_sec\":" << raysPerSec << "}\n";
+	}
+}
+
+/*
+* p50/p90/p99 of every section that took any time, throughput is the total work over the total frame time
+*/
+void FrameProfiler::printSummary() {
+	if (window.empty()) return;
+
+	double totalSeconds = 0.0;
+	unsigned long long totalSamples = 0, totalRays = 0;
+	for (const FrameRecord& record : window) {
+		totalSeconds += record.cpuMs[CPU_FRAME] / 1000.0;
+		totalSamples += record.numSamples;
+		totalRays += record.numRays;
+	}
+	double samplesPerSec = (totalSeconds > 0.0) ? totalSamples / totalSeconds : 0.0;
+	double raysPerSec = (totalSeconds > 0.0) ? totalRays / totalSeconds : 0.0;
+
+	std::cout << "Frame timings over " << window.size() << " frames (ms, p50 / p90 / p99)" << std::endl;
+	bool json = metrics.is_open() && !csv;
+	if (json) metrics << "{\"type\":\"summary\",\"frames\":" << window.size();
+
+	std::vector<double> values(window.size());
+	auto summarize = [&](const char* name, auto getValue) {
+		for (size_t i = 0; i < window.size(); i++) values[i] = getValue(window[i]);
+		std::sort(values.begin(), values.end());
+		if (values.back() <= 0.0) return;
+		double p50 = percentile(values, 50.0), p90 = percentile(values, 90.0), p99 = percentile(values, 99.0);
+		std::cout << "  " << std::left << std::setw(14) << name << std::right << std::fixed << std::setprecision(3)
+			<< p50 << " / " << p90 << " / " << p99 << std::defaultfloat << std::endl;
+		if (json) metrics << ",\"" << name << "_ms\":{\"p50\":" << p50 << ",\"p90\":" << p90 << ",\"p99\":" << p99 << "}";
+	};
+	for (int i = 0; i < NUM_CPU_SECTIONS; i++) summarize(cpuSectionNames[i], [i](const FrameRecord& r) { return r.cpuMs[i]; });
+	for (int i = 0; i < NUM_GPU_SECTIONS; i++) summarize(gpuSectionNames[i], [i](const FrameRecord& r) { return r.gpuMs[i]; });
+
+	std::cout << "  Samples/sec:  " << samplesPerSec / 1e6 << " M" << std::endl;
+	if (totalRays > 0) std::cout << "  Rays/sec:     " << raysPerSec / 1e6 << " M" << std::endl;
+	if (json) metrics << ",\"samples_per_sec\":" << samplesPerSec << ",\"rays_per_sec\":" << raysPerSec << "}\n";
+	metrics.flush();
+
+	window.clear();
+}
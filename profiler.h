@@ -0,0 +1,117 @@
+#pragma once
+
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <glad/glad.h>
+
+/*
+	Per frame timings of the render loop
+	- GPU sections are GL_TIME_ELAPSED query pairs, read back QUERY_FRAMES frames later so the CPU never waits on them
+	- GPU sample and ray counters are copied into a mapped ring next to the queries and fenced, they resolve together with the timings
+	- CPU sections are timed with ScopedTimer (or addCpuTime) around the code in question, a section can be entered several times a frame
+	- ScopedTimers nest exclusively, an inner one takes its time out of the outer section, so every section but cpu_frame adds up to it
+	- Every finished frame becomes one row of the metrics file: CSV when its name ends in .csv, JSON lines otherwise
+	- printSummary prints percentiles over the frames since the last call, JSON lines files also get it as a "summary" record
+*/
+
+// GL_TIME_ELAPSED queries cannot nest, these sections never overlap
+enum GpuSection {
+	GPU_COMPUTE,	// Wavefront stages of all tiles dispatched this frame
+	GPU_BARRIER,	// Barrier for the images and buffers read after the frame (denoiser, resolve, readbacks)
+	GPU_DENOISE,
+	GPU_RESOLVE,	// Tone mapping into the display target
+	GPU_BLIT,		// Screen quad
+	NUM_GPU_SECTIONS
+};
+
+enum CpuSection {
+	CPU_FRAME,		// Whole iteration of the render loop
+	CPU_INPUT,		// Camera input and event polling
+	CPU_UPLOAD,		// Scene edits and the frame uniforms
+	CPU_RENDER,		// CPU backend tracing or recording the GPU dispatches, without the upload and wait nested in it
+	CPU_PRESENT,	// Buffer swap, includes waiting for vsync
+	CPU_WAIT,		// Frame pacing, waiting for the GPU to free a frame slot
+	NUM_CPU_SECTIONS
+};
+
+class FrameProfiler {
+public:
+	// Without a GL context (headless CPU renders) only the CPU sections are timed
+	FrameProfiler(bool useGpuTimers_);
+	~FrameProfiler();
+
+	FrameProfiler(const FrameProfiler&) = delete;
+	FrameProfiler& operator=(const FrameProfiler&) = delete;
+
+	// Starts streaming per frame records to filename, returns false if it could not be opened
+	bool openMetrics(const std::string& filename);
+	bool metricsEnabled() const { return metrics.is_open(); }
+
+	void beginGpu(GpuSection section);
+	void endGpu();
+	void addCpuTime(CpuSection section, double ms);
+	// Used by ScopedTimer, endCpu adds the time to the innermost open section and takes it out of the one around it
+	void beginCpu(CpuSection section);
+	void endCpu(double ms);
+	// Copies the frame's sample counter and its two ray counters (extend, shadow) out of GPU buffers, they replace the counts given to endFrame
+	void copyGpuCounters(GLuint samplesBuffer, GLintptr samplesOffset, GLuint raysBuffer, GLintptr raysOffset);
+	// Closes the frame, numRays is 0 when the backend did not count its rays
+	void endFrame(unsigned long long numSamples, unsigned long long numRays);
+	// Waits for the outstanding GPU timings, call before the last printSummary
+	void flush();
+	void printSummary();
+
+private:
+	static const unsigned int QUERY_FRAMES = 4;
+
+	struct FrameRecord {
+		unsigned long long index;
+		unsigned int querySlot;
+		double cpuMs[NUM_CPU_SECTIONS];
+		double gpuMs[NUM_GPU_SECTIONS];
+		unsigned long long numSamples, numRays;
+		GLsync countersFence;	// Set when the frame copied GPU counters into its slot of countersMapped
+	};
+
+	bool resolve(FrameRecord& record, bool wait);
+	void writeRecord(const FrameRecord& record);
+
+	const bool useGpuTimers;
+	GLuint queries[QUERY_FRAMES][NUM_GPU_SECTIONS];
+	bool queryUsed[QUERY_FRAMES][NUM_GPU_SECTIONS] = {};
+	unsigned int querySlot = 0;
+	int activeGpuSection = -1;
+	// Samples, extend rays and shadow rays per query slot, persistently mapped
+	static const unsigned int NUM_COUNTERS = 3;
+	GLuint countersBuffer = 0;
+	const GLuint* countersMapped = nullptr;
+	bool countersCopied = false;
+
+	FrameRecord current;
+	std::vector<CpuSection> openCpuSections;	// ScopedTimers that have not ended yet, innermost last
+	unsigned long long frameIndex = 0;
+	std::deque<FrameRecord> pending;	// Waiting for their GPU timings
+	std::vector<FrameRecord> window;	// Resolved since the last summary
+
+	std::ofstream metrics;
+	bool csv = false;
+};
+
+// Adds the time between construction and destruction to a CPU section
+class ScopedTimer {
+public:
+	ScopedTimer(FrameProfiler* profiler_, CpuSection section) : profiler(profiler_), start(std::chrono::steady_clock::now()) {
+		profiler->beginCpu(section);
+	}
+	~ScopedTimer() {
+		profiler->endCpu(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+	}
+
+private:
+	FrameProfiler* profiler;
+	std::chrono::steady_clock::time_point start;
+};
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <glm/glm.hpp>
+
+// Host side versions of the Ray/Hit structs in raytracer.comp, shared by the CPU intersection code
+
+struct Ray {
+	glm::vec3 pos;
+	glm::vec3 dir;
+};
+
+// Only what traversal needs, the material is looked up once the closest hit is known
+struct Hit {
+	float t;
+	glm::vec3 normal;
+	unsigned int prim;	// primRef of the closest primitive
+	bool backface;
+};
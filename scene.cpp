@@ -1,49 +1,152 @@
 
 #include "scene.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <random>
+
+#include "imageio.h"
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-Scene::Scene(GLFWwindow* window_) : TEXTURE_WIDTH(1024), TEXTURE_HEIGHT(1024), COMP_DIM_X(128), COMP_DIM_Y(128) {
-	srand(time(0));
+const std::vector<std::string> Scene::SCENE_NAMES = { "sunset", "balls", "greyscale", "cornell" };
 
+bool Scene::isSceneFile(const std::string& name) {
+	return name.size() > 6 && name.compare(name.size() - 6, 6, ".scene") == 0;
+}
+
+Scene::Scene(GLFWwindow* window_, bool useCPU_, const std::string& sceneName) : GROUP_SIZE_X(globals::GROUP_SIZE_X), GROUP_SIZE_Y(globals::GROUP_SIZE_Y),
+	TILE_WIDTH(std::min(globals::TILE_WIDTH, globals::TEXTURE_WIDTH)), TILE_HEIGHT(std::min(globals::TILE_HEIGHT, globals::TEXTURE_HEIGHT)),
+	TEXTURE_WIDTH(globals::TEXTURE_WIDTH), TEXTURE_HEIGHT(globals::TEXTURE_HEIGHT),
+	framesInFlight(std::min(std::max(globals::FRAMES_IN_FLIGHT, 1u), MAX_FRAMES_IN_FLIGHT)) {
 	window = window_;
+	useCPU = useCPU_ || window == nullptr;
+
+	camera = new Camera(window);
+	cpuTracer = new CPUTracer(TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	profiler = new FrameProfiler(window != nullptr);
+
+	// Populate scene objects, scene files come with their BVH already built
+	bool hasBVH = false;
+	if (isSceneFile(sceneName)) hasBVH = valid = loadSceneFile(sceneName);
+	else valid = setupSceneObjects(sceneName);
+	if (!valid) return;
+	updateEmitters();
+	if (!hasBVH) bvh.build(spheresVec, trianglesVec, quadsVec);
+	loadSkybox();
+
+	// Without a window there is no GL context, everything below is GPU only
+	if (window == nullptr) return;
 
 	glfwSetWindowUserPointer(window, this);
 	glfwSetKeyCallback(window, keyInputSetup);
 
-	camera = new Camera(window);
-	shaders = new Shader("default.vert", "default.frag", "raytracer.comp");
-
-	timeLoc = glGetUniformLocation(shaders->compShaderID, "time");
-	cameraPosLoc = glGetUniformLocation(shaders->compShaderID, "cameraPos");
-	cameraDirLoc = glGetUniformLocation(shaders->compShaderID, "cameraDir");
-	numAccumFramesLoc = glGetUniformLocation(shaders->compShaderID, "numAccumFrames");
-	ray00Loc = glGetUniformLocation(shaders->compShaderID, "ray00");
-	ray10Loc = glGetUniformLocation(shaders->compShaderID, "ray10");
-	ray01Loc = glGetUniformLocation(shaders->compShaderID, "ray01");
-	ray11Loc = glGetUniformLocation(shaders->compShaderID, "ray11");
+	numTilesX = (TEXTURE_WIDTH + TILE_WIDTH - 1) / TILE_WIDTH;
+	numTilesY = (TEXTURE_HEIGHT + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	tilesPerDraw = globals::TILES_PER_DRAW;
+
+	shaders = new Shader("default.vert", "default.frag", "raytracer.comp", buildShaderDefines());
+
+	queryUniformLocations();
 	textureLoc = glGetUniformLocation(shaders->screenQuadShaderID, "tex");
 
 	setupScreenQuad();
-
-	// Populate scene objects
-	setupSceneObjects();
 	setupComputeShaderData();
+	setupFrameUniforms();
 }
 
 Scene::~Scene() {
 
-	glDeleteBuffers(1, &VBO);
-	glDeleteBuffers(1, &EBO);
-	glDeleteVertexArrays(1, &VAO);
-	glDeleteTextures(1, &texID);
+	if (shaders != nullptr) {
+		glDeleteBuffers(1, &VBO);
+		glDeleteBuffers(1, &EBO);
+		glDeleteVertexArrays(1, &VAO);
+		glDeleteTextures(1, &texID);
+		glDeleteTextures(1, &momentsTexID);
+		glDeleteTextures(1, &albedoTexID);
+		glDeleteTextures(1, &normalDepthTexID);
+		glDeleteTextures(2, filterTexIDs);
+		glDeleteTextures(4, historyTexIDs);
+		glDeleteTextures(1, &resolveTexID);
+		pointLightBuffer.release();
+		sphereBuffer.release();
+		quadBuffer.release();
+		triangleBuffer.release();
+		bvhNodeBuffer.release();
+		primRefBuffer.release();
+		emitterBuffer.release();
+		materialBuffer.release();
+		delete uploadRing;
+		glDeleteBuffers(1, &pathSSBO);
+		glDeleteBuffers(1, &hitSSBO);
+		glDeleteBuffers(1, &queueSSBO);
+		glDeleteBuffers(1, &environmentSSBO);
+		glDeleteBuffers(1, &statsSSBO);
+		for (unsigned int i = 0; i < MAX_BOUNCE_CHECKS; i++) {
+			if (bounceCheckFences[i] != nullptr) glDeleteSync(bounceCheckFences[i]);
+		}
+		if (bounceCheckMapped != nullptr) glUnmapNamedBuffer(bounceCheckBuffer);
+		glDeleteBuffers(1, &bounceCheckBuffer);
+		for (unsigned int i = 0; i < framesInFlight; i++) {
+			if (frameFences[i] != nullptr) glDeleteSync(frameFences[i]);
+		}
+		if (frameUniformsMapped != nullptr) glUnmapNamedBuffer(frameUBO);
+		glDeleteBuffers(1, &frameUBO);
 
-	shaders->deleteShaders();
+		shaders->deleteShaders();
+	}
 
 	window = nullptr;
 	delete camera;
 	delete shaders;
+	delete cpuTracer;
+	delete skybox;
+	delete profiler;
+}
+
+/*
+* Specializes raytracer.comp for the loaded scene, primitive types and material features it does not use are compiled out
+* Every combination gets its own entry in the program binary cache since the defines are part of the key
+*/
+std::string Scene::buildShaderDefines() const {
+	bool hasRefraction = false, hasGloss = false, hasEmission = false;
+	for (const Material& material : materialsVec) {
+		hasRefraction = hasRefraction || material.data.z != 0.0f;
+		hasGloss = hasGloss || material.data.x != 0.0f;
+		hasEmission = hasEmission || material.data.w != 0.0f;
+	}
+
+	std::string defines;
+	defines += "#define GROUP_SIZE_X " + std::to_string(GROUP_SIZE_X) + "\n";
+	defines += "#define GROUP_SIZE_Y " + std::to_string(GROUP_SIZE_Y) + "\n";
+	defines += "#define MAX_BOUNCES " + std::to_string(WAVEFRONT_MAX_BOUNCES) + "u\n";
+	defines += "#define HAS_SPHERES " + std::to_string(!spheresVec.empty()) + "\n";
+	defines += "#define HAS_TRIANGLES " + std::to_string(!trianglesVec.empty()) + "\n";
+	defines += "#define HAS_QUADS " + std::to_string(!quadsVec.empty()) + "\n";
+	defines += "#define HAS_REFRACTION " + std::to_string(hasRefraction) + "\n";
+	defines += "#define HAS_GLOSS " + std::to_string(hasGloss) + "\n";
+	defines += "#define HAS_EMISSION " + std::to_string(hasEmission) + "\n";
+	return defines;
+}
+
+/*
+* Locations of the per dispatch uniforms of every wavefront stage, has to run again whenever the stage programs are rebuilt
+* Everything that stays the same for a whole frame comes from the FrameUniforms block instead
+*/
+void Scene::queryUniformLocations() {
+	for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++) {
+		GLuint program = shaders->stageShaderIDs[i];
+		StageUniforms& locs = stageLocs[i];
+		locs.queueIdx = glGetUniformLocation(program, "queueIdx");
+		locs.queuePhase = glGetUniformLocation(program, "queuePhase");
+		locs.tileOrigin = glGetUniformLocation(program, "tileOrigin");
+		locs.tileSize = glGetUniformLocation(program, "tileSize");
+		locs.denoiseStep = glGetUniformLocation(program, "denoiseStep");
+		locs.exposure = glGetUniformLocation(program, "exposure");
+	}
 }
 
 void Scene::keyInput(int key, int scancode, int action, int mods) {
@@ -53,7 +156,57 @@ void Scene::keyInput(int key, int scancode, int action, int mods) {
 			if (randmode == 0) randmode = 1;
 			else randmode = 0;
 			resetFrames = true;
-			std::cout << "Draw Frustum: " << ((randmode) ? "Rand 2" : "Rand 1") << std::endl;
+			std::cout << "Sampler: " << ((randmode) ? "PCG" : "Sobol") << std::endl;
+			break;
+		case GLFW_KEY_V:
+			adaptiveSampling = !adaptiveSampling;
+			std::cout << "Adaptive sampling: " << ((adaptiveSampling) ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_E:
+			envSampling = !envSampling;
+			resetFrames = true;
+			std::cout << "Skybox sampling: " << ((envSampling) ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_C:
+			useCPU = !useCPU;
+			resetFrames = true;
+			std::cout << "Backend: " << ((useCPU) ? "CPU" : "GPU") << std::endl;
+			break;
+		case GLFW_KEY_P:
+			pathStats = !pathStats;
+			std::cout << "Path statistics: " << ((pathStats) ? "on" : "off") << std::endl;
+			// Flushes what was collected so far, the next run starts from zero
+			if (!pathStats) printPathStats();
+			break;
+		case GLFW_KEY_N:
+			denoise = !denoise;
+			std::cout << "Denoiser: " << ((denoise) ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_T:
+			temporalReprojection = !temporalReprojection;
+			std::cout << "Temporal reprojection: " << ((temporalReprojection) ? "on" : "off") << std::endl;
+			break;
+		case GLFW_KEY_O:
+			dropSphere();
+			break;
+		case GLFW_KEY_U:
+		case GLFW_KEY_J:
+			moveEditSphere(glm::vec3(0.0f, (key == GLFW_KEY_U) ? 0.25f : -0.25f, 0.0f));
+			break;
+		case GLFW_KEY_G:
+			recolorEditSphere();
+			break;
+		case GLFW_KEY_X:
+			removeEditSphere();
+			break;
+		case GLFW_KEY_L:
+			movePointLightToCamera();
+			break;
+		// Only changes the resolve, the accumulation keeps going
+		case GLFW_KEY_EQUAL:
+		case GLFW_KEY_MINUS:
+			exposure += (key == GLFW_KEY_EQUAL) ? 0.5f : -0.5f;
+			std::cout << "Exposure: " << exposure << " EV" << std::endl;
 			break;
 		default:
 			break;
@@ -75,6 +228,22 @@ void Scene::setupScreenQuad() {
 
 	glBindImageTexture(0, texID, 0, GL_FALSE, 0, GL_READ_WRITE, GL_RGBA32F);
 
+	// Luminance moments for adaptive sampling and the denoiser's first hit features, only touched by the compute stages
+	momentsTexID = createImageTexture(GL_RGBA32F, 2);
+	albedoTexID = createImageTexture(GL_RGBA16F, 3);
+	normalDepthTexID = createImageTexture(GL_RGBA32F, 4);
+	// The denoiser binds these to image units 5 and 6 itself, the screen quad samples the one with the result
+	filterTexIDs[0] = createImageTexture(GL_RGBA32F, 5);
+	filterTexIDs[1] = createImageTexture(GL_RGBA32F, 6);
+	// Reprojection reads the history through texelFetch, the images are copied in when the camera moves
+	historyTexIDs[0] = createImageTexture(GL_RGBA32F, -1);
+	historyTexIDs[1] = createImageTexture(GL_RGBA32F, -1);
+	historyTexIDs[2] = createImageTexture(GL_RGBA16F, -1);
+	historyTexIDs[3] = createImageTexture(GL_RGBA32F, -1);
+	for (GLuint i = 0; i < 4; i++) glBindTextureUnit(2 + i, historyTexIDs[i]);
+	glBindTexture(GL_TEXTURE_2D, texID);
+	displayTexID = texID;
+
 
 	GLfloat tempVerts[] = {
 		-1.0f, -1.0f, 0.0f, 0.0f, 0.0f,
@@ -116,105 +285,307 @@ void Scene::setupScreenQuad() {
 }
 
 /*
-* Create and add all scene objects to local vectors
+* Create and add all objects of the named scene to local vectors and place the camera, returns false for unknown names
+* Every scene is built the same way on every run, random objects come from a fixed seed so renders can be compared
 */
-void Scene::setupSceneObjects() {
-	// RANDOM BALLS SCENE
-	//Material lightMaterial(glm::vec4(0, 0, 0, 300), glm::vec4(0), glm::vec4(0), glm::vec4(1));
-	//pointLightsVec.push_back(PointLight(glm::vec4(-7, 15, 10, 1.0), lightMaterial));
-
-	//Material lightMaterial2(glm::vec4(0, 0, 0, 1000), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1));
-	//pointLightsVec.push_back(PointLight(glm::vec4(5, 25, -5, 1.0), lightMaterial2));
-
-	const int numX = 4, numY = 4;
-	for (int i = -numX / 2; i < numX / 2; i++) {
-		for (int j = -numY / 2; j < numY / 2; j++) {
-			spheresVec.push_back(Sphere(
-				glm::vec4((float)(rand()) / (float)(RAND_MAX) * 10.0 - 5.0, (float)(rand()) / (float)(RAND_MAX) * 10.0 - 5.0, (float)(rand()) / (float)(RAND_MAX) * 10.0 - 5.0,
-					(float)(rand()) / (float)(RAND_MAX) + 0.2), 
-				Material(glm::vec4((float)(rand()) / (float)(RAND_MAX), 0, ((float)(rand()) / (float)(RAND_MAX) + 1.0) * (((float)(rand()) / (float)(RAND_MAX)) > 0.6), 0),
-						glm::vec4((float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), 1.0),
-						glm::vec4((float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), 1),
-						glm::vec4((float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), (float)(rand()) / (float)(RAND_MAX), 1), glm::vec4(0))));
+bool Scene::setupSceneObjects(const std::string& name) {
+	// mt19937 gives the same sequence on every platform, unlike rand()
+	std::mt19937 rng(SCENE_SEED);
+	auto random = [&rng]() { return (float)(rng() / 4294967296.0); };
+
+	// Random diffuse, glossy and glass balls in a 10x10x10 cube, drawn one value at a time since argument evaluation order is unspecified
+	auto addRandomBalls = [&]() {
+		const int numX = 4, numY = 4;
+		for (int i = 0; i < numX * numY; i++) {
+			glm::vec4 posRad;
+			for (int c = 0; c < 3; c++) posRad[c] = random() * 10.0f - 5.0f;
+			posRad.w = random() + 0.2f;
+			glm::vec4 data(random(), 0, 0, 0);
+			float ior = random() + 1.0f;
+			if (random() > 0.6f) data.z = ior;
+			glm::vec4 colors[3];
+			for (glm::vec4& color : colors) {
+				for (int c = 0; c < 3; c++) color[c] = random();
+				color.w = 1.0f;
+			}
+			spheresVec.push_back(Sphere(posRad, addMaterial(Material(data, colors[0], colors[1], colors[2], glm::vec4(0)))));
 		}
-	}
+	};
+
+	if (name == "balls") {
+		// RANDOM BALLS SCENE
+		unsigned int lightMaterial = addMaterial(Material(glm::vec4(0, 0, 0, 300), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1)));
+		pointLightsVec.push_back(PointLight(glm::vec3(-7, 15, 10), lightMaterial));
+		unsigned int lightMaterial2 = addMaterial(Material(glm::vec4(0, 0, 0, 1000), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1)));
+		pointLightsVec.push_back(PointLight(glm::vec3(5, 25, -5), lightMaterial2));
+		addRandomBalls();
 
+		camera->position = glm::vec3(0, 0, 14);
+	}
+	else if (name == "sunset") {
+		// SUNSET SCENE, the random balls lit by a large emissive sphere low over the horizon
+		addRandomBalls();
+		unsigned int sunset = addMaterial(Material(glm::vec4(0, 0, 0, 100), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1, 0.5, 0.5, 1.0)));
+		spheresVec.push_back(Sphere(glm::vec4(40, 5, 50, 10.0), sunset));
 
+		camera->position = glm::vec3(0, 0, 2);
+	}
+	else if (name == "greyscale") {
+		// GREYSCALE SCENE
+		unsigned int matteGrey = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(1), glm::vec4(1), glm::vec4(0), glm::vec4(0)));
+		unsigned int blue = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(0, 0, 1, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0)));
+		unsigned int clearGrey = addMaterial(Material(glm::vec4(1, 0, 1.5, 0), glm::vec4(1), glm::vec4(0), glm::vec4(1), glm::vec4(0)));
+		spheresVec.push_back(Sphere(glm::vec4(1, 0, 0, 0.3), clearGrey));
+		spheresVec.push_back(Sphere(glm::vec4(0, 0, 1, 0.3), matteGrey));
+		spheresVec.push_back(Sphere(glm::vec4(0.7, 0, 0.7, 0.3), blue));
+
+		float quadDim = 2;
+		float quadYpos = -0.301f;
+		quadsVec.push_back(Quad(glm::vec3(-quadDim, quadYpos, -quadDim), glm::vec3(quadDim, quadYpos, -quadDim),
+			glm::vec3(-quadDim, quadYpos, quadDim), glm::vec3(quadDim, quadYpos, quadDim),
+			matteGrey));
+
+		unsigned int emissive = addMaterial(Material(glm::vec4(0, 0, 0, 5), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1)));
+		spheresVec.push_back(Sphere(glm::vec4(-0.5, 0.5, -0.5, 0.6), emissive));
+
+		camera->position = glm::vec3(0.3f, 0.6f, 3.0f);
+		camera->direction = glm::normalize(glm::vec3(0, -0.25f, -1));
+	}
+	else if (name == "cornell") {
+		// CORNELL BOX, the camera looks in through the open side and every primary ray hits a wall
+		// Walls keep the usual albedos below 1 so light bouncing around inside the box dies out
+		unsigned int white = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(0.73, 0.73, 0.73, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0)));
+		unsigned int green = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(0.12, 0.45, 0.15, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0)));
+		unsigned int red = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(0.65, 0.05, 0.05, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0)));
+		unsigned int light = addMaterial(Material(glm::vec4(0, 0, 0, 50), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1)));
+
+		quadsVec.push_back(Quad(glm::vec3(-1, 1, 1), glm::vec3(1, 1, 1), glm::vec3(-1, 1, -1), glm::vec3(1, 1, -1), white));
+		quadsVec.push_back(Quad(glm::vec3(-1, 1, -1), glm::vec3(1, 1, -1), glm::vec3(-1, -1, -1), glm::vec3(1, -1, -1), white));
+		quadsVec.push_back(Quad(glm::vec3(-1, -1, -1), glm::vec3(1, -1, -1), glm::vec3(-1, -1, 1), glm::vec3(1, -1, 1), white));
+		quadsVec.push_back(Quad(glm::vec3(1, 1, -1), glm::vec3(1, 1, 1), glm::vec3(1, -1, -1), glm::vec3(1, -1, 1), green));
+		quadsVec.push_back(Quad(glm::vec3(-1, 1, 1), glm::vec3(-1, 1, -1), glm::vec3(-1, -1, 1), glm::vec3(-1, -1, -1), red));
+		quadsVec.push_back(Quad(glm::vec3(-0.2, 0.99, 0.2), glm::vec3(0.2, 0.99, 0.2), glm::vec3(-0.2, 0.99, -0.2), glm::vec3(0.2, 0.99, -0.2), light));
+
+		camera->position = glm::vec3(0, 0, 3.4f);
+	}
+	else {
+		std::cout << "Unknown scene " << name << std::endl;
+		return false;
+	}
 
-	// SUNSET SCENE
-	Material sunset(glm::vec4(0, 0, 0, 100), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1, 0.5, 0.5, 1.0));
-	spheresVec.push_back(Sphere(glm::vec4(40, 5, 50, 10.0), sunset));
-
-	//Material sunset2(glm::vec4(0, 0, 0, 2000), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1, 0.5, 0.5, 1.0));
-	//pointLightsVec.push_back(PointLight(glm::vec4(-5, 50, -5, 1.0), sunset2));
-
-	//spheresVec.push_back(Sphere(glm::vec4(0, 0, 0, 0.2), 
-	//	Material(glm::vec4(0, 0, 0, 0), glm::vec4(1), glm::vec4(0.8), glm::vec4(0), glm::vec4(0))));
-	////spheresVec.push_back(Sphere(glm::vec4(-0.5, -0.5, -0.5, 0.4),
-	////	Material(glm::vec4(0.001, 16, 0, 0), glm::vec4(247/255.0, 217/255.0, 45/255.0, 1.0), glm::vec4(0.9), glm::vec4(0), glm::vec4(0))));
-	////spheresVec.push_back(Sphere(glm::vec4(-0.5, 0.0, 0.5, 0.3),
-	////	Material(glm::vec4(1, 16, 0, 0), glm::vec4(247 / 255.0, 45 / 255.0, 109 / 255.0, 1.0), glm::vec4(0.5), glm::vec4(0), glm::vec4(0))));
-	////spheresVec.push_back(Sphere(glm::vec4(0.5, 0.0, -0.5, 0.3),
-	////	Material(glm::vec4(1, 16, 0, 0), glm::vec4(0.3, 0.4, 0.4, 1.0), glm::vec4(0.2), glm::vec4(0), glm::vec4(0))));
-	////spheresVec.push_back(Sphere(glm::vec4(0.5, 0.5, 0.5, 0.1),
-	////	Material(glm::vec4(1, 16, 0, 0), glm::vec4(0.5, 0.3, 0.2, 1.0), glm::vec4(0.2), glm::vec4(0), glm::vec4(0))));
-
-	//Material glass(glm::vec4(0, 0, 1.5, 0), glm::vec4(1), glm::vec4(1), glm::vec4(1), glm::vec4(0));
-	//spheresVec.push_back(Sphere(glm::vec4(1, 0, 1, 0.4), glass));
-
-	//int quadDim = 2;
-	//int quadYpos = -1;
-	//Material quadMat(glm::vec4(0.5, 0, 0, 0), glm::vec4(1), glm::vec4(0.2), glm::vec4(0), glm::vec4(0));
-	//quadsVec.push_back(Quad(glm::vec4(-quadDim, quadYpos, -quadDim, 1), glm::vec4(quadDim, quadYpos, -quadDim, 1),
-	//	glm::vec4(-quadDim, quadYpos, quadDim, 1), glm::vec4(quadDim, quadYpos, quadDim, 1),
-	//	quadMat));
-
-
-	// GREYSCALE SCENE
-	//Material matteGrey(glm::vec4(0, 0, 0, 0), glm::vec4(1), glm::vec4(1), glm::vec4(0), glm::vec4(0));
-	//Material red(glm::vec4(0, 0, 0, 0), glm::vec4(1, 0, 0, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material green(glm::vec4(0, 0, 0, 0), glm::vec4(0, 1, 0, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material blue(glm::vec4(0, 0, 0, 0), glm::vec4(0, 0, 1, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material shinyGrey(glm::vec4(0.98, 0, 0, 0), glm::vec4(1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material clearGrey(glm::vec4(1, 0, 1.5, 0), glm::vec4(1), glm::vec4(0), glm::vec4(1), glm::vec4(0));
-	//spheresVec.push_back(Sphere(glm::vec4(1, 0, 0, 0.3), clearGrey));
-	//spheresVec.push_back(Sphere(glm::vec4(0, 0, 1, 0.3), matteGrey));
-	//spheresVec.push_back(Sphere(glm::vec4(0.7, 0, 0.7, 0.3), blue));
-
-	//float quadDim = 2;
-	//float quadYpos = -0.301;
-	//quadsVec.push_back(Quad(glm::vec4(-quadDim, quadYpos, -quadDim, 1), glm::vec4(quadDim, quadYpos, -quadDim, 1),
-	//	glm::vec4(-quadDim, quadYpos, quadDim, 1), glm::vec4(quadDim, quadYpos, quadDim, 1),
-	//	matteGrey));
-
-	////quadsVec.push_back(Quad(glm::vec4(2, 1.6, 2, 1), glm::vec4(-2, 1.6, 2, 1), glm::vec4(2, quadYpos, 2, 1), glm::vec4(-2, quadYpos, 2, 1),
-	////	matteGrey));
-	////quadsVec.push_back(Quad(glm::vec4(2, 1.6, -2, 1), glm::vec4(-2, 1.6, -2, 1), glm::vec4(2, quadYpos, -2, 1), glm::vec4(-2, quadYpos, -2, 1),
-	////	matteGrey));
-	////quadsVec.push_back(Quad(glm::vec4(2, 1.6, -2, 1), glm::vec4(2, 1.6, 2, 1), glm::vec4(2, quadYpos, -2, 1), glm::vec4(2, quadYpos, 2, 1),
-	////	shinyGrey));
-
-	//Material emissive(glm::vec4(0, 0, 0, 5), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1));
-	//spheresVec.push_back(Sphere(glm::vec4(-0.5, 0.5, -0.5, 0.6), emissive));
-
-
-	// CORNELL BOX
-	//Material white(glm::vec4(1, 0, 0, 0), glm::vec4(1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material green(glm::vec4(1, 0, 0, 0), glm::vec4(0, 1, 0, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material red(glm::vec4(1, 0, 0, 0), glm::vec4(1, 0, 0, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0));
-	//Material light(glm::vec4(1, 0, 0, 50), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1));
-
-	//quadsVec.push_back(Quad(glm::vec4(-1, 1, 1, 1), glm::vec4(1, 1, 1, 1), glm::vec4(-1, 1, -1, 1), glm::vec4(1, 1, -1, 1), white));
-	//quadsVec.push_back(Quad(glm::vec4(-1, 1, -1, 1), glm::vec4(1, 1, -1, 1), glm::vec4(-1, -1, -1, 1), glm::vec4(1, -1, -1, 1), white));
-	//quadsVec.push_back(Quad(glm::vec4(-1, -1, -1, 1), glm::vec4(1, -1, -1, 1), glm::vec4(-1, -1, 1, 1), glm::vec4(1, -1, 1, 1), white));
-	//quadsVec.push_back(Quad(glm::vec4(1, 1, -1, 1), glm::vec4(1, 1, 1, 1), glm::vec4(1, -1, -1, 1), glm::vec4(1, -1, 1, 1), green));
-	//quadsVec.push_back(Quad(glm::vec4(-1, 1, 1, 1), glm::vec4(-1, 1, -1, 1), glm::vec4(-1, -1, 1, 1), glm::vec4(-1, -1, -1, 1), red));
-	//quadsVec.push_back(Quad(glm::vec4(-0.2, 0.99, 0.2, 1), glm::vec4(0.2, 0.99, 0.2, 1), glm::vec4(-0.2, 0.99, -0.2, 1), glm::vec4(0.2, 0.99, -0.2, 1), light));
+	// MESH SCENE
+	//unsigned int white = addMaterial(Material(glm::vec4(0, 0, 0, 0), glm::vec4(0.8, 0.8, 0.8, 1), glm::vec4(0), glm::vec4(0), glm::vec4(0)));
+	//addMesh("bunny.obj", white, glm::scale(glm::translate(glm::mat4(1.0f), glm::vec3(0, -1, 0)), glm::vec3(10.0f)));
 
 	// Junk objects
-	pointLightsVec.push_back(PointLight());
 	//spheresVec.push_back(Sphere());
 	quadsVec.push_back(Quad());
+
+	camera->matrix();
+	return true;
+}
+
+/*
+* Takes the objects, BVH, camera and skybox of a scene file, the arrays are copied straight out of its mapped cache
+* Returns false if the file cannot be loaded
+*/
+bool Scene::loadSceneFile(const std::string& filename) {
+	auto start = std::chrono::steady_clock::now();
+	SceneFile file(filename);
+	if (!file.isLoaded()) return false;
+
+	file.copySection(SECTION_MATERIALS, materialsVec);
+	file.copySection(SECTION_SPHERES, spheresVec);
+	file.copySection(SECTION_TRIANGLES, trianglesVec);
+	file.copySection(SECTION_QUADS, quadsVec);
+	file.copySection(SECTION_POINT_LIGHTS, pointLightsVec);
+	file.copySection(SECTION_BVH_NODES, bvh.nodes);
+	file.copySection(SECTION_PRIM_REFS, bvh.primRefs);
+	if (!file.environment.empty()) skyboxFile = file.environment;
+	if (file.hasCamera) {
+		camera->position = file.cameraPosition;
+		camera->direction = file.cameraDirection;
+		camera->matrix();
+	}
+
+	double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Loaded " << filename << ": " << spheresVec.size() + trianglesVec.size() + quadsVec.size() << " primitives in " << ms << " ms" << std::endl;
+	return true;
+}
+
+/*
+* Collects the spheres whose material emits light, only marked dirty when the list actually changed
+*/
+void Scene::updateEmitters() {
+	std::vector<unsigned int> emitters;
+	for (unsigned int i = 0; i < spheresVec.size(); i++) {
+		if (spheresVec[i].posRad.w > 0.0f && materialsVec[spheresVec[i].materialIdx].data.w > 0.0f) emitters.push_back(i);
+	}
+	if (emitters == emittersVec) return;
+	// Covers the old length too so the count is rewritten when the last emitter goes away
+	dirtyEmitters.mark(0, std::max(emitters.size(), emittersVec.size()));
+	emittersVec.swap(emitters);
+}
+
+/*
+* Add a material to the shared material table and return the index objects refer to it by
+*/
+unsigned int Scene::addMaterial(const Material& material) {
+	materialsVec.push_back(material);
+	dirtyMaterials.mark(materialsVec.size() - 1);
+	return (unsigned int)(materialsVec.size() - 1);
+}
+
+void Scene::setMaterial(unsigned int idx, const Material& material) {
+	if (idx >= materialsVec.size()) return;
+	materialsVec[idx] = material;
+	dirtyMaterials.mark(idx);
+}
+
+unsigned int Scene::addSphere(const Sphere& sphere) {
+	spheresVec.push_back(sphere);
+	dirtySpheres.mark(spheresVec.size() - 1);
+	bvhRebuild = true;
+	return (unsigned int)(spheresVec.size() - 1);
+}
+
+void Scene::moveSphere(unsigned int idx, const glm::vec3& pos) {
+	if (idx >= spheresVec.size()) return;
+	spheresVec[idx].posRad = glm::vec4(pos, spheresVec[idx].posRad.w);
+	dirtySpheres.mark(idx);
+	bvhRefit = true;
+}
+
+void Scene::removeSphere(unsigned int idx) {
+	if (idx >= spheresVec.size()) return;
+	spheresVec[idx] = spheresVec.back();
+	spheresVec.pop_back();
+	dirtySpheres.mark(idx);
+	bvhRebuild = true;
+}
+
+unsigned int Scene::addQuad(const Quad& quad) {
+	quadsVec.push_back(quad);
+	dirtyQuads.mark(quadsVec.size() - 1);
+	bvhRebuild = true;
+	return (unsigned int)(quadsVec.size() - 1);
+}
+
+void Scene::removeQuad(unsigned int idx) {
+	if (idx >= quadsVec.size()) return;
+	quadsVec[idx] = quadsVec.back();
+	quadsVec.pop_back();
+	dirtyQuads.mark(idx);
+	bvhRebuild = true;
+}
+
+unsigned int Scene::addPointLight(const PointLight& light) {
+	pointLightsVec.push_back(light);
+	dirtyLights.mark(pointLightsVec.size() - 1);
+	return (unsigned int)(pointLightsVec.size() - 1);
+}
+
+void Scene::movePointLight(unsigned int idx, const glm::vec3& pos) {
+	if (idx >= pointLightsVec.size()) return;
+	pointLightsVec[idx].pos = pos;
+	dirtyLights.mark(idx);
+}
+
+void Scene::removePointLight(unsigned int idx) {
+	if (idx >= pointLightsVec.size()) return;
+	pointLightsVec[idx] = pointLightsVec.back();
+	pointLightsVec.pop_back();
+	// Also rewrites the light count even when the last light was removed
+	dirtyLights.mark(idx);
+}
+
+/*
+* Adds a metal sphere two units in front of the camera with a material of its own, the edit keys then work on it
+*/
+void Scene::dropSphere() {
+	unsigned int material = addMaterial(Material(glm::vec4(0.9, 0, 0, 0), glm::vec4(0.8, 0.6, 0.3, 1), glm::vec4(0.8, 0.6, 0.3, 1), glm::vec4(0), glm::vec4(0)));
+	editSphere = (int)addSphere(Sphere(glm::vec4(camera->position + camera->direction * 2.0f, 0.3f), material));
+	std::cout << "Added sphere " << editSphere << std::endl;
+}
+
+void Scene::moveEditSphere(const glm::vec3& offset) {
+	if (editSphere < 0) return;
+	moveSphere(editSphere, glm::vec3(spheresVec[editSphere].posRad) + offset);
+}
+
+void Scene::recolorEditSphere() {
+	static const glm::vec4 palette[4] = { glm::vec4(0.8, 0.6, 0.3, 1), glm::vec4(0.7, 0.1, 0.1, 1), glm::vec4(0.1, 0.4, 0.7, 1), glm::vec4(0.9, 0.9, 0.9, 1) };
+	if (editSphere < 0) return;
+	unsigned int materialIdx = spheresVec[editSphere].materialIdx;
+	Material material = materialsVec[materialIdx];
+	editColor = (editColor + 1) % 4;
+	material.diffuseColor = material.glossColor = palette[editColor];
+	setMaterial(materialIdx, material);
+}
+
+void Scene::removeEditSphere() {
+	if (editSphere < 0) return;
+	removeSphere(editSphere);
+	std::cout << "Removed sphere " << editSphere << std::endl;
+	editSphere = -1;
+}
+
+// Scenes without point lights get one
+void Scene::movePointLightToCamera() {
+	if (pointLightsVec.empty()) {
+		unsigned int material = addMaterial(Material(glm::vec4(0, 0, 0, 20), glm::vec4(0), glm::vec4(0), glm::vec4(0), glm::vec4(1)));
+		addPointLight(PointLight(camera->position, material));
+	}
+	else movePointLight(0, camera->position);
+}
+
+/*
+* Uploads after every step so the BVH is rebuilt for the additions and removals and refit for the move in between
+*/
+void Scene::editDemo() {
+	std::cout << "Editing the scene: add a sphere and a quad, move and recolor the sphere, move a light, remove the quad and the first sphere" << std::endl;
+	dropSphere();
+	unsigned int quad = addQuad(Quad(glm::vec3(-0.3, -0.3, -1), glm::vec3(0.3, -0.3, -1), glm::vec3(-0.3, 0.3, -1), glm::vec3(0.3, 0.3, -1), spheresVec[editSphere].materialIdx));
+	uploadSceneChanges();
+
+	moveEditSphere(glm::vec3(0.0f, 0.25f, 0.0f));
+	recolorEditSphere();
+	movePointLightToCamera();
+	uploadSceneChanges();
+
+	// Removing the first sphere moves the last one, the dropped sphere, into its slot
+	removeQuad(quad);
+	if (spheresVec.size() > 1) {
+		removeSphere(0);
+		editSphere = 0;
+	}
+	uploadSceneChanges();
+}
+
+/*
+* Append every triangle of an OBJ mesh to trianglesVec, placed in the scene by transform
+*/
+void Scene::addMesh(const std::string& filename, unsigned int materialIdx, const glm::mat4& transform) {
+	Mesh mesh(filename);
+	if (!mesh.isLoaded()) return;
+
+	trianglesVec.reserve(trianglesVec.size() + mesh.triangleCount);
+	for (unsigned int i = 0; i < mesh.triangleCount; i++) {
+		const glm::vec4* v = mesh.vertices + i * 3;
+		trianglesVec.push_back(Triangle(glm::vec3(transform * v[0]), glm::vec3(transform * v[1]), glm::vec3(transform * v[2]), materialIdx));
+	}
+	std::cout << "Loaded " << filename << ": " << mesh.triangleCount << " triangles" << std::endl;
+}
+
+/*
+* Load the skybox into host memory and hand the scene to the CPU backend
+*/
+void Scene::loadSkybox() {
+	// Falls back on a black sky rather than crashing so scenes with their own lights still render
+	skybox = new EnvironmentMap(skyboxFile);
+	envDistribution.build(*skybox);
+	// The CPU backend copies both once it first renders, see syncCpuTracer
+	cpuSkyboxStale = cpuSceneStale = true;
 }
 
 /*
@@ -222,79 +593,174 @@ void Scene::setupSceneObjects() {
 */
 void Scene::setupComputeShaderData() {
 
-	int sbWidth, sbHeight, sbChannels;
-	float* skyboxData = stbi_loadf("sunset_in_the_chalk_quarry_2k.hdr", &sbWidth, &sbHeight, &sbChannels, 0);
 	// Skybox
+	// Every level is uploaded straight from the mapped cache, the transform is already applied
 	glGenTextures(1, &skyboxID);
 	glActiveTexture(GL_TEXTURE1);
 	glBindTexture(GL_TEXTURE_2D, skyboxID);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, sbWidth, sbHeight, 0, GL_RGB, GL_FLOAT, skyboxData);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexStorage2D(GL_TEXTURE_2D, skybox->levelCount, GL_RGBA16F, skybox->width, skybox->height);
+	for (unsigned int level = 0; level < skybox->levelCount; level++) {
+		glTexSubImage2D(GL_TEXTURE_2D, level, 0, 0, skybox->levelWidth(level), skybox->levelHeight(level), GL_RGBA, GL_HALF_FLOAT, skybox->levels[level]);
+	}
+	// Sampled with textureLod from texture unit 1, longitude wraps around and latitude stops at the poles
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-
-	glBindImageTexture(1, skyboxID, 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
-	stbi_image_free(skyboxData);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
 
 
 	//
-	// UBO's
+	// Scene storage, the first upload sends everything through the staging ring
 	//
-	unsigned int blockIndexSUBO;
-	GLuint bindingIndexSUBO;
-
-	// Point Light UBO
-	GLuint pointLightUBO;
-	glGenBuffers(1, &pointLightUBO);
-	glBindBuffer(GL_UNIFORM_BUFFER, pointLightUBO);
-	glBufferData(GL_UNIFORM_BUFFER, pointLightsVec.size() * sizeof(PointLight), &pointLightsVec[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
-	blockIndexSUBO = glGetUniformBlockIndex(shaders->compShaderID, "pointLightData");
-	bindingIndexSUBO = 5;
-	glBindBufferBase(GL_UNIFORM_BUFFER, bindingIndexSUBO, pointLightUBO);
-	glUniformBlockBinding(shaders->compShaderID, blockIndexSUBO, bindingIndexSUBO);
-
-	// Sphere UBO
-	GLuint sphereUBO;
-	glGenBuffers(1, &sphereUBO);
-	glBindBuffer(GL_UNIFORM_BUFFER, sphereUBO);
-	glBufferData(GL_UNIFORM_BUFFER, spheresVec.size() * sizeof(Sphere), &spheresVec[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
-	blockIndexSUBO = glGetUniformBlockIndex(shaders->compShaderID, "sphereData");
-	bindingIndexSUBO = 6;
-	glBindBufferBase(GL_UNIFORM_BUFFER, bindingIndexSUBO, sphereUBO);
-	glUniformBlockBinding(shaders->compShaderID, blockIndexSUBO, bindingIndexSUBO);
-
-	// Plane UBO
-	GLuint quadUBO;
-	glGenBuffers(1, &quadUBO);
-	glBindBuffer(GL_UNIFORM_BUFFER, quadUBO);
-	glBufferData(GL_UNIFORM_BUFFER, quadsVec.size() * sizeof(Quad), &quadsVec[0], GL_STATIC_DRAW);
-	glBindBuffer(GL_UNIFORM_BUFFER, 0);
-	glUnmapBuffer(GL_UNIFORM_BUFFER);
-	blockIndexSUBO = glGetUniformBlockIndex(shaders->compShaderID, "quadData");
-	bindingIndexSUBO = 7;
-	glBindBufferBase(GL_UNIFORM_BUFFER, bindingIndexSUBO, quadUBO);
-	glUniformBlockBinding(shaders->compShaderID, blockIndexSUBO, bindingIndexSUBO);
+	uploadRing = new StagingRing();
+	dirtyMaterials.mark(0, materialsVec.size());
+	dirtySpheres.mark(0, spheresVec.size());
+	dirtyTriangles.mark(0, trianglesVec.size());
+	dirtyQuads.mark(0, quadsVec.size());
+	dirtyLights.mark(0, pointLightsVec.size());
+	dirtyEmitters.mark(0, emittersVec.size());
+	dirtyNodes.mark(0, bvh.nodes.size());
+	dirtyPrimRefs.mark(0, bvh.primRefs.size());
+	writeDirtyRanges();
+
+	// Skybox sampling tables, a small header followed by the marginal and conditional CDFs
+	struct EnvironmentHeader {
+		GLuint width, height;
+		GLfloat total;
+		GLuint pad;
+	} envHeader = { (GLuint)envDistribution.width, (GLuint)envDistribution.height, envDistribution.total, 0 };
+	GLsizeiptr marginalSize = envDistribution.marginalCdf.size() * sizeof(float);
+	GLsizeiptr conditionalSize = envDistribution.conditionalCdf.size() * sizeof(float);
+	environmentSSBO = createSSBO(15, sizeof(envHeader) + marginalSize + conditionalSize, nullptr);
+	glNamedBufferSubData(environmentSSBO, 0, sizeof(envHeader), &envHeader);
+	glNamedBufferSubData(environmentSSBO, sizeof(envHeader), marginalSize, envDistribution.marginalCdf.data());
+	glNamedBufferSubData(environmentSSBO, sizeof(envHeader) + marginalSize, conditionalSize, envDistribution.conditionalCdf.data());
+
+	// Wavefront buffers, only written by the GPU, one path per pixel of a tile
+	GLsizeiptr numPaths = (GLsizeiptr)TILE_WIDTH * TILE_HEIGHT;
+	pathSSBO = createSSBO(12, numPaths * PATH_STATE_SIZE, nullptr);
+	hitSSBO = createSSBO(13, numPaths * HIT_RECORD_SIZE, nullptr);
+	queueSSBO = createSSBO(14, QUEUE_HEADER_SIZE + NUM_QUEUES * numPaths * sizeof(GLuint), nullptr);
+	// The queue stage writes the indirect dispatch arguments into the same buffer
+	glBindBuffer(GL_DISPATCH_INDIRECT_BUFFER, queueSSBO);
+
+	// Path statistics, two ray counters and a path length histogram
+	statsSSBO = createSSBO(17, STATS_HEADER_SIZE + (WAVEFRONT_MAX_BOUNCES + 1) * sizeof(GLuint), nullptr);
+	glClearNamedBufferData(statsSSBO, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+
+	// Ray queue sizes copied back by the bounce loop, read straight from the mapping once their fence signaled
+	const GLbitfield readFlags = GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &bounceCheckBuffer);
+	glNamedBufferStorage(bounceCheckBuffer, MAX_BOUNCE_CHECKS * sizeof(GLuint), nullptr, readFlags);
+	bounceCheckMapped = static_cast<const GLuint*>(glMapNamedBufferRange(bounceCheckBuffer, 0, MAX_BOUNCE_CHECKS * sizeof(GLuint), readFlags));
+	if (bounceCheckMapped == nullptr) std::cout << "Failed to map the bounce check buffer" << std::endl;
+}
 
+/*
+* Applies the edits made since the last frame to the BVH and both backends
+* Returns false without touching anything when there were none
+*/
+bool Scene::uploadSceneChanges() {
+	if (!bvhRebuild && !bvhRefit && dirtyMaterials.empty() && dirtySpheres.empty() && dirtyTriangles.empty()
+		&& dirtyQuads.empty() && dirtyLights.empty()) return false;
+
+	if (bvhRebuild) {
+		bvh.build(spheresVec, trianglesVec, quadsVec);
+		dirtyNodes.mark(0, bvh.nodes.size());
+		dirtyPrimRefs.mark(0, bvh.primRefs.size());
+	}
+	else if (bvhRefit) {
+		std::vector<unsigned int> changedNodes;
+		bvh.refit(spheresVec, trianglesVec, quadsVec, changedNodes);
+		for (unsigned int node : changedNodes) dirtyNodes.mark(node);
+	}
+	bvhRebuild = bvhRefit = false;
+
+	if (!dirtySpheres.empty() || !dirtyMaterials.empty()) updateEmitters();
+	cpuSceneStale = true;
+	if (uploadRing != nullptr) {
+		writeDirtyRanges();
+		// Adding the first object of a type or material feature needs a different shader variant
+		shaders->setComputeDefines(buildShaderDefines());
+	}
+	// Without a GL context there is nothing to upload, the CPU backend takes the whole scene
+	else clearDirtyRanges();
+	resetFrames = true;
+	return true;
+}
 
-	//
-	// SSBO's
-	//
+void Scene::clearDirtyRanges() {
+	for (DirtyRanges* dirty : { &dirtyMaterials, &dirtySpheres, &dirtyTriangles, &dirtyQuads, &dirtyLights, &dirtyEmitters, &dirtyNodes, &dirtyPrimRefs }) {
+		dirty->clear();
+	}
+}
 
-	//GLuint sphereSSBO;
-	//glGenBuffers(1, &sphereSSBO);
-	//glBindBuffer(GL_SHADER_STORAGE_BUFFER, sphereSSBO);
-	//glBufferData(GL_SHADER_STORAGE_BUFFER, spheresVec.size() * sizeof(Sphere), NULL, GL_STATIC_DRAW);
-	//struct Sphere* spheres = (struct Sphere*)glMapBufferRange(GL_SHADER_STORAGE_BUFFER, 0, spheresVec.size() * sizeof(Sphere), GL_MAP_WRITE_BIT);
-	//for (int i = 0; i < spheresVec.size(); i++) {
-	//	spheres[i].posRad = spheresVec[i].posRad;
-	//	spheres[i].material = spheresVec[i].material;
-	//}
-	//glUnmapBuffer(GL_SHADER_STORAGE_BUFFER);
-	//glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, sphereSSBO);
+/*
+* Copies the scene and skybox into the CPU backend if they changed since the last time, call before it renders
+* The copy includes the whole BVH and rebuilds the wide one, so loads and edits while the GPU backend runs never pay for it
+*/
+void Scene::syncCpuTracer() {
+	if (cpuSkyboxStale) cpuTracer->setSkybox(*skybox, envDistribution);
+	if (cpuSceneStale) cpuTracer->setScene(materialsVec, spheresVec, trianglesVec, quadsVec, pointLightsVec, emittersVec, bvh);
+	cpuSkyboxStale = cpuSceneStale = false;
+}
+
+/*
+* Copies every dirty range into the scene SSBOs through the staging ring
+*/
+void Scene::writeDirtyRanges() {
+	// The light buffers start with their count, padded to the 16 byte alignment of PointLight
+	bool lightsChanged = !dirtyLights.empty() || pointLightBuffer.id == 0;
+	pointLightBuffer.write(*uploadRing, pointLightsVec, dirtyLights, 4 * sizeof(GLuint));
+	if (lightsChanged) {
+		GLuint lightHeader[4] = { (GLuint)pointLightsVec.size(), 0, 0, 0 };
+		uploadRing->upload(pointLightBuffer.id, 0, sizeof(lightHeader), lightHeader);
+	}
+	bool emittersChanged = !dirtyEmitters.empty() || emitterBuffer.id == 0;
+	emitterBuffer.write(*uploadRing, emittersVec, dirtyEmitters, 4 * sizeof(GLuint));
+	if (emittersChanged) {
+		GLuint emitterHeader[4] = { (GLuint)emittersVec.size(), 0, 0, 0 };
+		uploadRing->upload(emitterBuffer.id, 0, sizeof(emitterHeader), emitterHeader);
+	}
+
+	materialBuffer.write(*uploadRing, materialsVec, dirtyMaterials);
+	sphereBuffer.write(*uploadRing, spheresVec, dirtySpheres);
+	triangleBuffer.write(*uploadRing, trianglesVec, dirtyTriangles);
+	quadBuffer.write(*uploadRing, quadsVec, dirtyQuads);
+	bvhNodeBuffer.write(*uploadRing, bvh.nodes, dirtyNodes);
+	primRefBuffer.write(*uploadRing, bvh.primRefs, dirtyPrimRefs);
+	uploadRing->submit();
+}
+
+/*
+* Screen sized image for the compute stages, bound to the given image unit unless it is negative
+*/
+GLuint Scene::createImageTexture(GLenum format, GLint unit) {
+	GLuint tex;
+	glGenTextures(1, &tex);
+	glBindTexture(GL_TEXTURE_2D, tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexStorage2D(GL_TEXTURE_2D, 1, format, TEXTURE_WIDTH, TEXTURE_HEIGHT);
+	if (unit >= 0) glBindImageTexture(unit, tex, 0, GL_FALSE, 0, GL_READ_WRITE, format);
+	return tex;
+}
+
+/*
+* Create a static SSBO and bind it to the given binding point, empty buffers get a few bytes so the binding stays valid
+*/
+GLuint Scene::createSSBO(GLuint binding, GLsizeiptr size, const void* data) {
+	GLuint ssbo;
+	glGenBuffers(1, &ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, ssbo);
+	if (size > 0) glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STATIC_DRAW);
+	else glBufferData(GL_SHADER_STORAGE_BUFFER, 16, NULL, GL_STATIC_DRAW);
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, ssbo);
+	glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	return ssbo;
 }
 
 
@@ -308,23 +774,399 @@ void Scene::updateFPS() {
 		frameTime = timeDiff / counter;
 		std::string FPS = std::to_string((1.0 / timeDiff) * counter);
 		std::string ms = std::to_string(frameTime * 1000.0);
-		std::string newTitle = "Test - " + FPS + " FPS / " + ms + " ms";
+		std::string newTitle = std::string((useCPU) ? "Test (CPU)" : "Test (GPU)") + " - " + FPS + " FPS / " + ms + " ms";
+		if (useCPU) newTitle += " / " + std::to_string(cpuTracer->lastRayCount / cpuTracer->lastFrameTime / 1e6) + " MRays/s";
 		glfwSetWindowTitle(window, newTitle.c_str());
 		prevTime = curTime;
 		counter = 0;
 	}
 }
 
+/*
+* Corner rays of the view frustum, shared by the GPU and CPU backends
+*/
+void Scene::updateCameraRays() {
+	glm::vec4 temp = camera->invProjView * frust00;
+	ray00 = glm::vec3(temp) / temp.w;
+	temp = camera->invProjView * frust10;
+	ray10 = glm::vec3(temp) / temp.w;
+	temp = camera->invProjView * frust01;
+	ray01 = glm::vec3(temp) / temp.w;
+	temp = camera->invProjView * frust11;
+	ray11 = glm::vec3(temp) / temp.w;
+}
+
+/*
+* Uniform ring of the wavefront stages, bound at binding 0 one slot at a time
+* Without a persistent mapping every slot is written through glNamedBufferSubData instead
+*/
+void Scene::setupFrameUniforms() {
+	GLint alignment = 256;
+	glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	frameSlotStride = ((GLsizeiptr)sizeof(FrameUniforms) + alignment - 1) / alignment * alignment;
+
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &frameUBO);
+	glNamedBufferStorage(frameUBO, frameSlotStride * framesInFlight, nullptr, flags | GL_DYNAMIC_STORAGE_BIT);
+	frameUniformsMapped = static_cast<unsigned char*>(glMapNamedBufferRange(frameUBO, 0, frameSlotStride * framesInFlight, flags));
+	if (frameUniformsMapped == nullptr) std::cout << "Failed to map the frame uniforms" << std::endl;
+}
+
+/*
+* Moves to the next uniform slot and waits until the GPU is done with the frame that used it last
+* This is what paces the frame loop, the wait only blocks once the CPU is framesInFlight frames ahead
+*/
+void Scene::beginFrameSlot() {
+	frameSlot = (frameSlot + 1) % framesInFlight;
+	if (frameFences[frameSlot] == nullptr) return;
+
+	ScopedTimer timer(profiler, CPU_WAIT);
+	GLenum status = glClientWaitSync(frameFences[frameSlot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+	if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) glFinish();
+	glDeleteSync(frameFences[frameSlot]);
+	frameFences[frameSlot] = nullptr;
+}
+
+// Fences everything submitted since beginFrameSlot
+void Scene::endFrameSlot() {
+	frameFences[frameSlot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+/*
+* Transfer all dynamic scene data to the wavefront stages and accumulate the next tiles of a frame into the screen texture
+* Returns true once every tile of the frame has been dispatched, with tilesPerDraw = 0 that is every call
+*/
+bool Scene::dispatchCompute(int numAccumFrames, float time) {
+	beginFrameSlot();
+
+	// Camera and settings only change between frames, a frame spread over several calls keeps the ones it started with
+	if (nextTile == 0) {
+		FrameUniforms& uniforms = frameUniforms;
+		uniforms.prevProjView = historyProjView;
+		uniforms.cameraPos = camera->position;
+		uniforms.time = time;
+		uniforms.cameraDir = camera->direction;
+		uniforms.randMode = randmode;
+		uniforms.ray00 = ray00;
+		uniforms.numAccumFrames = numAccumFrames;
+		uniforms.ray10 = ray10;
+		uniforms.adaptiveSampling = adaptiveSampling;
+		uniforms.ray01 = ray01;
+		uniforms.errorThreshold = errorThreshold;
+		uniforms.ray11 = ray11;
+		uniforms.envSampling = envSampling;
+		uniforms.prevCameraPos = historyCameraPos;
+		uniforms.pathStats = pathStats;
+		uniforms.reproject = reprojectFrame;
+		uniforms.numPaths = TILE_WIDTH * TILE_HEIGHT;
+		uniforms.countRays = pathStats || profiler->metricsEnabled();
+		uniforms.pad = 0;
+
+		frameProjView = camera->projView;
+		frameCameraPos = camera->position;
+	}
+
+	// The slot's fence has signaled, so the mapping is free to write and coherent without a flush
+	GLintptr slotOffset = frameSlot * frameSlotStride;
+	{
+		ScopedTimer timer(profiler, CPU_UPLOAD);
+		if (frameUniformsMapped != nullptr) std::memcpy(frameUniformsMapped + slotOffset, &frameUniforms, sizeof(frameUniforms));
+		else glNamedBufferSubData(frameUBO, slotOffset, sizeof(frameUniforms), &frameUniforms);
+		glBindBufferRange(GL_UNIFORM_BUFFER, 0, frameUBO, slotOffset, sizeof(frameUniforms));
+	}
+
+	// Sample and ray counters of the frame, the histogram is cleared by collectPathStats instead
+	if (nextTile == 0) {
+		glClearNamedBufferSubData(queueSSBO, GL_R32UI, ACTIVE_PIXELS_OFFSET, sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+		glClearNamedBufferSubData(statsSSBO, GL_R32UI, 0, 2 * sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	}
+
+	unsigned int numTiles = numTilesX * numTilesY;
+	unsigned int lastTile = (tilesPerDraw == 0) ? numTiles : std::min(numTiles, nextTile + tilesPerDraw);
+	profiler->beginGpu(GPU_COMPUTE);
+	for (; nextTile < lastTile; nextTile++) {
+		dispatchTile(nextTile);
+	}
+	profiler->endGpu();
+
+	// Every tile already ends in a storage barrier, what is left are the images read by the denoiser, the screen quad,
+	// the history copy and glGetTextureImage, and the counters read back with glGetNamedBufferSubData
+	profiler->beginGpu(GPU_BARRIER);
+	glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+	profiler->endGpu();
+	// The metrics get the frame's counters together with its timings, without waiting for them here
+	if (nextTile == numTiles && profiler->metricsEnabled()) profiler->copyGpuCounters(queueSSBO, ACTIVE_PIXELS_OFFSET, statsSSBO, 0);
+	endFrameSlot();
+
+	if (nextTile < numTiles) return false;
+	nextTile = 0;
+	reprojectFrame = false;
+	return true;
+}
+
+/*
+* Runs every wavefront stage over one tile, the last row/column of tiles is clipped to the image
+* Every bounce runs extend -> miss/shade as separate dispatches, sized on the GPU through the queue stage
+*/
+void Scene::dispatchTile(unsigned int tile) {
+	glm::ivec2 tileOrigin((tile % numTilesX) * TILE_WIDTH, (tile / numTilesX) * TILE_HEIGHT);
+	glm::ivec2 tileSize(std::min(TILE_WIDTH, TEXTURE_WIDTH - tileOrigin.x), std::min(TILE_HEIGHT, TEXTURE_HEIGHT - tileOrigin.y));
+	GLuint numGroupsX = (tileSize.x + GROUP_SIZE_X - 1) / GROUP_SIZE_X;
+	GLuint numGroupsY = (tileSize.y + GROUP_SIZE_Y - 1) / GROUP_SIZE_Y;
+
+	// Generate appends to the first ray queue
+	glClearNamedBufferSubData(queueSSBO, GL_R32UI, 0, sizeof(GLuint), GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+	shaders->activateStage(STAGE_GENERATE);
+	glUniform2i(stageLocs[STAGE_GENERATE].tileOrigin, tileOrigin.x, tileOrigin.y);
+	glUniform2i(stageLocs[STAGE_GENERATE].tileSize, tileSize.x, tileSize.y);
+	glDispatchCompute(numGroupsX, numGroupsY, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+	// Empty queues dispatch zero workgroups, the bounce checks stop issuing them soon after the last path ended
+	GLuint queueIdx = 0;
+	unsigned int numChecks = 0, nextCheck = 0;
+	bool pathsLeft = true;
+	for (unsigned int bounce = 0; bounce <= WAVEFRONT_MAX_BOUNCES; bounce++) {
+		// Resolve the checks in order, without waiting unless the oldest one has fallen BOUNCE_CHECK_LAG bounces behind
+		while (nextCheck < numChecks && pathsLeft) {
+			bool resolved = false;
+			bool wait = bounce >= bounceCheckBounces[nextCheck] + BOUNCE_CHECK_LAG;
+			pathsLeft = !pollBounceCheck(nextCheck, wait, resolved);
+			if (!resolved) break;
+			nextCheck++;
+		}
+		if (!pathsLeft) break;
+
+		dispatchQueueStage((bounce == 0) ? 2 : 0, queueIdx);
+
+		shaders->activateStage(STAGE_EXTEND);
+		glUniform1ui(stageLocs[STAGE_EXTEND].queueIdx, queueIdx);
+		glDispatchComputeIndirect(DISPATCH_ARGS_OFFSET + DISPATCH_EXTEND * 3 * sizeof(GLuint));
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		dispatchQueueStage(1, queueIdx);
+
+		// Miss and shade touch disjoint paths so they need no barrier in between
+		shaders->activateStage(STAGE_MISS);
+		glDispatchComputeIndirect(DISPATCH_ARGS_OFFSET + DISPATCH_MISS * 3 * sizeof(GLuint));
+		shaders->activateStage(STAGE_SHADE);
+		glUniform1ui(stageLocs[STAGE_SHADE].queueIdx, queueIdx);
+		glDispatchComputeIndirect(DISPATCH_ARGS_OFFSET + DISPATCH_SHADE * 3 * sizeof(GLuint));
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT);
+
+		// Shade has filled the other ray queue, its counter is the number of paths the next bounce extends
+		if ((bounce + 1) % BOUNCE_CHECK_INTERVAL == 0 && numChecks < MAX_BOUNCE_CHECKS && bounceCheckMapped != nullptr) {
+			glMemoryBarrier(GL_BUFFER_UPDATE_BARRIER_BIT);
+			glCopyNamedBufferSubData(queueSSBO, bounceCheckBuffer, (queueIdx ^ 1) * sizeof(GLuint), numChecks * sizeof(GLuint), sizeof(GLuint));
+			bounceCheckFences[numChecks] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			bounceCheckBounces[numChecks] = bounce;
+			numChecks++;
+		}
+
+		queueIdx ^= 1;
+	}
+	// Checks still in flight are dropped, the next tile reuses their slots after its own copies
+	for (; nextCheck < numChecks; nextCheck++) {
+		glDeleteSync(bounceCheckFences[nextCheck]);
+		bounceCheckFences[nextCheck] = nullptr;
+	}
+
+	shaders->activateStage(STAGE_ACCUMULATE);
+	glUniform2i(stageLocs[STAGE_ACCUMULATE].tileOrigin, tileOrigin.x, tileOrigin.y);
+	glUniform2i(stageLocs[STAGE_ACCUMULATE].tileSize, tileSize.x, tileSize.y);
+	glDispatchCompute(numGroupsX, numGroupsY, 1);
+	// The next tile reuses the path buffers and clears the queue counters
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+
+	// Submit every tile on its own so a long frame never turns into one huge command buffer for the driver watchdog
+	glFlush();
+}
+
+/*
+* Polls the fence of one bounce check, blocking on it when wait is set
+* resolved is set once the copy has landed, returns true when it saw no path left for the next bounce
+*/
+bool Scene::pollBounceCheck(unsigned int check, bool wait, bool& resolved) {
+	GLenum status = glClientWaitSync(bounceCheckFences[check], GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000000ull : 0);
+	if (status == GL_TIMEOUT_EXPIRED && !wait) return false;
+
+	resolved = true;
+	glDeleteSync(bounceCheckFences[check]);
+	bounceCheckFences[check] = nullptr;
+	// A failed or timed out wait leaves the copy unknown, keep going like before the checks existed
+	if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) return false;
+	return bounceCheckMapped[check] == 0;
+}
+
+/*
+* Single invocation that turns the queue counters into indirect dispatch arguments
+* phase 0 runs before extend and clears the queues extend/shade will fill, phase 1 runs before miss/shade
+* phase 2 is phase 0 for the first bounce, it also adds the generated paths to the frame's activePixels
+*/
+void Scene::dispatchQueueStage(int phase, GLuint queueIdx) {
+	shaders->activateStage(STAGE_QUEUE);
+	glUniform1ui(stageLocs[STAGE_QUEUE].queueIdx, queueIdx);
+	glUniform1i(stageLocs[STAGE_QUEUE].queuePhase, phase);
+	glDispatchCompute(1, 1, 1);
+	glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT);
+}
+
+/*
+* Filters the accumulated image with the edge-avoiding a-trous denoiser and returns the texture holding the result
+* The variance stage pairs every pixel with the variance of its luminance, each iteration then doubles the distance between taps
+*/
+GLuint Scene::dispatchDenoiser() {
+	GLuint numGroupsX = (TEXTURE_WIDTH + GROUP_SIZE_X - 1) / GROUP_SIZE_X;
+	GLuint numGroupsY = (TEXTURE_HEIGHT + GROUP_SIZE_Y - 1) / GROUP_SIZE_Y;
+
+	profiler->beginGpu(GPU_DENOISE);
+	glBindImageTexture(6, filterTexIDs[0], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+	shaders->activateStage(STAGE_DENOISE_VARIANCE);
+	glDispatchCompute(numGroupsX, numGroupsY, 1);
+
+	unsigned int current = 0;
+	shaders->activateStage(STAGE_DENOISE);
+	for (unsigned int i = 0; i < DENOISE_ITERATIONS; i++) {
+		glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		glBindImageTexture(5, filterTexIDs[current], 0, GL_FALSE, 0, GL_READ_ONLY, GL_RGBA32F);
+		glBindImageTexture(6, filterTexIDs[current ^ 1], 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA32F);
+		glUniform1i(stageLocs[STAGE_DENOISE].denoiseStep, 1 << i);
+		glDispatchCompute(numGroupsX, numGroupsY, 1);
+		current ^= 1;
+	}
+
+	// The resolve stage and glGetTextureImage read the result
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+	profiler->endGpu();
+	return filterTexIDs[current];
+}
+
+/*
+* (Re)creates the display target, called whenever the window's framebuffer changes size
+*/
+void Scene::resizeDisplayTarget(int width, int height) {
+	if (resolveTexID != 0) glDeleteTextures(1, &resolveTexID);
+	glCreateTextures(GL_TEXTURE_2D, 1, &resolveTexID);
+	glTextureStorage2D(resolveTexID, 1, GL_RGBA8, width, height);
+	glBindImageTexture(7, resolveTexID, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+	resolveWidth = width;
+	resolveHeight = height;
+	glViewport(0, 0, width, height);
+}
+
+/*
+* Exposure, filmic curve and sRGB encoding of displayTexID into the display target
+* Accumulation and the denoiser stay in linear radiance, the screen quad then only reads 4 bytes per window pixel
+*/
+void Scene::dispatchResolve() {
+	GLuint numGroupsX = (resolveWidth + GROUP_SIZE_X - 1) / GROUP_SIZE_X;
+	GLuint numGroupsY = (resolveHeight + GROUP_SIZE_Y - 1) / GROUP_SIZE_Y;
+
+	profiler->beginGpu(GPU_RESOLVE);
+	glBindTextureUnit(6, displayTexID);
+	shaders->activateStage(STAGE_RESOLVE);
+	glUniform1f(stageLocs[STAGE_RESOLVE].exposure, std::exp2(exposure));
+	glDispatchCompute(numGroupsX, numGroupsY, 1);
+	glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+	profiler->endGpu();
+}
+
+/*
+* Keeps the accumulated frame as history for the next one, which reprojects it into the moved camera's view
+* Must only be called between frames since every tile of the next frame reads the same history
+*/
+void Scene::beginReprojection() {
+	GLuint images[4] = { texID, momentsTexID, albedoTexID, normalDepthTexID };
+	for (int i = 0; i < 4; i++) {
+		glCopyImageSubData(images[i], GL_TEXTURE_2D, 0, 0, 0, 0, historyTexIDs[i], GL_TEXTURE_2D, 0, 0, 0, 0, TEXTURE_WIDTH, TEXTURE_HEIGHT, 1);
+	}
+	historyProjView = frameProjView;
+	historyCameraPos = frameCameraPos;
+	reprojectFrame = true;
+}
+
+/*
+* Number of paths generated over every tile of the last frame, waits for the GPU
+*/
+unsigned int Scene::readActivePixels() {
+	GLuint activePixels = 0;
+	glGetNamedBufferSubData(queueSSBO, ACTIVE_PIXELS_OFFSET, sizeof(GLuint), &activePixels);
+	return activePixels;
+}
+
+/*
+* Adds the path statistics of the last frame to the running totals
+* The GPU counters are 32 bit so they are read back and cleared after every frame, which waits for the GPU
+*/
+void Scene::collectPathStats() {
+	if (useCPU) {
+		statsExtendRays += cpuTracer->lastRayCount - cpuTracer->lastShadowRayCount;
+		statsShadowRays += cpuTracer->lastShadowRayCount;
+		for (size_t i = 0; i < std::min(statsPathLengths.size(), cpuTracer->lastPathLengths.size()); i++) {
+			statsPathLengths[i] += cpuTracer->lastPathLengths[i];
+		}
+	}
+	else {
+		std::vector<GLuint> counters(STATS_HEADER_SIZE / sizeof(GLuint) + statsPathLengths.size());
+		glGetNamedBufferSubData(statsSSBO, 0, counters.size() * sizeof(GLuint), counters.data());
+		glClearNamedBufferData(statsSSBO, GL_R32UI, GL_RED_INTEGER, GL_UNSIGNED_INT, nullptr);
+		statsExtendRays += counters[0];
+		statsShadowRays += counters[1];
+		for (size_t i = 0; i < statsPathLengths.size(); i++) {
+			statsPathLengths[i] += counters[STATS_HEADER_SIZE / sizeof(GLuint) + i];
+		}
+	}
+	statsFrames++;
+}
+
+/*
+* Prints the rays per frame and the path length histogram collected so far and starts over
+* Bounce counts no path ended at after the longest one are left out
+*/
+void Scene::printPathStats() {
+	if (statsFrames == 0) return;
+
+	unsigned long long numPaths = 0;
+	size_t longest = 0;
+	double meanLength = 0.0;
+	for (size_t i = 0; i < statsPathLengths.size(); i++) {
+		numPaths += statsPathLengths[i];
+		meanLength += (double)i * statsPathLengths[i];
+		if (statsPathLengths[i] > 0) longest = i;
+	}
+	meanLength /= std::max(numPaths, 1ull);
+
+	std::cout << "Path statistics over " << statsFrames << " frames" << std::endl;
+	std::cout << "  Extend rays:  " << statsExtendRays / statsFrames << " per frame" << std::endl;
+	std::cout << "  Shadow rays:  " << statsShadowRays / statsFrames << " per frame" << std::endl;
+	std::cout << "  Bounces:      " << meanLength << " on average" << std::endl;
+	std::cout << "  Histogram:   ";
+	for (size_t i = 0; i <= longest; i++) {
+		std::cout << " " << i << ": " << 100.0 * statsPathLengths[i] / std::max(numPaths, 1ull) << "%";
+	}
+	std::cout << std::endl;
+
+	statsExtendRays = statsShadowRays = 0;
+	std::fill(statsPathLengths.begin(), statsPathLengths.end(), 0ull);
+	statsFrames = 0;
+}
+
 void Scene::draw() {
 	double curTime = glfwGetTime();
 
 	int numAccumFrames = 0;
+	double statsTime = curTime;
+	double metricsTime = curTime;
+	std::vector<glm::vec4> denoisedPixels;
 
 	glBindVertexArray(VAO);
+	// Saving raytracer.comp while the window is open swaps in the new stages
+	shaders->watchComputeFile();
 
 	while (!glfwWindowShouldClose(window)) {
 		//break;
 		if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS) break;
+		auto frameStart = std::chrono::steady_clock::now();
 		updateFPS();
 		curTime = glfwGetTime();
 
@@ -332,54 +1174,220 @@ void Scene::draw() {
 		//glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
 		//glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-		// Activate the compute shader and transfer all dynamic scene data
-		shaders->activateCompShader();
-		glUniform1f(timeLoc, (float)curTime);
-		glUniform3fv(cameraPosLoc, 1, glm::value_ptr(camera->position));
-		glUniform3fv(cameraDirLoc, 1, glm::value_ptr(camera->direction));
-		
-		glUniform1i(glGetUniformLocation(shaders->compShaderID, "randMode"), randmode);
-
+		{
+			ScopedTimer timer(profiler, CPU_UPLOAD);
+			uploadSceneChanges();
+		}
+		if (shaders->reloadIfChanged()) {
+			queryUniformLocations();
+			resetFrames = true;
+		}
 		if (resetFrames) {
 			numAccumFrames = 0;
+			nextTile = 0;
 			resetFrames = false;
+			cameraMoved = false;
+			reprojectFrame = false;
+		}
+		else if (cameraMoved) {
+			// Only whole frames can be reprojected, the CPU backend and a frame that is still in progress start over
+			if (temporalReprojection && !useCPU && numAccumFrames > 0 && nextTile == 0) {
+				beginReprojection();
+			}
+			else {
+				numAccumFrames = 0;
+				nextTile = 0;
+				reprojectFrame = false;
+			}
+			cameraMoved = false;
+		}
+		updateCameraRays();
+
+		// With tilesPerDraw set a GPU frame can take several iterations, the partly updated image is shown in between
+		bool frameDone = true;
+		{
+			ScopedTimer timer(profiler, CPU_RENDER);
+			if (useCPU) {
+				syncCpuTracer();
+				cpuTracer->setCamera(camera->position, ray00, ray10, ray01, ray11);
+				cpuTracer->adaptiveSampling = adaptiveSampling;
+				cpuTracer->errorThreshold = errorThreshold;
+				cpuTracer->envSampling = envSampling;
+				cpuTracer->randMode = randmode;
+				cpuTracer->render(numAccumFrames);
+				// The CPU backend runs its own reference denoiser and uploads the result in place of the image
+				const std::vector<glm::vec4>* shown = &cpuTracer->image;
+				if (denoise) {
+					cpuTracer->denoise(denoisedPixels);
+					shown = &denoisedPixels;
+				}
+				glTextureSubImage2D(texID, 0, 0, 0, TEXTURE_WIDTH, TEXTURE_HEIGHT, GL_RGBA, GL_FLOAT, shown->data());
+				displayTexID = texID;
+			}
+			else {
+				frameDone = dispatchCompute(numAccumFrames, (float)curTime);
+				// Partly rendered frames keep showing the last denoised one
+				if (frameDone) displayTexID = (denoise) ? dispatchDenoiser() : texID;
+			}
+		}
+
+		// A minimized window has an empty framebuffer, there is nothing to present then
+		int framebufferWidth, framebufferHeight;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		if (framebufferWidth > 0 && framebufferHeight > 0) {
+			if (framebufferWidth != resolveWidth || framebufferHeight != resolveHeight) resizeDisplayTarget(framebufferWidth, framebufferHeight);
+			dispatchResolve();
+
+			shaders->activateDefaultShader();
+			glBindTextureUnit(0, resolveTexID);
+			glUniform1i(textureLoc, 0);
+			profiler->beginGpu(GPU_BLIT);
+			glDrawElements(GL_TRIANGLES, screenQuadInds.size(), GL_UNSIGNED_INT, 0);
+			profiler->endGpu();
+		}
+		if (frameDone) numAccumFrames++;
+
+		// Path statistics are printed about once a second while enabled
+		if (frameDone && pathStats) {
+			collectPathStats();
+			if (curTime - statsTime >= 1.0) {
+				printPathStats();
+				statsTime = curTime;
+			}
 		}
-		glUniform1i(numAccumFramesLoc, numAccumFrames);
 
-		glm::vec4 temp = camera->invProjView * frust00;
-		ray00 = glm::vec3(temp) / temp.w;
-		temp = camera->invProjView * frust10;
-		ray10 = glm::vec3(temp) / temp.w;
-		temp = camera->invProjView * frust01;
-		ray01 = glm::vec3(temp) / temp.w;
-		temp = camera->invProjView * frust11;
-		ray11 = glm::vec3(temp) / temp.w;
+		{
+			ScopedTimer timer(profiler, CPU_PRESENT);
+			glfwSwapBuffers(window);
+		}
 
-		glUniform3fv(ray00Loc, 1, glm::value_ptr(ray00));
-		glUniform3fv(ray10Loc, 1, glm::value_ptr(ray10));
-		glUniform3fv(ray01Loc, 1, glm::value_ptr(ray01));
-		glUniform3fv(ray11Loc, 1, glm::value_ptr(ray11));
+		{
+			ScopedTimer timer(profiler, CPU_INPUT);
+			glfwPollEvents();
 
-		glDispatchCompute(COMP_DIM_X, COMP_DIM_Y, 1);
-		//glDispatchCompute(TEXTURE_WIDTH, TEXTURE_HEIGHT, 1);
+			// Update camera variables
+			// Holding the mouse button counts as input but only a changed view has to be handled
+			glm::mat4 lastProjView = camera->projView;
+			camera->inputs(frameTime, cameraMoved);
+			camera->matrix();
+			if (camera->projView == lastProjView) cameraMoved = false;
+		}
 
-		// make sure writing to image has finished before read
-		//glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT | GL_SHADER_STORAGE_BARRIER_BIT);
-		glMemoryBarrier(GL_ALL_BARRIER_BITS);
+		// Partial frames add no samples, GPU frames get theirs from the counters copied by dispatchCompute
+		unsigned long long frameSamples = 0, frameRays = 0;
+		if (frameDone && useCPU) {
+			frameSamples = cpuTracer->lastActivePixels;
+			frameRays = cpuTracer->lastRayCount;
+		}
+		profiler->addCpuTime(CPU_FRAME, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+		profiler->endFrame(frameSamples, frameRays);
+		if (profiler->metricsEnabled() && curTime - metricsTime >= 5.0) {
+			profiler->printSummary();
+			metricsTime = curTime;
+		}
+	}
 
-		shaders->activateDefaultShader();
-		glBindTextureUnit(0, texID);
-		glUniform1i(textureLoc, 0);
-		glDrawElements(GL_TRIANGLES, screenQuadInds.size(), GL_UNSIGNED_INT, 0);
-		numAccumFrames++;
+	if (profiler->metricsEnabled()) {
+		profiler->flush();
+		profiler->printSummary();
+	}
+}
 
+/*
+* Accumulates spp samples per pixel from the scene's camera and reads the result back, denoised if denoise is set
+* Always starts from an empty image, so consecutive calls render the same frames
+*/
+void Scene::render(unsigned int spp, std::vector<glm::vec4>& pixels, RenderStats& stats) {
+	// Edits made since the last frame, a new shader variant is built right away
+	uploadSceneChanges();
+	if (shaders != nullptr && shaders->reloadIfChanged()) queryUniformLocations();
+	updateCameraRays();
+	if (useCPU) syncCpuTracer();
+	cpuTracer->setCamera(camera->position, ray00, ray10, ray01, ray11);
+
+	cpuTracer->adaptiveSampling = adaptiveSampling;
+	cpuTracer->errorThreshold = errorThreshold;
+	cpuTracer->envSampling = envSampling;
+	cpuTracer->randMode = randmode;
+
+	unsigned long long numRays = 0;
+	double numSamples = 0.0;
+	unsigned int numFrames = 0;
+	nextTile = 0;
+	reprojectFrame = false;
+	auto start = std::chrono::steady_clock::now();
+
+	// One sample per active pixel per frame, time only feeds the RNG seed so step it as if running at 60 FPS
+	// With adaptive sampling spp is an upper bound and the render stops once every pixel has converged
+	while (numFrames < spp) {
+		auto frameStart = std::chrono::steady_clock::now();
+		float frameTime = numFrames / 60.0f;
+		unsigned int activePixels = TEXTURE_WIDTH * TEXTURE_HEIGHT;
+		unsigned long long frameRays = 0;
+		{
+			ScopedTimer timer(profiler, CPU_RENDER);
+			if (useCPU) {
+				cpuTracer->render(numFrames);
+				frameRays = cpuTracer->lastRayCount;
+				activePixels = cpuTracer->lastActivePixels;
+			}
+			else {
+				while (!dispatchCompute(numFrames, frameTime));
+				if (adaptiveSampling) activePixels = readActivePixels();
+			}
+		}
+		if (pathStats) {
+			unsigned long long lastRays = statsExtendRays + statsShadowRays;
+			collectPathStats();
+			if (!useCPU) frameRays = statsExtendRays + statsShadowRays - lastRays;
+		}
+		numRays += frameRays;
+		numFrames++;
+		numSamples += activePixels;
+		profiler->addCpuTime(CPU_FRAME, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - frameStart).count());
+		profiler->endFrame(activePixels, frameRays);
+		if (activePixels == 0) break;
+	}
 
-		glfwSwapBuffers(window);
-		glfwPollEvents();
+	if (useCPU) {
+		if (denoise) cpuTracer->denoise(pixels);
+		else pixels = cpuTracer->image;
+	}
+	else {
+		GLuint resultTexID = (denoise) ? dispatchDenoiser() : texID;
+		pixels.resize(TEXTURE_WIDTH * TEXTURE_HEIGHT);
+		glFinish();
+		glGetTextureImage(resultTexID, 0, GL_RGBA, GL_FLOAT, (GLsizei)(pixels.size() * sizeof(glm::vec4)), pixels.data());
+	}
 
+	stats.numFrames = numFrames;
+	stats.numSamples = numSamples;
+	stats.numRays = numRays;
+	stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
 
-		// Update camera variables
-		camera->inputs(frameTime, resetFrames);
-		camera->matrix();
+bool Scene::renderOffline(unsigned int spp, const std::string& outFile) {
+	std::vector<glm::vec4> pixels;
+	RenderStats stats;
+	render(spp, pixels, stats);
+	unsigned int numFrames = stats.numFrames;
+	double numSamples = stats.numSamples, seconds = stats.seconds;
+
+	std::cout << "Rendered " << TEXTURE_WIDTH << "x" << TEXTURE_HEIGHT << " at " << spp << " spp on the " << ((useCPU) ? "CPU" : "GPU") << std::endl;
+	if (adaptiveSampling) {
+		std::cout << "  Adaptive:     threshold " << errorThreshold << ", " << numFrames << " frames, "
+			<< numSamples / ((double)TEXTURE_WIDTH * TEXTURE_HEIGHT) << " average spp" << std::endl;
 	}
+	if (denoise) std::cout << "  Denoiser:     " << DENOISE_ITERATIONS << " a-trous iterations" << std::endl;
+	if (useCPU) std::cout << "  Traversal:    " << ((cpuTracer->useWideBVH && WIDE_BVH_AVAILABLE) ? std::to_string(SIMD_WIDTH) + "-wide BVH" : "binary BVH") << std::endl;
+	std::cout << "  Total time:   " << seconds << " s (" << seconds * 1000.0 / std::max(numFrames, 1u) << " ms/frame)" << std::endl;
+	std::cout << "  Samples/sec:  " << numSamples / seconds / 1e6 << " M" << std::endl;
+	if (useCPU || pathStats) std::cout << "  Rays/sec:     " << stats.numRays / seconds / 1e6 << " M" << std::endl;
+	if (pathStats) printPathStats();
+	if (profiler->metricsEnabled()) {
+		profiler->flush();
+		profiler->printSummary();
+	}
+
+	return writeImage(outFile, TEXTURE_WIDTH, TEXTURE_HEIGHT, pixels, exposure);
 }
\ No newline at end of file
@@ -3,8 +3,6 @@
 #include <string>
 #include <vector>
 
-#include <omp.h>
-
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
@@ -16,19 +14,78 @@
 #include "shaders.h"
 #include "camera.h"
 #include "object.h"
+#include "mesh.h"
+#include "bvh.h"
+#include "cputracer.h"
+#include "envmap.h"
+#include "storagebuffer.h"
+#include "profiler.h"
+#include "scenefile.h"
 
 class Scene {
 public:
-	Scene(GLFWwindow* window_);
+	// window_ may be null for headless rendering, in which case only the CPU backend is available
+	// sceneName is one of SCENE_NAMES or the path of a .scene file, each of them also places the camera
+	Scene(GLFWwindow* window_, bool useCPU_ = false, const std::string& sceneName = SCENE_NAMES[0]);
 	~Scene();
 
+	// False when the scene could not be loaded, nothing past the scene objects is set up then
+	bool isValid() const { return valid; }
+
+	static const std::vector<std::string> SCENE_NAMES;
+	static bool isSceneFile(const std::string& name);
+
 	void keyInput(int key, int scancode, int action, int mods);
 
+	// Interactive loop, runs until the window is closed or ESC is pressed
 	void draw();
+	// Batch mode, accumulates a fixed number of samples per pixel and writes the image to outFile
+	bool renderOffline(unsigned int spp, const std::string& outFile);
+	// What renderOffline does short of printing and writing, numRays is only counted on the GPU with pathStats on
+	struct RenderStats {
+		unsigned int numFrames = 0;
+		double numSamples = 0.0;
+		unsigned long long numRays = 0;
+		double seconds = 0.0;
+	};
+	void render(unsigned int spp, std::vector<glm::vec4>& pixels, RenderStats& stats);
+
+	// Scene edits, both backends pick them up at the start of the next frame and restart accumulation
+	// Only the changed elements are uploaded (as a few ranges per buffer), removing an object moves the last one of its type into its index
+	// In the window O drops a sphere in front of the camera, U/J move it, G recolors it, X removes it and L moves a point light to the camera
+	unsigned int addMaterial(const Material& material);
+	void setMaterial(unsigned int idx, const Material& material);
+	unsigned int addSphere(const Sphere& sphere);
+	void moveSphere(unsigned int idx, const glm::vec3& pos);
+	void removeSphere(unsigned int idx);
+	unsigned int addQuad(const Quad& quad);
+	void removeQuad(unsigned int idx);
+	unsigned int addPointLight(const PointLight& light);
+	void movePointLight(unsigned int idx, const glm::vec3& pos);
+	void removePointLight(unsigned int idx);
+	// Fixed sequence of edits that goes through adding, refitting, recoloring and removing once, for --edit
+	void editDemo();
 
 	GLFWwindow* window;
 	Camera* camera;
-	Shader* shaders;
+	Shader* shaders = nullptr;
+	CPUTracer* cpuTracer;
+	// Frame timings, only written out and summarized once openMetrics has been called on it
+	FrameProfiler* profiler;
+
+	// Stop tracing pixels once the relative standard error of their mean luminance is below errorThreshold
+	bool adaptiveSampling = false;
+	float errorThreshold = 0.02f;
+	// Send a shadow ray towards a bright part of the skybox at every diffuse hit
+	bool envSampling = true;
+	// Count rays and path lengths every frame and print them, the GPU backend waits for every frame then
+	bool pathStats = false;
+	// Show the accumulated image through the a-trous denoiser, guided by first hit albedo, normal and depth
+	bool denoise = true;
+	// Camera moves reproject the accumulated image into the new view instead of starting over, GPU backend only
+	bool temporalReprojection = true;
+	// In stops, applied ahead of the filmic curve by the resolve stage and to .png output
+	float exposure = 0.0f;
 
 private:
 	static void keyInputSetup(GLFWwindow* window, int key, int scancode, int action, int mods) {
@@ -38,20 +95,133 @@ private:
 
 	int randmode = 0;
 	bool resetFrames = false;
+	// Set by camera input, handled like resetFrames unless the accumulation can be reprojected
+	bool cameraMoved = false;
+	// Renders on the CPU and uploads the result instead of dispatching the compute shader
+	bool useCPU = false;
+	bool valid = false;
 
 	void updateFPS();
 	void setupScreenQuad();
-	void setupSceneObjects();
+	GLuint createImageTexture(GLenum format, GLint unit);
+	bool setupSceneObjects(const std::string& name);
+	bool loadSceneFile(const std::string& filename);
+	void dropSphere();
+	void moveEditSphere(const glm::vec3& offset);
+	void recolorEditSphere();
+	void removeEditSphere();
+	void movePointLightToCamera();
+	void updateEmitters();
+	void addMesh(const std::string& filename, unsigned int materialIdx, const glm::mat4& transform = glm::mat4(1.0f));
+	void loadSkybox();
 	void setupComputeShaderData();
+	bool uploadSceneChanges();
+	void writeDirtyRanges();
+	void clearDirtyRanges();
+	void syncCpuTracer();
+	std::string buildShaderDefines() const;
+	void queryUniformLocations();
+	GLuint createSSBO(GLuint binding, GLsizeiptr size, const void* data);
+	void updateCameraRays();
+	void setupFrameUniforms();
+	void beginFrameSlot();
+	void endFrameSlot();
+	bool dispatchCompute(int numAccumFrames, float time);
+	void dispatchTile(unsigned int tile);
+	void dispatchQueueStage(int phase, GLuint queueIdx);
+	bool pollBounceCheck(unsigned int check, bool wait, bool& resolved);
+	GLuint dispatchDenoiser();
+	void resizeDisplayTarget(int width, int height);
+	void dispatchResolve();
+	void beginReprojection();
+	unsigned int readActivePixels();
+	void collectPathStats();
+	void printPathStats();
 
-	const unsigned int COMP_DIM_X, COMP_DIM_Y;
+	// Wavefront pipeline sizes, must match raytracer.comp
+	const unsigned int GROUP_SIZE_X, GROUP_SIZE_Y;
+	static const unsigned int WAVEFRONT_MAX_BOUNCES = 32;	// Hard cap, Russian roulette ends most paths long before
+	static const unsigned int PATH_STATE_SIZE = 112;	// sizeof(PathState) in std430
+	static const unsigned int HIT_RECORD_SIZE = 32;		// sizeof(HitRecord) in std430
+	static const unsigned int QUEUE_HEADER_SIZE = 64;	// Counters and indirect dispatch arguments ahead of the queues
+	static const unsigned int NUM_QUEUES = 4;
+	static const unsigned int DISPATCH_ARGS_OFFSET = 16;	// Indirect arguments follow the four queue counters
+	static const unsigned int ACTIVE_PIXELS_OFFSET = 52;	// activePixels follows the three indirect dispatches
+	enum QueueDispatch { DISPATCH_EXTEND, DISPATCH_SHADE, DISPATCH_MISS };
+	static const unsigned int STATS_HEADER_SIZE = 16;	// Ray counters ahead of the path length histogram
+	static const unsigned int DENOISE_ITERATIONS = 5;	// A-trous iterations, the last one's taps are 16 pixels apart
+	static const unsigned int SCENE_SEED = 1;	// Seeds the random objects of the canonical scenes
 
+	std::vector<Material> materialsVec;
 	std::vector<Sphere> spheresVec;
+	std::vector<Triangle> trianglesVec;
 	std::vector<Quad> quadsVec;
 	std::vector<PointLight> pointLightsVec;
+	// Spheres with an emissive material, light sources for next event estimation next to the point lights
+	std::vector<unsigned int> emittersVec;
+
+	// Acceleration structure over spheres, triangles and quads, shared by both backends
+	BVH bvh;
+	// Edits since the last upload, moves refit the BVH while adding or removing primitives rebuilds it
+	DirtyRanges dirtyMaterials, dirtySpheres, dirtyTriangles, dirtyQuads, dirtyLights, dirtyEmitters, dirtyNodes, dirtyPrimRefs;
+	bool bvhRebuild = false, bvhRefit = false;
+	// The CPU backend's copy of the scene and skybox is only brought up to date before it renders, the GPU backend never needs it
+	bool cpuSceneStale = true, cpuSkyboxStale = true;
+	// Sphere the edit keys work on, -1 until one has been dropped
+	int editSphere = -1;
+	unsigned int editColor = 0;
+
+	// Scene storage, grows with the scene and is only written through uploadRing
+	StagingRing* uploadRing = nullptr;
+	StorageBuffer pointLightBuffer{ 5 }, sphereBuffer{ 6 }, quadBuffer{ 7 }, triangleBuffer{ 8 };
+	StorageBuffer bvhNodeBuffer{ 9 }, primRefBuffer{ 10 }, materialBuffer{ 11 }, emitterBuffer{ 16 };
+	// Path state, hit records and ray queues passed between the wavefront stages, sized for one tile
+	GLuint pathSSBO, hitSSBO, queueSSBO;
+	GLuint environmentSSBO;
+	GLuint statsSSBO;
+
+	// Early exit of the bounce loop, every BOUNCE_CHECK_INTERVAL bounces the next ray queue's size is copied into bounceCheckMapped and fenced
+	// The checks are polled without waiting and only waited on once they are BOUNCE_CHECK_LAG bounces old, so the GPU always has work queued
+	static const unsigned int BOUNCE_CHECK_INTERVAL = 4;
+	static const unsigned int BOUNCE_CHECK_LAG = 8;
+	static const unsigned int MAX_BOUNCE_CHECKS = WAVEFRONT_MAX_BOUNCES / BOUNCE_CHECK_INTERVAL;
+	GLuint bounceCheckBuffer = 0;
+	const GLuint* bounceCheckMapped = nullptr;
+	GLsync bounceCheckFences[MAX_BOUNCE_CHECKS] = {};
+	unsigned int bounceCheckBounces[MAX_BOUNCE_CHECKS] = {};
+
+	// Path statistics summed over the frames since they were last printed
+	unsigned long long statsExtendRays = 0, statsShadowRays = 0;
+	std::vector<unsigned long long> statsPathLengths = std::vector<unsigned long long>(WAVEFRONT_MAX_BOUNCES + 1, 0);
+	unsigned int statsFrames = 0;
+
+	// Tile scheduler, every tile runs the whole wavefront pipeline
+	const unsigned int TILE_WIDTH, TILE_HEIGHT;
+	unsigned int numTilesX, numTilesY;
+	unsigned int tilesPerDraw;	// 0 renders the whole frame in one call to dispatchCompute
+	unsigned int nextTile = 0;	// First tile of the current frame that has not been dispatched yet
+
+	// Preprocessed skybox with its mip chain, mapped from the cache file next to the HDR
+	EnvironmentMap* skybox = nullptr;
+	std::string skyboxFile = "sunset_in_the_chalk_quarry_2k.hdr";	// Scene files can pick another one
+	// Importance sampling tables for the skybox, shared by both backends
+	EnvironmentDistribution envDistribution;
 
 	// Variables for textured screen quad
 	GLuint texID;
+	GLuint momentsTexID;
+	GLuint albedoTexID, normalDepthTexID;	// First hit features written next to the image
+	GLuint filterTexIDs[2];	// Denoiser ping-pong, one of them holds the denoised frame
+	GLuint displayTexID;	// Resolved for the window, texID or the denoiser's output
+	// RGBA8 output of the resolve stage at the window's framebuffer size, the screen quad draws it texel for texel
+	GLuint resolveTexID = 0;
+	int resolveWidth = 0, resolveHeight = 0;
+	// Image, moments, albedo and normal + depth as they were before the camera moved, on texture units 2 to 5
+	GLuint historyTexIDs[4];
+	bool reprojectFrame = false;	// The frame being rendered starts from the history
+	// Camera the frame in texID was started with and the one the history was rendered with
+	glm::mat4 frameProjView, historyProjView;
+	glm::vec3 frameCameraPos, historyCameraPos;
 	GLuint VBO, EBO, VAO;
 	const unsigned int TEXTURE_WIDTH, TEXTURE_HEIGHT;
 
@@ -73,8 +243,48 @@ private:
 	unsigned int counter = 0;
 	float frameTime = 0.0001;
 
+	// Per frame data of the wavefront stages, std140 layout of the FrameUniforms block in raytracer.comp
+	struct FrameUniforms {
+		glm::mat4 prevProjView;
+		glm::vec3 cameraPos;
+		GLfloat time;
+		glm::vec3 cameraDir;
+		GLint randMode;
+		glm::vec3 ray00;
+		GLint numAccumFrames;
+		glm::vec3 ray10;
+		GLint adaptiveSampling;
+		glm::vec3 ray01;
+		GLfloat errorThreshold;
+		glm::vec3 ray11;
+		GLint envSampling;
+		glm::vec3 prevCameraPos;
+		GLint pathStats;
+		GLint reproject;
+		GLuint numPaths;
+		GLint countRays;
+		GLuint pad;
+	};
+	static_assert(sizeof(FrameUniforms) == 192, "FrameUniforms has to match the std140 block in raytracer.comp");
+	// Latched when the first tile of a frame is dispatched, the later tiles of the frame reuse it so they all see the same camera
+	FrameUniforms frameUniforms;
+
+	// Ring of FrameUniforms slots in one persistently mapped buffer, every dispatchCompute call writes the next slot
+	// Each slot is fenced after its dispatches, so the CPU runs at most framesInFlight calls ahead of the GPU
+	static const unsigned int MAX_FRAMES_IN_FLIGHT = 4;
+	const unsigned int framesInFlight;
+	GLuint frameUBO = 0;
+	unsigned char* frameUniformsMapped = nullptr;
+	GLsizeiptr frameSlotStride = 0;	// sizeof(FrameUniforms) rounded up to GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT
+	unsigned int frameSlot = 0;
+	GLsync frameFences[MAX_FRAMES_IN_FLIGHT] = {};
+
 	// Uniform locations
 	GLuint skyboxID;
-	GLuint timeLoc, cameraPosLoc, cameraDirLoc, numAccumFramesLoc, ray00Loc, ray10Loc, ray01Loc, ray11Loc;
+	// Per wavefront stage, -1 where a stage does not use the uniform
+	struct StageUniforms {
+		GLint queueIdx, queuePhase, tileOrigin, tileSize, denoiseStep, exposure;
+	};
+	StageUniforms stageLocs[NUM_WAVEFRONT_STAGES];
 	GLuint textureLoc;
 };
\ No newline at end of file
@@ -0,0 +1,282 @@
+#include "scenefile.h"
+
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+
+#include <glm/gtc/matrix_transform.hpp>
+
+#include "mesh.h"
+
+static const char SCENE_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'C', 'E', 'N', 'E', 0 };
+// Element type of every section, in SceneSection order
+static const size_t SECTION_ELEMENT_SIZES[NUM_SCENE_SECTIONS] = { sizeof(Material), sizeof(Sphere), sizeof(Triangle), sizeof(Quad), sizeof(PointLight), sizeof(BVHNode), sizeof(unsigned int) };
+
+// Size and modification time of a file, false if it does not exist
+static bool fileStamp(const std::string& filename, uint64_t& size, int64_t& time) {
+	std::error_code error;
+	size = std::filesystem::file_size(filename, error);
+	if (error) return false;
+	time = (int64_t)std::filesystem::last_write_time(filename, error).time_since_epoch().count();
+	return !error;
+}
+
+SceneFile::SceneFile(const std::string& filename) {
+	uint64_t sourceSize;
+	int64_t sourceTime;
+	if (!fileStamp(filename, sourceSize, sourceTime)) {
+		std::cout << "Failed to open scene: " << filename << std::endl;
+		return;
+	}
+
+	std::string cacheFile = filename + ".scenecache";
+	if (openCache(cacheFile, filename)) return;
+
+	std::cout << "Building scene cache: " << cacheFile << std::endl;
+	if (!compile(filename, cacheFile) || !openCache(cacheFile, filename)) {
+		std::cout << "Failed to load scene: " << filename << std::endl;
+	}
+}
+
+SceneFile::~SceneFile() {
+	delete cache;
+}
+
+/*
+* Maps the cache and checks it against every file it was compiled from, nothing else is read until a section is used
+*/
+bool SceneFile::openCache(const std::string& cacheFile, const std::string& sceneFile) {
+	MappedFile* file = new MappedFile(cacheFile);
+	const SceneCacheHeader* fileHeader = reinterpret_cast<const SceneCacheHeader*>(file->data);
+	bool valid = file->isOpen() && file->size >= sizeof(SceneCacheHeader)
+		&& std::memcmp(fileHeader->magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC)) == 0
+		&& fileHeader->version == CACHE_VERSION && fileHeader->dependencyCount > 0
+		&& file->size >= sizeof(SceneCacheHeader) + fileHeader->dependencyCount * sizeof(SceneDependency);
+
+	if (valid) {
+		const SceneDependency* dependencies = reinterpret_cast<const SceneDependency*>(file->data + sizeof(SceneCacheHeader));
+		// The cache may have been copied along with the scene, the scene file is always checked under its current name
+		for (uint32_t i = 0; i < fileHeader->dependencyCount && valid; i++) {
+			uint64_t size;
+			int64_t time;
+			std::string path = (i == 0) ? sceneFile : std::string(dependencies[i].path, strnlen(dependencies[i].path, sizeof(dependencies[i].path)));
+			valid = fileStamp(path, size, time) && size == dependencies[i].size && time == dependencies[i].time;
+		}
+		for (int s = 0; s < NUM_SCENE_SECTIONS && valid; s++) {
+			valid = fileHeader->elementSizes[s] == SECTION_ELEMENT_SIZES[s]
+				&& fileHeader->sectionOffsets[s] + fileHeader->sectionCounts[s] * SECTION_ELEMENT_SIZES[s] <= file->size;
+		}
+	}
+	// Stale caches are unmapped right away so they can be overwritten
+	if (!valid) {
+		delete file;
+		return false;
+	}
+
+	delete cache;
+	cache = file;
+	header = fileHeader;
+	hasCamera = header->cameraPosition.w != 0.0f;
+	cameraPosition = glm::vec3(header->cameraPosition);
+	cameraDirection = glm::vec3(header->cameraDirection);
+	environment = std::string(header->environment, strnlen(header->environment, sizeof(header->environment)));
+	return true;
+}
+
+/*
+* Parses the scene file, loads its meshes, builds the BVH and writes everything to the cache
+* Errors name the line they were found on and stop the compilation
+*/
+bool SceneFile::compile(const std::string& sceneFile, const std::string& cacheFile) {
+	std::ifstream in(sceneFile);
+	if (!in) return false;
+	std::filesystem::path directory = std::filesystem::path(sceneFile).parent_path();
+
+	std::vector<Material> materials;
+	std::vector<Sphere> spheres;
+	std::vector<Triangle> triangles;
+	std::vector<Quad> quads;
+	std::vector<PointLight> pointLights;
+	std::map<std::string, unsigned int> materialNames;
+
+	SceneCacheHeader header = {};
+	std::memcpy(header.magic, SCENE_CACHE_MAGIC, sizeof(SCENE_CACHE_MAGIC));
+	header.version = CACHE_VERSION;
+	header.cameraDirection = glm::vec4(0, 0, -1, 0);
+
+	std::vector<SceneDependency> dependencies(1);
+	auto addDependency = [&dependencies](const std::string& path, SceneDependency& dependency) {
+		if (path.size() >= sizeof(dependency.path)) return false;
+		std::memset(dependency.path, 0, sizeof(dependency.path));
+		std::memcpy(dependency.path, path.c_str(), path.size());
+		return fileStamp(path, dependency.size, dependency.time);
+	};
+	if (!addDependency(sceneFile, dependencies[0])) return false;
+
+	std::string line;
+	unsigned int lineNumber = 0;
+	while (std::getline(in, line)) {
+		lineNumber++;
+		line = line.substr(0, line.find('#'));
+		std::istringstream tokens(line);
+		std::string keyword;
+		if (!(tokens >> keyword)) continue;
+
+		auto fail = [&](const std::string& message) {
+			std::cout << sceneFile << ":" << lineNumber << ": " << message << std::endl;
+			return false;
+		};
+		auto readVec3 = [&tokens](glm::vec3& v) { return (bool)(tokens >> v.x >> v.y >> v.z); };
+		auto readMaterial = [&](unsigned int& idx) {
+			std::string name;
+			if (!(tokens >> name)) return false;
+			auto it = materialNames.find(name);
+			if (it == materialNames.end()) return false;
+			idx = it->second;
+			return true;
+		};
+		bool ok = true;
+
+		if (keyword == "camera") {
+			glm::vec3 position, direction;
+			ok = readVec3(position) && readVec3(direction) && glm::length(direction) > 0.0f;
+			header.cameraPosition = glm::vec4(position, 1.0f);
+			header.cameraDirection = glm::vec4(glm::normalize(direction), 0.0f);
+		}
+		else if (keyword == "environment") {
+			std::string file;
+			ok = (bool)(tokens >> file);
+			std::string path = (directory / file).string();
+			if (ok && path.size() >= sizeof(header.environment)) return fail("environment path is too long");
+			if (ok) std::memcpy(header.environment, path.c_str(), path.size());
+		}
+		else if (keyword == "material") {
+			std::string name, key;
+			ok = (bool)(tokens >> name);
+			Material material;
+			while (ok && tokens >> key) {
+				glm::vec4* color = nullptr;
+				if (key == "diffuse") color = &material.diffuseColor;
+				else if (key == "gloss") color = &material.glossColor;
+				else if (key == "refraction") color = &material.refractionColor;
+				else if (key == "emission") color = &material.emissionColor;
+
+				glm::vec3 rgb;
+				if (color != nullptr) {
+					ok = readVec3(rgb);
+					*color = glm::vec4(rgb, 1.0f);
+				}
+				else if (key == "smoothness") ok = (bool)(tokens >> material.data.x);
+				else if (key == "glossiness") ok = (bool)(tokens >> material.data.y);
+				else if (key == "ior") ok = (bool)(tokens >> material.data.z);
+				else if (key == "power") ok = (bool)(tokens >> material.data.w);
+				else return fail("unknown material property " + key);
+			}
+			if (ok) {
+				materialNames[name] = (unsigned int)materials.size();
+				materials.push_back(material);
+			}
+		}
+		else if (keyword == "sphere") {
+			glm::vec3 center;
+			float radius;
+			unsigned int materialIdx;
+			ok = readVec3(center) && (tokens >> radius) && readMaterial(materialIdx);
+			if (ok) spheres.push_back(Sphere(glm::vec4(center, radius), materialIdx));
+		}
+		else if (keyword == "quad") {
+			glm::vec3 c[4];
+			unsigned int materialIdx;
+			ok = readVec3(c[0]) && readVec3(c[1]) && readVec3(c[2]) && readVec3(c[3]) && readMaterial(materialIdx);
+			if (ok) quads.push_back(Quad(c[0], c[1], c[2], c[3], materialIdx));
+		}
+		else if (keyword == "triangle") {
+			glm::vec3 p[3];
+			unsigned int materialIdx;
+			ok = readVec3(p[0]) && readVec3(p[1]) && readVec3(p[2]) && readMaterial(materialIdx);
+			if (ok) triangles.push_back(Triangle(p[0], p[1], p[2], materialIdx));
+		}
+		else if (keyword == "light") {
+			glm::vec3 position;
+			unsigned int materialIdx;
+			ok = readVec3(position) && readMaterial(materialIdx);
+			if (ok) pointLights.push_back(PointLight(position, materialIdx));
+		}
+		else if (keyword == "mesh") {
+			std::string file, key;
+			unsigned int materialIdx;
+			ok = (tokens >> file) && readMaterial(materialIdx);
+			glm::vec3 scale(1.0f), translate(0.0f);
+			while (ok && tokens >> key) {
+				if (key == "translate") ok = readVec3(translate);
+				else if (key == "scale") {
+					ok = (bool)(tokens >> scale.x);
+					// One value scales uniformly
+					if (ok && !(tokens >> scale.y >> scale.z)) {
+						tokens.clear();
+						scale = glm::vec3(scale.x);
+					}
+				}
+				else return fail("unknown mesh option " + key);
+			}
+			if (!ok) return fail("expected mesh <file.obj> <material> [scale f | scale xyz] [translate xyz]");
+
+			std::string path = (directory / file).string();
+			Mesh mesh(path);
+			if (!mesh.isLoaded()) return fail("could not load " + path);
+			dependencies.push_back(SceneDependency());
+			if (!addDependency(path, dependencies.back())) return fail("mesh path is too long");
+
+			glm::mat4 transform = glm::scale(glm::translate(glm::mat4(1.0f), translate), scale);
+			triangles.reserve(triangles.size() + mesh.triangleCount);
+			for (unsigned int i = 0; i < mesh.triangleCount; i++) {
+				const glm::vec4* v = mesh.vertices + i * 3;
+				triangles.push_back(Triangle(glm::vec3(transform * v[0]), glm::vec3(transform * v[1]), glm::vec3(transform * v[2]), materialIdx));
+			}
+		}
+		else return fail("unknown statement " + keyword);
+
+		if (!ok) return fail("could not parse " + keyword + " (or its material is not declared yet)");
+	}
+
+	BVH bvh;
+	bvh.build(spheres, triangles, quads);
+
+	// Sections follow the header and dependencies, each starts on its own alignment boundary
+	const void* sectionData[NUM_SCENE_SECTIONS] = { materials.data(), spheres.data(), triangles.data(), quads.data(), pointLights.data(), bvh.nodes.data(), bvh.primRefs.data() };
+	const uint64_t sectionSizes[NUM_SCENE_SECTIONS] = { materials.size() * sizeof(Material), spheres.size() * sizeof(Sphere), triangles.size() * sizeof(Triangle),
+		quads.size() * sizeof(Quad), pointLights.size() * sizeof(PointLight), bvh.nodes.size() * sizeof(BVHNode), bvh.primRefs.size() * sizeof(unsigned int) };
+	const uint64_t sectionCounts[NUM_SCENE_SECTIONS] = { materials.size(), spheres.size(), triangles.size(), quads.size(), pointLights.size(), bvh.nodes.size(), bvh.primRefs.size() };
+	header.dependencyCount = (uint32_t)dependencies.size();
+	uint64_t offset = sizeof(SceneCacheHeader) + dependencies.size() * sizeof(SceneDependency);
+	for (int s = 0; s < NUM_SCENE_SECTIONS; s++) {
+		offset = (offset + SECTION_ALIGNMENT - 1) / SECTION_ALIGNMENT * SECTION_ALIGNMENT;
+		header.sectionOffsets[s] = offset;
+		header.sectionCounts[s] = sectionCounts[s];
+		header.elementSizes[s] = (uint32_t)SECTION_ELEMENT_SIZES[s];
+		offset += sectionSizes[s];
+	}
+
+	// Write to a temporary file first so an interrupted compilation never leaves a truncated cache behind
+	std::string tempFile = cacheFile + ".tmp";
+	{
+		std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+		if (!out) return false;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(reinterpret_cast<const char*>(dependencies.data()), dependencies.size() * sizeof(SceneDependency));
+		const char padding[SECTION_ALIGNMENT] = {};
+		for (int s = 0; s < NUM_SCENE_SECTIONS; s++) {
+			out.write(padding, header.sectionOffsets[s] - (uint64_t)out.tellp());
+			out.write(reinterpret_cast<const char*>(sectionData[s]), sectionSizes[s]);
+		}
+		if (!out) return false;
+	}
+	std::error_code error;
+	std::filesystem::rename(tempFile, cacheFile, error);
+	std::cout << "Compiled " << sceneFile << ": " << materials.size() << " materials, " << spheres.size() << " spheres, " << triangles.size() << " triangles, "
+		<< quads.size() << " quads, " << pointLights.size() << " point lights" << std::endl;
+	return !error;
+}
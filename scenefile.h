@@ -0,0 +1,91 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "mappedfile.h"
+#include "object.h"
+#include "bvh.h"
+
+/*
+	Scene described in a text file (.scene), one statement per line, # starts a comment
+		camera <position xyz> <direction xyz>
+		environment <file.hdr>
+		material <name> [diffuse rgb] [gloss rgb] [refraction rgb] [emission rgb] [smoothness f] [glossiness f] [ior f] [power f]
+		sphere <center xyz> <radius> <material>
+		quad <c00 xyz> <c10 xyz> <c01 xyz> <c11 xyz> <material>
+		triangle <p0 xyz> <p1 xyz> <p2 xyz> <material>
+		light <position xyz> <material>
+		mesh <file.obj> <material> [scale f | scale xyz] [translate xyz]
+	- Paths are relative to the scene file, materials have to be declared before they are used
+	- The first load compiles the scene into a binary cache next to it (<file>.scenecache), BVH included
+	- Every section of the cache is laid out exactly like its SSBO, later loads memory map it and take the arrays as they are
+	- The cache is rebuilt whenever the scene file or one of its meshes no longer matches the size and modification time stored in it,
+	  or when the element sizes stored in it differ from this build's structs
+*/
+
+enum SceneSection {
+	SECTION_MATERIALS,
+	SECTION_SPHERES,
+	SECTION_TRIANGLES,
+	SECTION_QUADS,
+	SECTION_POINT_LIGHTS,
+	SECTION_BVH_NODES,
+	SECTION_PRIM_REFS,
+	NUM_SCENE_SECTIONS
+};
+
+struct SceneCacheHeader {
+	char magic[8];			// "RTSCENE\0"
+	uint32_t version;
+	uint32_t dependencyCount;
+	glm::vec4 cameraPosition;	// w = 1 when the scene sets the camera
+	glm::vec4 cameraDirection;
+	char environment[256];	// Empty when the scene keeps the default skybox
+	uint64_t sectionOffsets[NUM_SCENE_SECTIONS];	// From the start of the file, multiples of SECTION_ALIGNMENT
+	uint64_t sectionCounts[NUM_SCENE_SECTIONS];		// In elements
+	uint32_t elementSizes[NUM_SCENE_SECTIONS];		// sizeof of every section's element type, a build with other layouts rebuilds the cache
+	// Followed by dependencyCount SceneDependency records, the scene file itself first, then the sections
+};
+
+struct SceneDependency {
+	char path[256];
+	uint64_t size;
+	int64_t time;
+};
+
+class SceneFile {
+public:
+	SceneFile(const std::string& filename);
+	~SceneFile();
+
+	SceneFile(const SceneFile&) = delete;
+	SceneFile& operator=(const SceneFile&) = delete;
+
+	bool isLoaded() const { return cache != nullptr; }
+
+	// Elements of a section, they point into the mapped cache file
+	template <typename T>
+	const T* section(SceneSection s) const { return reinterpret_cast<const T*>(cache->data + header->sectionOffsets[s]); }
+	size_t count(SceneSection s) const { return (size_t)header->sectionCounts[s]; }
+	// Copies a section into the matching scene array
+	template <typename T>
+	void copySection(SceneSection s, std::vector<T>& out) const { out.assign(section<T>(s), section<T>(s) + count(s)); }
+
+	bool hasCamera = false;
+	glm::vec3 cameraPosition = glm::vec3(0), cameraDirection = glm::vec3(0, 0, -1);
+	std::string environment;
+
+private:
+	static const uint32_t CACHE_VERSION = 2;
+	static const uint64_t SECTION_ALIGNMENT = 256;	// Largest GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT in practice
+
+	bool openCache(const std::string& cacheFile, const std::string& sceneFile);
+	static bool compile(const std::string& sceneFile, const std::string& cacheFile);
+
+	MappedFile* cache = nullptr;
+	const SceneCacheHeader* header = nullptr;
+};
@@ -1,5 +1,15 @@
 #include "shaders.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include "mappedfile.h"
+
 std::string getFileContents(const char* filename) {
 	std::ifstream in(filename, std::ios::binary);
 	if (in) {
@@ -14,7 +24,64 @@ std::string getFileContents(const char* filename) {
 	throw(errno);
 }
 
-Shader::Shader(const char* vertexFile, const char* fragmentFile, const char* computeFile) {
+static const char* stageNames[NUM_WAVEFRONT_STAGES] = {
+	"STAGE_GENERATE",
+	"STAGE_QUEUE",
+	"STAGE_EXTEND",
+	"STAGE_SHADE",
+	"STAGE_MISS",
+	"STAGE_ACCUMULATE",
+	"STAGE_DENOISE_VARIANCE",
+	"STAGE_DENOISE",
+	"STAGE_RESOLVE"
+};
+
+// Stored ahead of the driver's program binary in every cache file
+struct ProgramCacheHeader {
+	char magic[8];	// "RTSHADER"
+	uint32_t version;
+	uint32_t binaryFormat;
+	uint32_t binaryLength;
+	uint32_t pad;
+};
+static const char PROGRAM_CACHE_MAGIC[8] = { 'R', 'T', 'S', 'H', 'A', 'D', 'E', 'R' };
+static const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+// 64 bit FNV-1a, only used to name cache files
+static uint64_t hashString(const std::string& str, uint64_t hash = 14695981039346656037ull) {
+	for (unsigned char c : str) {
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static bool checkCompileStatus(GLuint shader, const std::string& name) {
+	GLint status;
+	glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+	if (status == GL_TRUE) return true;
+	GLint logLength = 0;
+	glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &logLength);
+	std::string log(std::max(logLength, 1), '\0');
+	glGetShaderInfoLog(shader, logLength, NULL, &log[0]);
+	std::cout << "Failed to compile " << name << ":\n" << log.c_str() << std::endl;
+	return false;
+}
+
+static bool checkLinkStatus(GLuint program, const std::string& name) {
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status == GL_TRUE) return true;
+	GLint logLength = 0;
+	glGetProgramiv(program, GL_INFO_LOG_LENGTH, &logLength);
+	std::string log(std::max(logLength, 1), '\0');
+	glGetProgramInfoLog(program, logLength, NULL, &log[0]);
+	std::cout << "Failed to link " << name << ":\n" << log.c_str() << std::endl;
+	return false;
+}
+
+Shader::Shader(const char* vertexFile, const char* fragmentFile, const char* computeFile_, const std::string& computeDefines_) :
+	computeFile(computeFile_), computeDefines(computeDefines_) {
 
 	std::string vertexCode = getFileContents(vertexFile);
 	std::string fragmentCode = getFileContents(fragmentFile);
@@ -27,46 +94,214 @@ Shader::Shader(const char* vertexFile, const char* fragmentFile, const char* com
 	GLuint vertexShader = glCreateShader(GL_VERTEX_SHADER);
 	glShaderSource(vertexShader, 1, &vertexSource, NULL);
 	glCompileShader(vertexShader);
+	checkCompileStatus(vertexShader, vertexFile);
 	// Create the fragment shader (manages pixels between the vertices)
 	GLuint fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 	glShaderSource(fragmentShader, 1, &fragmentSource, NULL);
 	glCompileShader(fragmentShader);
+	checkCompileStatus(fragmentShader, fragmentFile);
 
 	screenQuadShaderID = glCreateProgram();
 	glAttachShader(screenQuadShaderID, vertexShader);
 	glAttachShader(screenQuadShaderID, fragmentShader);
 	glLinkProgram(screenQuadShaderID);
+	checkLinkStatus(screenQuadShaderID, "screen quad program");
 
 	glDeleteShader(vertexShader);
 	glDeleteShader(fragmentShader);
 
 
 
-	// Setup compute shader program
-	std::string computeCode = getFileContents(computeFile);
-	const char* computeSource = computeCode.c_str();
-	// Setup the shaders so we can actually see objects
-	// Create the vertex shader (manages the vertices)
+	// Setup one compute program per wavefront stage from the same source
+	driverString = std::string((const char*)glGetString(GL_VENDOR)) + "|" + (const char*)glGetString(GL_RENDERER) + "|" + (const char*)glGetString(GL_VERSION);
+	if (!buildStages(stageShaderIDs)) {
+		std::cout << "Compute shaders failed to build, nothing will be traced" << std::endl;
+	}
+}
+
+Shader::~Shader() {
+	stopWatching = true;
+	if (watcher.joinable()) watcher.join();
+}
+
+/*
+* Builds every wavefront stage from the current contents of computeFile
+* Either all programs are returned or none, a failed build leaves programs at 0
+*/
+bool Shader::buildStages(GLuint (&programs)[NUM_WAVEFRONT_STAGES]) {
+	for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++) programs[i] = 0;
+
+	std::string computeCode;
+	try {
+		computeCode = getFileContents(computeFile.c_str());
+	}
+	catch (int) {
+		std::cout << "Failed to read compute shader: " << computeFile << std::endl;
+		return false;
+	}
+
+	for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++) {
+		programs[i] = createComputeProgram(computeCode, computeDefines + "#define " + stageNames[i] + "\n", stageNames[i]);
+		if (programs[i] == 0) {
+			for (int j = 0; j < i; j++) {
+				glDeleteProgram(programs[j]);
+				programs[j] = 0;
+			}
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+* Compiles a compute program with defines inserted right after the #version line, which has to stay first
+* Returns 0 if it fails to compile or link
+*/
+GLuint Shader::createComputeProgram(const std::string& source, const std::string& defines, const char* name) {
+	size_t versionEnd = source.find('\n', source.find("#version")) + 1;
+	std::string header = source.substr(0, versionEnd) + defines;
+	const char* computeSources[2] = { header.c_str(), source.c_str() + versionEnd };
+
+	char hashName[17];
+	std::snprintf(hashName, sizeof(hashName), "%016llx", (unsigned long long)hashString(source, hashString(header, hashString(driverString))));
+	std::string cacheFile = std::string(SHADER_CACHE_DIR) + "/" + hashName + ".bin";
+	GLuint program = loadProgramBinary(cacheFile);
+	if (program != 0) return program;
+
+	std::string programName = computeFile + " (" + name + ")";
 	GLuint computeShader = glCreateShader(GL_COMPUTE_SHADER);
-	glShaderSource(computeShader, 1, &computeSource, NULL);
+	glShaderSource(computeShader, 2, computeSources, NULL);
 	glCompileShader(computeShader);
+	if (!checkCompileStatus(computeShader, programName)) {
+		glDeleteShader(computeShader);
+		return 0;
+	}
 
-	compShaderID = glCreateProgram();
-	glAttachShader(compShaderID, computeShader);
-	glLinkProgram(compShaderID);
-
+	program = glCreateProgram();
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	glAttachShader(program, computeShader);
+	glLinkProgram(program);
 	glDeleteShader(computeShader);
+	if (!checkLinkStatus(program, programName)) {
+		glDeleteProgram(program);
+		return 0;
+	}
+
+	saveProgramBinary(program, cacheFile);
+	return program;
+}
+
+/*
+* Returns 0 if there is no cache file or the driver rejects the binary, e.g. after a driver update
+*/
+GLuint Shader::loadProgramBinary(const std::string& cacheFile) {
+	MappedFile file(cacheFile);
+	const ProgramCacheHeader* header = reinterpret_cast<const ProgramCacheHeader*>(file.data);
+	if (!file.isOpen() || file.size < sizeof(ProgramCacheHeader)
+		|| std::memcmp(header->magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC)) != 0
+		|| header->version != PROGRAM_CACHE_VERSION
+		|| file.size < sizeof(ProgramCacheHeader) + header->binaryLength) return 0;
+
+	GLuint program = glCreateProgram();
+	glProgramBinary(program, header->binaryFormat, file.data + sizeof(ProgramCacheHeader), header->binaryLength);
+	GLint status;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (status != GL_TRUE) {
+		glDeleteProgram(program);
+		return 0;
+	}
+	return program;
+}
+
+void Shader::saveProgramBinary(GLuint program, const std::string& cacheFile) {
+	GLint numFormats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &numFormats);
+	if (numFormats == 0) return;
+
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0) return;
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program, length, &length, &format, binary.data());
+
+	ProgramCacheHeader header;
+	std::memcpy(header.magic, PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+	header.version = PROGRAM_CACHE_VERSION;
+	header.binaryFormat = format;
+	header.binaryLength = (uint32_t)length;
+	header.pad = 0;
+
+	// Write to a temporary file first so an interrupted write never leaves a truncated binary behind
+	std::error_code error;
+	std::filesystem::create_directories(SHADER_CACHE_DIR, error);
+	std::string tempFile = cacheFile + ".tmp";
+	{
+		std::ofstream out(tempFile, std::ios::binary | std::ios::trunc);
+		if (!out) return;
+		out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		out.write(binary.data(), length);
+		if (!out) return;
+	}
+	std::filesystem::rename(tempFile, cacheFile, error);
+}
+
+/*
+* Polls the compute file's modification time from a background thread, the GL work is left to reloadIfChanged
+*/
+void Shader::watchComputeFile() {
+	if (watcher.joinable()) return;
+	watcher = std::thread([this]() {
+		std::error_code error;
+		std::filesystem::file_time_type lastWrite = std::filesystem::last_write_time(computeFile, error);
+		while (!stopWatching) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(250));
+			std::filesystem::file_time_type writeTime = std::filesystem::last_write_time(computeFile, error);
+			if (!error && writeTime != lastWrite) {
+				lastWrite = writeTime;
+				computeFileChanged = true;
+			}
+		}
+	});
+}
+
+/*
+* Rebuilds the stages after the watcher saw the compute file change, a failed build keeps the running programs
+*/
+bool Shader::reloadIfChanged() {
+	if (!computeFileChanged.exchange(false)) return false;
+
+	std::cout << "Reloading " << computeFile << std::endl;
+	GLuint programs[NUM_WAVEFRONT_STAGES];
+	if (!buildStages(programs)) {
+		std::cout << "Keeping the previous compute shaders" << std::endl;
+		return false;
+	}
+	for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++) {
+		glDeleteProgram(stageShaderIDs[i]);
+		stageShaderIDs[i] = programs[i];
+	}
+	return true;
+}
+
+bool Shader::setComputeDefines(const std::string& defines) {
+	if (defines == computeDefines) return false;
+	computeDefines = defines;
+	computeFileChanged = true;
+	return true;
 }
 
 void Shader::activateDefaultShader() {
 	glUseProgram(screenQuadShaderID);
 }
 
-void Shader::activateCompShader() {
-	glUseProgram(compShaderID);
+void Shader::activateStage(WavefrontStage stage) {
+	glUseProgram(stageShaderIDs[stage]);
 }
 
 void Shader::deleteShaders() {
+	stopWatching = true;
+	if (watcher.joinable()) watcher.join();
 	glDeleteProgram(screenQuadShaderID);
-	glDeleteProgram(compShaderID);
+	for (int i = 0; i < NUM_WAVEFRONT_STAGES; i++) glDeleteProgram(stageShaderIDs[i]);
 }
\ No newline at end of file
@@ -6,17 +6,65 @@
 #include <sstream>
 #include <iostream>
 #include <cerrno>
+#include <atomic>
+#include <thread>
 
 std::string getFileContents(const char* filename);
 
+// Stages of the wavefront path tracer, each one is raytracer.comp compiled with its STAGE_* define
+enum WavefrontStage {
+	STAGE_GENERATE,
+	STAGE_QUEUE,
+	STAGE_EXTEND,
+	STAGE_SHADE,
+	STAGE_MISS,
+	STAGE_ACCUMULATE,
+	STAGE_DENOISE_VARIANCE,	// Denoiser input, runs over the whole image after a finished frame
+	STAGE_DENOISE,			// One a-trous iteration
+	STAGE_RESOLVE,			// Tone maps the shown image into the window sized display target
+	NUM_WAVEFRONT_STAGES
+};
+
+/*
+	Screen quad program and one compute program per wavefront stage
+	- Compile and link errors are printed with the info log, failed programs are left at 0
+	- Linked compute programs are saved with glGetProgramBinary in SHADER_CACHE_DIR, keyed on a hash of the
+	  full source (defines included) and the driver string, a rejected or missing binary falls back on compiling
+	- watchComputeFile starts a thread that polls the compute file, reloadIfChanged then rebuilds every stage
+	  on the GL thread and only swaps the programs in once all of them linked
+*/
 class Shader {
 public:
 	GLuint screenQuadShaderID;
-	GLuint compShaderID;
-	Shader(const char* vertexFile, const char* fragmentFile, const char* computeFile);
+	GLuint stageShaderIDs[NUM_WAVEFRONT_STAGES];
+	// computeDefines is inserted ahead of every stage, e.g. the workgroup size
+	Shader(const char* vertexFile, const char* fragmentFile, const char* computeFile, const std::string& computeDefines = "");
+	~Shader();
 
 	void activateDefaultShader();
-	void activateCompShader();
+	void activateStage(WavefrontStage stage);
+
+	// Hot reload, uniform locations of the new programs have to be queried again when reloadIfChanged returns true
+	void watchComputeFile();
+	bool reloadIfChanged();
+	// Rebuilds the stages with new defines on the next reloadIfChanged, false if they are already in use
+	bool setComputeDefines(const std::string& defines);
 
 	void deleteShaders();
-};
\ No newline at end of file
+
+private:
+	const char* SHADER_CACHE_DIR = "shadercache";
+
+	bool buildStages(GLuint (&programs)[NUM_WAVEFRONT_STAGES]);
+	GLuint createComputeProgram(const std::string& source, const std::string& defines, const char* name);
+	GLuint loadProgramBinary(const std::string& cacheFile);
+	void saveProgramBinary(GLuint program, const std::string& cacheFile);
+
+	std::string computeFile;
+	std::string computeDefines;
+	std::string driverString;	// Vendor, renderer and version, a binary is only valid for the driver that produced it
+
+	std::thread watcher;
+	std::atomic<bool> stopWatching{ false };
+	std::atomic<bool> computeFileChanged{ false };
+};
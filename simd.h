@@ -0,0 +1,110 @@
+#pragma once
+
+/*
+	Thin wrapper over the widest float vector the build targets
+	- AVX2 (8 lanes) when compiled with /arch:AVX2 or -mavx2, SSE2 (4 lanes) on any x64 build, scalar otherwise
+	- vfloat holds SIMD_WIDTH floats, vmask holds the result of a lane-wise comparison
+	- Only what the CPU intersection kernels need is exposed
+*/
+
+#include <cmath>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define SIMD_WIDTH 8
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SIMD_WIDTH 4
+#else
+#define SIMD_WIDTH 1
+#endif
+
+#if SIMD_WIDTH == 8
+
+struct vmask { __m256 m; };
+struct vfloat {
+	__m256 v;
+	static vfloat load(const float* p) { return { _mm256_loadu_ps(p) }; }
+	static vfloat broadcast(float f) { return { _mm256_set1_ps(f) }; }
+	void store(float* p) const { _mm256_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return { _mm256_add_ps(a.v, b.v) }; }
+inline vfloat operator-(vfloat a, vfloat b) { return { _mm256_sub_ps(a.v, b.v) }; }
+inline vfloat operator*(vfloat a, vfloat b) { return { _mm256_mul_ps(a.v, b.v) }; }
+inline vfloat operator/(vfloat a, vfloat b) { return { _mm256_div_ps(a.v, b.v) }; }
+inline vfloat vmin(vfloat a, vfloat b) { return { _mm256_min_ps(a.v, b.v) }; }
+inline vfloat vmax(vfloat a, vfloat b) { return { _mm256_max_ps(a.v, b.v) }; }
+inline vfloat vsqrt(vfloat a) { return { _mm256_sqrt_ps(a.v) }; }
+inline vfloat vabs(vfloat a) { return { _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v) }; }
+
+inline vmask operator<(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ) }; }
+inline vmask operator<=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ) }; }
+inline vmask operator>(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ) }; }
+inline vmask operator>=(vfloat a, vfloat b) { return { _mm256_cmp_ps(a.v, b.v, _CMP_GE_OQ) }; }
+inline vmask operator&(vmask a, vmask b) { return { _mm256_and_ps(a.m, b.m) }; }
+inline vmask operator|(vmask a, vmask b) { return { _mm256_or_ps(a.m, b.m) }; }
+inline vmask andNot(vmask a, vmask b) { return { _mm256_andnot_ps(b.m, a.m) }; }	// a & ~b
+inline int movemask(vmask a) { return _mm256_movemask_ps(a.m); }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm256_blendv_ps(b.v, a.v, m.m) }; }
+
+#elif SIMD_WIDTH == 4
+
+struct vmask { __m128 m; };
+struct vfloat {
+	__m128 v;
+	static vfloat load(const float* p) { return { _mm_loadu_ps(p) }; }
+	static vfloat broadcast(float f) { return { _mm_set1_ps(f) }; }
+	void store(float* p) const { _mm_storeu_ps(p, v); }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return { _mm_add_ps(a.v, b.v) }; }
+inline vfloat operator-(vfloat a, vfloat b) { return { _mm_sub_ps(a.v, b.v) }; }
+inline vfloat operator*(vfloat a, vfloat b) { return { _mm_mul_ps(a.v, b.v) }; }
+inline vfloat operator/(vfloat a, vfloat b) { return { _mm_div_ps(a.v, b.v) }; }
+inline vfloat vmin(vfloat a, vfloat b) { return { _mm_min_ps(a.v, b.v) }; }
+inline vfloat vmax(vfloat a, vfloat b) { return { _mm_max_ps(a.v, b.v) }; }
+inline vfloat vsqrt(vfloat a) { return { _mm_sqrt_ps(a.v) }; }
+inline vfloat vabs(vfloat a) { return { _mm_andnot_ps(_mm_set1_ps(-0.0f), a.v) }; }
+
+inline vmask operator<(vfloat a, vfloat b) { return { _mm_cmplt_ps(a.v, b.v) }; }
+inline vmask operator<=(vfloat a, vfloat b) { return { _mm_cmple_ps(a.v, b.v) }; }
+inline vmask operator>(vfloat a, vfloat b) { return { _mm_cmpgt_ps(a.v, b.v) }; }
+inline vmask operator>=(vfloat a, vfloat b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+inline vmask operator&(vmask a, vmask b) { return { _mm_and_ps(a.m, b.m) }; }
+inline vmask operator|(vmask a, vmask b) { return { _mm_or_ps(a.m, b.m) }; }
+inline vmask andNot(vmask a, vmask b) { return { _mm_andnot_ps(b.m, a.m) }; }	// a & ~b
+inline int movemask(vmask a) { return _mm_movemask_ps(a.m); }
+// SSE2 has no blendv, fall back on and/andnot/or
+inline vfloat select(vmask m, vfloat a, vfloat b) { return { _mm_or_ps(_mm_and_ps(m.m, a.v), _mm_andnot_ps(m.m, b.v)) }; }
+
+#else
+
+struct vmask { bool m; };
+struct vfloat {
+	float v;
+	static vfloat load(const float* p) { return { *p }; }
+	static vfloat broadcast(float f) { return { f }; }
+	void store(float* p) const { *p = v; }
+};
+
+inline vfloat operator+(vfloat a, vfloat b) { return { a.v + b.v }; }
+inline vfloat operator-(vfloat a, vfloat b) { return { a.v - b.v }; }
+inline vfloat operator*(vfloat a, vfloat b) { return { a.v * b.v }; }
+inline vfloat operator/(vfloat a, vfloat b) { return { a.v / b.v }; }
+inline vfloat vmin(vfloat a, vfloat b) { return { (a.v < b.v) ? a.v : b.v }; }
+inline vfloat vmax(vfloat a, vfloat b) { return { (a.v > b.v) ? a.v : b.v }; }
+inline vfloat vsqrt(vfloat a) { return { std::sqrt(a.v) }; }
+inline vfloat vabs(vfloat a) { return { std::abs(a.v) }; }
+
+inline vmask operator<(vfloat a, vfloat b) { return { a.v < b.v }; }
+inline vmask operator<=(vfloat a, vfloat b) { return { a.v <= b.v }; }
+inline vmask operator>(vfloat a, vfloat b) { return { a.v > b.v }; }
+inline vmask operator>=(vfloat a, vfloat b) { return { a.v >= b.v }; }
+inline vmask operator&(vmask a, vmask b) { return { a.m && b.m }; }
+inline vmask operator|(vmask a, vmask b) { return { a.m || b.m }; }
+inline vmask andNot(vmask a, vmask b) { return { a.m && !b.m }; }	// a & ~b
+inline int movemask(vmask a) { return a.m ? 1 : 0; }
+inline vfloat select(vmask m, vfloat a, vfloat b) { return m.m ? a : b; }
+
+#endif
@@ -0,0 +1,125 @@
+#include "storagebuffer.h"
+
+#include <cstring>
+#include <iostream>
+
+StagingRing::StagingRing(GLsizeiptr segmentSize_, unsigned int numSegments_) :
+	segmentSize(segmentSize_), numSegments(std::min(std::max(numSegments_, 2u), MAX_SEGMENTS)) {
+	const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+	glCreateBuffers(1, &buffer);
+	glNamedBufferStorage(buffer, segmentSize * numSegments, nullptr, flags);
+	mapped = static_cast<unsigned char*>(glMapNamedBufferRange(buffer, 0, segmentSize * numSegments, flags));
+	if (mapped == nullptr) std::cout << "Failed to map the staging ring" << std::endl;
+}
+
+StagingRing::~StagingRing() {
+	for (unsigned int i = 0; i < numSegments; i++) {
+		if (fences[i] != nullptr) glDeleteSync(fences[i]);
+	}
+	if (mapped != nullptr) glUnmapNamedBuffer(buffer);
+	glDeleteBuffers(1, &buffer);
+}
+
+void StagingRing::upload(GLuint dst, GLintptr dstOffset, GLsizeiptr size, const void* data) {
+	const unsigned char* src = static_cast<const unsigned char*>(data);
+	// Without a mapping everything goes through the driver's own copy
+	if (mapped == nullptr) {
+		glNamedBufferSubData(dst, dstOffset, size, src);
+		return;
+	}
+
+	while (size > 0) {
+		if (head == segmentSize) nextSegment();
+		GLsizeiptr chunk = std::min(size, segmentSize - head);
+		GLintptr offset = segment * segmentSize + head;
+		// The mapping is coherent, the copy command sees the memcpy without a flush
+		std::memcpy(mapped + offset, src, (size_t)chunk);
+		glCopyNamedBufferSubData(buffer, dst, offset, dstOffset, chunk);
+
+		head += chunk;
+		src += chunk;
+		dstOffset += chunk;
+		size -= chunk;
+	}
+}
+
+void StagingRing::submit() {
+	if (head > 0) nextSegment();
+}
+
+/*
+* Fences the current segment and waits until the GPU has finished copying out of the next one
+* With three segments the wait only blocks when edits outrun the GPU by more than two frames
+*/
+void StagingRing::nextSegment() {
+	fences[segment] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	segment = (segment + 1) % numSegments;
+	head = 0;
+
+	if (fences[segment] != nullptr) {
+		GLenum status = glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000ull);
+		if (status == GL_TIMEOUT_EXPIRED || status == GL_WAIT_FAILED) glFinish();
+		glDeleteSync(fences[segment]);
+		fences[segment] = nullptr;
+	}
+}
+
+//========================================================
+
+/*
+* Ranges that overlap or touch the new one are merged into it, so the list stays sorted and disjoint
+*/
+void DirtyRanges::mark(size_t begin, size_t end) {
+	if (begin >= end) return;
+
+	// First range that does not end before begin, it and the ones after it up to end touch the new range
+	auto first = std::lower_bound(ranges.begin(), ranges.end(), begin,
+		[](const std::pair<size_t, size_t>& range, size_t value) { return range.second < value; });
+	auto last = first;
+	while (last != ranges.end() && last->first <= end) {
+		begin = std::min(begin, last->first);
+		end = std::max(end, last->second);
+		last++;
+	}
+	first = ranges.erase(first, last);
+	ranges.insert(first, std::make_pair(begin, end));
+
+	if (ranges.size() > MAX_RANGES) {
+		size_t closest = 0;
+		for (size_t i = 1; i + 1 < ranges.size(); i++) {
+			if (ranges[i + 1].first - ranges[i].second < ranges[closest + 1].first - ranges[closest].second) closest = i;
+		}
+		ranges[closest].second = ranges[closest + 1].second;
+		ranges.erase(ranges.begin() + closest + 1);
+	}
+}
+
+//========================================================
+
+/*
+* Capacity doubles so adding objects one at a time reallocates only log(n) times
+* Empty scenes still get a few bytes so the binding stays valid
+*/
+void StorageBuffer::reserve(GLsizeiptr size) {
+	if (id != 0 && size <= capacity) return;
+
+	GLsizeiptr newCapacity = std::max<GLsizeiptr>(capacity, 256);
+	while (newCapacity < size) newCapacity *= 2;
+
+	GLuint newId;
+	glCreateBuffers(1, &newId);
+	glNamedBufferStorage(newId, newCapacity, nullptr, 0);
+	if (id != 0) {
+		glCopyNamedBufferSubData(id, newId, 0, 0, capacity);
+		glDeleteBuffers(1, &id);
+	}
+	id = newId;
+	capacity = newCapacity;
+	glBindBufferBase(GL_SHADER_STORAGE_BUFFER, binding, id);
+}
+
+void StorageBuffer::release() {
+	if (id != 0) glDeleteBuffers(1, &id);
+	id = 0;
+	capacity = 0;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include <glad/glad.h>
+
+/*
+	Scene storage on the GPU and the path host edits take to get there
+	- StorageBuffer is an immutable glBufferStorage SSBO that grows by reallocating, the old contents are copied over on the GPU
+	- StagingRing is one persistently mapped, coherent buffer split into segments, writes are memcpy'd into the
+	  current segment and copied into the destination with glCopyNamedBufferSubData
+	- Every used segment is fenced when the ring moves on, a segment is only written again once its fence has signaled
+	  so edits never touch memory the GPU may still be copying from
+	- DirtyRanges tracks which elements of a host array changed since they were last uploaded
+*/
+
+// Changed elements as sorted, disjoint half open ranges, every range becomes one copy when uploaded
+// Past MAX_RANGES the two closest ranges are merged, which re-uploads the few unchanged elements between them
+struct DirtyRanges {
+	static const size_t MAX_RANGES = 16;
+	std::vector<std::pair<size_t, size_t>> ranges;
+
+	void mark(size_t begin, size_t end);
+	void mark(size_t idx) { mark(idx, idx + 1); }
+	bool empty() const { return ranges.empty(); }
+	void clear() { ranges.clear(); }
+};
+
+class StagingRing {
+public:
+	StagingRing(GLsizeiptr segmentSize_ = 1 << 20, unsigned int numSegments_ = 3);
+	~StagingRing();
+
+	StagingRing(const StagingRing&) = delete;
+	StagingRing& operator=(const StagingRing&) = delete;
+
+	// Copies size bytes of data into dst at dstOffset, uploads larger than a segment are split over several
+	void upload(GLuint dst, GLintptr dstOffset, GLsizeiptr size, const void* data);
+	// Fences the segment written since the last call, done once per frame after all the edits
+	void submit();
+
+private:
+	void nextSegment();
+
+	static const unsigned int MAX_SEGMENTS = 4;
+	const GLsizeiptr segmentSize;
+	const unsigned int numSegments;
+
+	GLuint buffer = 0;
+	unsigned char* mapped = nullptr;
+	GLsync fences[MAX_SEGMENTS] = {};
+	unsigned int segment = 0;
+	GLsizeiptr head = 0;	// Bytes of the current segment already handed out
+};
+
+class StorageBuffer {
+public:
+	// No GL calls happen until the first reserve, so scenes without a context can still hold one
+	StorageBuffer(GLuint binding_) : binding(binding_) {}
+
+	// Makes room for size bytes and keeps the buffer bound to binding, existing contents are preserved
+	void reserve(GLsizeiptr size);
+	// Uploads the elements of data inside dirty to offset + index * sizeof(T) and clears dirty
+	// The buffer always fits all of data, elements past its end (removed ones) are not uploaded
+	template <typename T>
+	void write(StagingRing& ring, const std::vector<T>& data, DirtyRanges& dirty, GLintptr offset = 0) {
+		reserve(offset + (GLsizeiptr)(data.size() * sizeof(T)));
+		for (const std::pair<size_t, size_t>& range : dirty.ranges) {
+			size_t last = std::min(range.second, data.size());
+			if (range.first < last) ring.upload(id, offset + (GLintptr)(range.first * sizeof(T)), (GLsizeiptr)((last - range.first) * sizeof(T)), data.data() + range.first);
+		}
+		dirty.clear();
+	}
+	void release();
+
+	const GLuint binding;
+	GLuint id = 0;
+	GLsizeiptr capacity = 0;
+};
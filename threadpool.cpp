@@ -0,0 +1,98 @@
+#include "threadpool.h"
+
+ThreadPool::ThreadPool(unsigned int numThreads) {
+	numWorkers = (numThreads == 0) ? std::thread::hardware_concurrency() : numThreads;
+	if (numWorkers == 0) numWorkers = 1;
+
+	for (unsigned int i = 0; i < numWorkers; i++) {
+		queues.push_back(std::make_unique<WorkQueue>());
+	}
+	// The last worker slot belongs to whichever thread calls parallelFor
+	for (unsigned int i = 0; i + 1 < numWorkers; i++) {
+		threads.emplace_back(&ThreadPool::workerLoop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> lock(batchMutex);
+		stopping = true;
+	}
+	batchStart.notify_all();
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+}
+
+void ThreadPool::parallelFor(unsigned int numJobs, const std::function<void(unsigned int)>& job) {
+	if (numJobs == 0) return;
+
+	{
+		std::lock_guard<std::mutex> lock(batchMutex);
+		// Hand out contiguous runs so neighbouring tiles start on the same core
+		unsigned int runLength = (numJobs + numWorkers - 1) / numWorkers;
+		for (unsigned int w = 0; w < numWorkers; w++) {
+			std::lock_guard<std::mutex> queueLock(queues[w]->mutex);
+			for (unsigned int i = w * runLength; i < std::min(numJobs, (w + 1) * runLength); i++) {
+				queues[w]->jobs.push_back(i);
+			}
+		}
+		batchJob = &job;
+		activeWorkers = numWorkers - 1;
+		batchID++;
+	}
+	batchStart.notify_all();
+
+	runJobs(numWorkers - 1);
+
+	// Every worker leaves runJobs only once all queues are empty and its own job has returned
+	std::unique_lock<std::mutex> lock(batchMutex);
+	batchDone.wait(lock, [this]() { return activeWorkers == 0; });
+	batchJob = nullptr;
+}
+
+void ThreadPool::workerLoop(unsigned int workerIdx) {
+	unsigned int lastBatch = 0;
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(batchMutex);
+			batchStart.wait(lock, [&]() { return stopping || batchID != lastBatch; });
+			if (stopping) return;
+			lastBatch = batchID;
+		}
+
+		runJobs(workerIdx);
+
+		std::lock_guard<std::mutex> lock(batchMutex);
+		if (--activeWorkers == 0) batchDone.notify_all();
+	}
+}
+
+void ThreadPool::runJobs(unsigned int workerIdx) {
+	unsigned int job;
+	while (popJob(workerIdx, job) || stealJob(workerIdx, job)) {
+		(*batchJob)(job);
+	}
+}
+
+bool ThreadPool::popJob(unsigned int workerIdx, unsigned int& job) {
+	WorkQueue& queue = *queues[workerIdx];
+	std::lock_guard<std::mutex> lock(queue.mutex);
+	if (queue.jobs.empty()) return false;
+	job = queue.jobs.back();
+	queue.jobs.pop_back();
+	return true;
+}
+
+bool ThreadPool::stealJob(unsigned int workerIdx, unsigned int& job) {
+	// Start with the next worker over so thieves don't all pile onto queue 0
+	for (unsigned int i = 1; i < numWorkers; i++) {
+		WorkQueue& victim = *queues[(workerIdx + i) % numWorkers];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (victim.jobs.empty()) continue;
+		job = victim.jobs.front();
+		victim.jobs.pop_front();
+		return true;
+	}
+	return false;
+}
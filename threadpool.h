@@ -0,0 +1,52 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/*
+	Small work-stealing thread pool used by the CPU renderer
+	- Every worker owns a deque of job indices, the jobs of a batch are split into contiguous runs per worker
+	- A worker pops from the back of its own deque and steals from the front of the others once it runs dry
+	- The calling thread takes part in the batch as the last worker so parallelFor never idles a core
+*/
+class ThreadPool {
+public:
+	// numThreads = 0 uses every hardware thread
+	ThreadPool(unsigned int numThreads = 0);
+	~ThreadPool();
+
+	// Runs job(i) for every i in [0, numJobs) and blocks until all of them have finished
+	void parallelFor(unsigned int numJobs, const std::function<void(unsigned int)>& job);
+
+	unsigned int size() const { return numWorkers; }
+
+private:
+	struct WorkQueue {
+		std::mutex mutex;
+		std::deque<unsigned int> jobs;
+	};
+
+	void workerLoop(unsigned int workerIdx);
+	void runJobs(unsigned int workerIdx);
+	bool popJob(unsigned int workerIdx, unsigned int& job);
+	bool stealJob(unsigned int workerIdx, unsigned int& job);
+
+	unsigned int numWorkers;
+	std::vector<std::thread> threads;
+	std::vector<std::unique_ptr<WorkQueue>> queues;
+
+	// Current batch state
+	std::mutex batchMutex;
+	std::condition_variable batchStart;
+	std::condition_variable batchDone;
+	const std::function<void(unsigned int)>* batchJob = nullptr;
+	unsigned int batchID = 0;
+	unsigned int activeWorkers = 0;
+	bool stopping = false;
+};
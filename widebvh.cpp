@@ -0,0 +1,325 @@
+#include "widebvh.h"
+
+#include <algorithm>
+#include <cmath>
+
+#define EPSILON 0.0001f
+#define MISS_DIST 1e30f
+
+// Children are never at index 0, so an empty root leaf (primCount 0) is still told apart from an interior node
+static bool isLeaf(const BVHNode& node) {
+	return node.primCount > 0 || node.leftFirst == 0;
+}
+
+void WideBVH::build(const BVH& bvh_, const std::vector<Sphere>& spheres_, const std::vector<Triangle>& triangles_, const std::vector<Quad>& quads_) {
+	bvh = &bvh_;
+	spheres = &spheres_;
+	triangles = &triangles_;
+	quads = &quads_;
+
+	nodes.clear();
+	leaves.clear();
+	sphereBlocks.clear();
+	triangleBlocks.clear();
+
+#if WIDE_BVH_AVAILABLE
+	subtreeFirst.assign(bvh->nodes.size(), 0);
+	subtreeCount.assign(bvh->nodes.size(), 0);
+	countPrims(0);
+	// The root is always an interior node, even when the whole binary tree is a single leaf
+	collapse(0);
+#endif
+
+	subtreeFirst.clear();
+	subtreeCount.clear();
+	bvh = nullptr;
+	spheres = nullptr;
+	triangles = nullptr;
+	quads = nullptr;
+}
+
+// Children of a binary node always cover a contiguous run of primRefs
+void WideBVH::countPrims(unsigned int binIdx) {
+	const BVHNode& node = bvh->nodes[binIdx];
+	if (isLeaf(node)) {
+		subtreeFirst[binIdx] = node.leftFirst;
+		subtreeCount[binIdx] = node.primCount;
+		return;
+	}
+	unsigned int left = node.leftFirst;
+	countPrims(left);
+	countPrims(left + 1);
+	subtreeFirst[binIdx] = subtreeFirst[left];
+	subtreeCount[binIdx] = subtreeCount[left] + subtreeCount[left + 1];
+}
+
+// Pulls grandchildren up into this node, always opening the child with the largest surface area, until it has SIMD_WIDTH children
+int WideBVH::collapse(unsigned int binIdx) {
+	std::vector<unsigned int> children = { binIdx };
+	auto canOpen = [&](unsigned int idx) {
+		return !isLeaf(bvh->nodes[idx]) && (idx == binIdx || subtreeCount[idx] > MAX_LEAF_PRIMS);
+	};
+	while (children.size() < SIMD_WIDTH) {
+		int best = -1;
+		float bestArea = -1.0f;
+		for (unsigned int i = 0; i < children.size(); i++) {
+			if (!canOpen(children[i])) continue;
+			const BVHNode& node = bvh->nodes[children[i]];
+			AABB box;
+			box.grow(node.bboxMin);
+			box.grow(node.bboxMax);
+			if (box.area() > bestArea) {
+				bestArea = box.area();
+				best = i;
+			}
+		}
+		if (best < 0) break;
+		unsigned int left = bvh->nodes[children[best]].leftFirst;
+		children[best] = left;
+		children.push_back(left + 1);
+	}
+
+	int nodeIdx = (int)nodes.size();
+	nodes.emplace_back();
+	std::vector<int> codes(children.size());
+	for (unsigned int i = 0; i < children.size(); i++) {
+		unsigned int c = children[i];
+		bool leaf = isLeaf(bvh->nodes[c]) || subtreeCount[c] <= MAX_LEAF_PRIMS;
+		codes[i] = leaf ? makeLeaf(c) : collapse(c);
+	}
+
+	// Filled in after the recursion since it can reallocate nodes
+	WideBVHNode& node = nodes[nodeIdx];
+	node.numChildren = (int)children.size();
+	for (int i = 0; i < SIMD_WIDTH; i++) {
+		bool used = i < node.numChildren;
+		glm::vec3 bmin = used ? bvh->nodes[children[i]].bboxMin : glm::vec3(MISS_DIST);
+		glm::vec3 bmax = used ? bvh->nodes[children[i]].bboxMax : glm::vec3(-MISS_DIST);
+		node.bminX[i] = bmin.x; node.bminY[i] = bmin.y; node.bminZ[i] = bmin.z;
+		node.bmaxX[i] = bmax.x; node.bmaxY[i] = bmax.y; node.bmaxZ[i] = bmax.z;
+		node.child[i] = used ? codes[i] : -1;
+	}
+	return nodeIdx;
+}
+
+// Packs every primitive under a binary node into SoA blocks
+int WideBVH::makeLeaf(unsigned int binIdx) {
+	WideBVHLeaf leaf;
+	leaf.firstSphereBlock = (unsigned int)sphereBlocks.size();
+	leaf.firstTriangleBlock = (unsigned int)triangleBlocks.size();
+	unsigned int numSpheres = 0, numTriangles = 0;
+
+	auto addTriangle = [&](const glm::vec3& p0, const glm::vec3& p1, const glm::vec3& p2, unsigned int prim) {
+		unsigned int lane = numTriangles++ % SIMD_WIDTH;
+		if (lane == 0) {
+			TriangleBlock block = {};
+			for (int i = 0; i < SIMD_WIDTH; i++) block.prim[i] = prim;
+			triangleBlocks.push_back(block);
+		}
+		TriangleBlock& block = triangleBlocks.back();
+		glm::vec3 e1 = p1 - p0;
+		glm::vec3 e2 = p2 - p0;
+		block.p0X[lane] = p0.x; block.p0Y[lane] = p0.y; block.p0Z[lane] = p0.z;
+		block.e1X[lane] = e1.x; block.e1Y[lane] = e1.y; block.e1Z[lane] = e1.z;
+		block.e2X[lane] = e2.x; block.e2Y[lane] = e2.y; block.e2Z[lane] = e2.z;
+		block.prim[lane] = prim;
+	};
+
+	for (unsigned int i = 0; i < subtreeCount[binIdx]; i++) {
+		unsigned int primRef = bvh->primRefs[subtreeFirst[binIdx] + i];
+		unsigned int type = primRef >> PRIM_TYPE_SHIFT;
+		unsigned int index = primRef & PRIM_INDEX_MASK;
+		if (type == PRIM_SPHERE) {
+			unsigned int lane = numSpheres++ % SIMD_WIDTH;
+			if (lane == 0) {
+				SphereBlock block = {};
+				for (int j = 0; j < SIMD_WIDTH; j++) block.prim[j] = primRef;
+				sphereBlocks.push_back(block);
+			}
+			SphereBlock& block = sphereBlocks.back();
+			const glm::vec4& posRad = (*spheres)[index].posRad;
+			block.posX[lane] = posRad.x; block.posY[lane] = posRad.y; block.posZ[lane] = posRad.z;
+			block.rad[lane] = posRad.w;
+			block.prim[lane] = primRef;
+		}
+		else if (type == PRIM_TRIANGLE) {
+			const Triangle& tri = (*triangles)[index];
+			addTriangle(tri.p0, tri.p1, tri.p2, primRef);
+		}
+		else {
+			// Same split as intersectQuad
+			const Quad& quad = (*quads)[index];
+			addTriangle(quad.c00, quad.c10, quad.c11, primRef);
+			addTriangle(quad.c00, quad.c11, quad.c01, primRef);
+		}
+	}
+
+	leaf.numSphereBlocks = (unsigned int)sphereBlocks.size() - leaf.firstSphereBlock;
+	leaf.numTriangleBlocks = (unsigned int)triangleBlocks.size() - leaf.firstTriangleBlock;
+	leaves.push_back(leaf);
+	return ~(int)(leaves.size() - 1);
+}
+
+// Picks the closest lane in mask, ties go to the lowest lane like the sequential loop
+static int closestLane(int mask, vfloat t, float& tOut) {
+	float ts[SIMD_WIDTH];
+	t.store(ts);
+	int best = -1;
+	for (int i = 0; i < SIMD_WIDTH; i++) {
+		if (!(mask & (1 << i))) continue;
+		if (best < 0 || ts[i] < ts[best]) best = i;
+	}
+	if (best >= 0) tOut = ts[best];
+	return best;
+}
+
+bool WideBVH::intersectSpheres(const SphereBlock& block, const Ray& ray, Hit& hit, bool hitBackface) const {
+	vfloat dx = vfloat::broadcast(ray.dir.x), dy = vfloat::broadcast(ray.dir.y), dz = vfloat::broadcast(ray.dir.z);
+	vfloat zero = vfloat::broadcast(0.0f);
+	vfloat rad = vfloat::load(block.rad);
+
+	float aScalar = glm::dot(ray.dir, ray.dir);
+	vfloat a = vfloat::broadcast(aScalar);
+	vfloat sx = vfloat::broadcast(ray.pos.x) - vfloat::load(block.posX);
+	vfloat sy = vfloat::broadcast(ray.pos.y) - vfloat::load(block.posY);
+	vfloat sz = vfloat::broadcast(ray.pos.z) - vfloat::load(block.posZ);
+	vfloat b = vfloat::broadcast(2.0f) * (sx * dx + sy * dy + sz * dz);
+	vfloat c = (sx * sx + sy * sy + sz * sz) - rad * rad;
+	vfloat disc = b * b - vfloat::broadcast(4.0f) * a * c;
+	vmask valid = (disc > zero) & (rad > zero);
+	if (!movemask(valid)) return false;
+
+	vfloat sq = vsqrt(vmax(disc, zero));
+	vfloat twoA = vfloat::broadcast(2.0f * aScalar);
+	vfloat tNear = (zero - b - sq) / twoA;
+	vfloat tFar = (zero - b + sq) / twoA;
+	// Inside the sphere only the far root counts, and only if backfaces are wanted
+	vmask inside = tNear <= zero;
+	vfloat t = select(inside, tFar, tNear);
+	valid = valid & (t > zero) & (t < vfloat::broadcast(hit.t));
+	if (!hitBackface) valid = andNot(valid, inside);
+
+	float tHit;
+	int lane = closestLane(movemask(valid), t, tHit);
+	if (lane < 0) return false;
+
+	int insideMask = movemask(inside);
+	bool backface = (insideMask & (1 << lane)) != 0;
+	glm::vec3 pos(block.posX[lane], block.posY[lane], block.posZ[lane]);
+	glm::vec3 normal = glm::normalize((ray.pos + tHit * ray.dir) - pos);
+	hit.t = tHit;
+	hit.normal = backface ? -normal : normal;
+	hit.prim = block.prim[lane];
+	hit.backface = backface;
+	return true;
+}
+
+// Moller-Trumbore on SIMD_WIDTH triangles at once
+bool WideBVH::intersectTriangles(const TriangleBlock& block, const Ray& ray, Hit& hit, bool hitBackface) const {
+	vfloat dx = vfloat::broadcast(ray.dir.x), dy = vfloat::broadcast(ray.dir.y), dz = vfloat::broadcast(ray.dir.z);
+	vfloat zero = vfloat::broadcast(0.0f);
+	vfloat one = vfloat::broadcast(1.0f);
+	vfloat e1x = vfloat::load(block.e1X), e1y = vfloat::load(block.e1Y), e1z = vfloat::load(block.e1Z);
+	vfloat e2x = vfloat::load(block.e2X), e2y = vfloat::load(block.e2Y), e2z = vfloat::load(block.e2Z);
+
+	vfloat hx = dy * e2z - dz * e2y;
+	vfloat hy = dz * e2x - dx * e2z;
+	vfloat hz = dx * e2y - dy * e2x;
+	vfloat a = e1x * hx + e1y * hy + e1z * hz;
+	vmask valid = vabs(a) >= vfloat::broadcast(EPSILON);
+	if (!movemask(valid)) return false;
+
+	vfloat f = one / a;
+	vfloat sx = vfloat::broadcast(ray.pos.x) - vfloat::load(block.p0X);
+	vfloat sy = vfloat::broadcast(ray.pos.y) - vfloat::load(block.p0Y);
+	vfloat sz = vfloat::broadcast(ray.pos.z) - vfloat::load(block.p0Z);
+	vfloat u = f * (sx * hx + sy * hy + sz * hz);
+	valid = valid & (u >= zero) & (u <= one);
+	vfloat qx = sy * e1z - sz * e1y;
+	vfloat qy = sz * e1x - sx * e1z;
+	vfloat qz = sx * e1y - sy * e1x;
+	vfloat v = f * (dx * qx + dy * qy + dz * qz);
+	valid = valid & (v >= zero) & (u + v <= one);
+	vfloat t = f * (e2x * qx + e2y * qy + e2z * qz);
+	valid = valid & (t > zero) & (t < vfloat::broadcast(hit.t));
+	// a = dot(dir, cross(edge2, edge1)), positive when the ray hits the back of the triangle
+	vmask back = a > zero;
+	if (!hitBackface) valid = andNot(valid, back);
+
+	float tHit;
+	int lane = closestLane(movemask(valid), t, tHit);
+	if (lane < 0) return false;
+
+	bool backface = (movemask(back) & (1 << lane)) != 0;
+	glm::vec3 edge1(block.e1X[lane], block.e1Y[lane], block.e1Z[lane]);
+	glm::vec3 edge2(block.e2X[lane], block.e2Y[lane], block.e2Z[lane]);
+	glm::vec3 normal = glm::normalize(glm::cross(edge2, edge1));
+	hit.t = tHit;
+	hit.normal = backface ? -normal : normal;
+	hit.prim = block.prim[lane];
+	hit.backface = backface;
+	return true;
+}
+
+// Front to back traversal, hit children are pushed far to near so the nearest one is popped next
+bool WideBVH::intersect(const Ray& ray, Hit& hit, bool hitBackface) const {
+	bool intersect = false;
+	if (nodes.empty()) return false;
+
+	glm::vec3 invDir = 1.0f / ray.dir;
+	vfloat ox = vfloat::broadcast(ray.pos.x), oy = vfloat::broadcast(ray.pos.y), oz = vfloat::broadcast(ray.pos.z);
+	vfloat ix = vfloat::broadcast(invDir.x), iy = vfloat::broadcast(invDir.y), iz = vfloat::broadcast(invDir.z);
+	vfloat zero = vfloat::broadcast(0.0f);
+
+	int stack[STACK_SIZE];
+	float stackDist[STACK_SIZE];
+	int stackPtr = 0;
+	stack[stackPtr] = 0;
+	stackDist[stackPtr++] = 0.0f;
+
+	while (stackPtr > 0) {
+		stackPtr--;
+		int code = stack[stackPtr];
+		// The closest hit may have moved in front of this entry since it was pushed
+		if (stackDist[stackPtr] >= hit.t) continue;
+
+		if (code < 0) {
+			const WideBVHLeaf& leaf = leaves[~code];
+			for (unsigned int i = 0; i < leaf.numSphereBlocks; i++) {
+				intersect = intersectSpheres(sphereBlocks[leaf.firstSphereBlock + i], ray, hit, hitBackface) || intersect;
+			}
+			for (unsigned int i = 0; i < leaf.numTriangleBlocks; i++) {
+				intersect = intersectTriangles(triangleBlocks[leaf.firstTriangleBlock + i], ray, hit, hitBackface) || intersect;
+			}
+			continue;
+		}
+
+		const WideBVHNode& node = nodes[code];
+		vfloat t0x = (vfloat::load(node.bminX) - ox) * ix, t1x = (vfloat::load(node.bmaxX) - ox) * ix;
+		vfloat t0y = (vfloat::load(node.bminY) - oy) * iy, t1y = (vfloat::load(node.bmaxY) - oy) * iy;
+		vfloat t0z = (vfloat::load(node.bminZ) - oz) * iz, t1z = (vfloat::load(node.bmaxZ) - oz) * iz;
+		vfloat tEnter = vmax(vmax(vmin(t0x, t1x), vmin(t0y, t1y)), vmin(t0z, t1z));
+		vfloat tExit = vmin(vmin(vmax(t0x, t1x), vmax(t0y, t1y)), vmax(t0z, t1z));
+		vmask boxHit = (tExit >= vmax(tEnter, zero)) & (tEnter < vfloat::broadcast(hit.t));
+		int mask = movemask(boxHit) & ((1 << node.numChildren) - 1);
+		if (!mask) continue;
+
+		float dists[SIMD_WIDTH];
+		tEnter.store(dists);
+		// Insertion sort of the hit children by descending distance straight onto the stack
+		int base = stackPtr;
+		for (int i = 0; i < node.numChildren; i++) {
+			if (!(mask & (1 << i))) continue;
+			int j = stackPtr++;
+			while (j > base && stackDist[j - 1] < dists[i]) {
+				stack[j] = stack[j - 1];
+				stackDist[j] = stackDist[j - 1];
+				j--;
+			}
+			stack[j] = node.child[i];
+			stackDist[j] = dists[i];
+		}
+	}
+
+	return intersect;
+}
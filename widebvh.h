@@ -0,0 +1,81 @@
+#pragma once
+
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#include "object.h"
+#include "bvh.h"
+#include "ray.h"
+#include "simd.h"
+
+/*
+	SIMD_WIDTH-ary BVH used by the CPU renderer
+	- Collapsed from the binary SAH BVH, so both trees hold exactly the same primitives
+	- Child bounds and leaf primitives are stored as structure of arrays so one ray is tested against SIMD_WIDTH boxes/primitives at once
+	- Quads are split into the same two triangles intersectQuad uses and keep the quad's primRef
+	- The intersection math mirrors intersectSphere/intersectTriangle so the result is identical to the scalar traversal
+	- Only available when the build has a vector ISA (SIMD_WIDTH > 1), otherwise the CPU renderer keeps the scalar BVH
+*/
+
+#define WIDE_BVH_AVAILABLE (SIMD_WIDTH > 1)
+
+struct WideBVHNode {
+	float bminX[SIMD_WIDTH], bminY[SIMD_WIDTH], bminZ[SIMD_WIDTH];
+	float bmaxX[SIMD_WIDTH], bmaxY[SIMD_WIDTH], bmaxZ[SIMD_WIDTH];
+	int child[SIMD_WIDTH];	// >= 0: index of an interior node, < 0: ~index into leaves
+	int numChildren;
+};
+
+struct WideBVHLeaf {
+	unsigned int firstSphereBlock, numSphereBlocks;
+	unsigned int firstTriangleBlock, numTriangleBlocks;
+};
+
+// Unused lanes have a radius of 0 and are masked out
+struct SphereBlock {
+	float posX[SIMD_WIDTH], posY[SIMD_WIDTH], posZ[SIMD_WIDTH], rad[SIMD_WIDTH];
+	unsigned int prim[SIMD_WIDTH];
+};
+
+// Unused lanes have zero edges which the parallel ray check always rejects
+struct TriangleBlock {
+	float p0X[SIMD_WIDTH], p0Y[SIMD_WIDTH], p0Z[SIMD_WIDTH];
+	float e1X[SIMD_WIDTH], e1Y[SIMD_WIDTH], e1Z[SIMD_WIDTH];
+	float e2X[SIMD_WIDTH], e2Y[SIMD_WIDTH], e2Z[SIMD_WIDTH];
+	unsigned int prim[SIMD_WIDTH];
+};
+
+class WideBVH {
+public:
+	void build(const BVH& bvh, const std::vector<Sphere>& spheres, const std::vector<Triangle>& triangles, const std::vector<Quad>& quads);
+
+	// Same contract as CPUTracer::intersectObjects
+	bool intersect(const Ray& ray, Hit& hit, bool hitBackface) const;
+
+	std::vector<WideBVHNode> nodes;
+	std::vector<WideBVHLeaf> leaves;
+	std::vector<SphereBlock> sphereBlocks;
+	std::vector<TriangleBlock> triangleBlocks;
+
+private:
+	// Subtrees with at most this many primitives become a single leaf
+	static const unsigned int MAX_LEAF_PRIMS = SIMD_WIDTH;
+	// Every popped node can push up to SIMD_WIDTH - 1 more entries than it removes
+	static const int STACK_SIZE = 64 * SIMD_WIDTH;
+
+	int collapse(unsigned int binIdx);
+	int makeLeaf(unsigned int binIdx);
+	void countPrims(unsigned int binIdx);
+
+	bool intersectSpheres(const SphereBlock& block, const Ray& ray, Hit& hit, bool hitBackface) const;
+	bool intersectTriangles(const TriangleBlock& block, const Ray& ray, Hit& hit, bool hitBackface) const;
+
+	// Only valid during build
+	const BVH* bvh = nullptr;
+	const std::vector<Sphere>* spheres = nullptr;
+	const std::vector<Triangle>* triangles = nullptr;
+	const std::vector<Quad>* quads = nullptr;
+	// First primRef and primitive count under every binary node
+	std::vector<unsigned int> subtreeFirst, subtreeCount;
+};